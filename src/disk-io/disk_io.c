@@ -0,0 +1,288 @@
+#include "disk_io.h"
+#include "../log/log.h"
+#include "../piece-request/piece_request.h"
+#include "../reactor/reactor.h"
+#include "../storage/storage.h"
+#include "../uring/uring.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+
+disk_device_t disk_devices[DISK_IO_MAX_DEVICES];
+size_t num_disk_devices = 0;
+pthread_mutex_t disk_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *disk_blocks[DISK_IO_BLOCK_POOL];
+size_t num_disk_blocks = 0;
+pthread_mutex_t disk_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Runs the job on the calling thread
+int disk_io_run(const disk_job_t *job) {
+  return job->op == DISK_OP_READ
+             ? storage_read(job->torrent, job->offset, job->buf, job->len)
+             : storage_write(job->torrent, job->offset, job->buf, job->len);
+}
+
+// Issues the spans of all jobs through the ring with one io_uring_enter()
+// and puts their results in `rets`. Jobs whose spans do not fit the ring or
+// that came back short run again with plain storage calls. Fails if the ring
+// does not work, the jobs are still run.
+int disk_io_run_batch(uring_t *ring, const disk_job_t *jobs, int *rets,
+                      size_t n) {
+  storage_span_t spans[URING_ENTRIES];
+  size_t span_jobs[URING_ENTRIES];
+  size_t num_spans = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    const disk_job_t *job = &jobs[i];
+    int count = storage_fd_spans(job->torrent, job->offset, job->len, job->buf,
+                                 spans + num_spans, URING_ENTRIES - num_spans);
+    rets[i] = count < 0 ? -1 : 0;
+    for (int j = 0; j < count; j++, num_spans++) {
+      struct io_uring_sqe *sqe = uring_sqe(ring);
+      sqe->opcode = job->op == DISK_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+      sqe->fd = spans[num_spans].fd;
+      sqe->addr = (uint64_t)(uintptr_t)spans[num_spans].buf;
+      sqe->len = spans[num_spans].len;
+      sqe->off = spans[num_spans].offset;
+      sqe->user_data = num_spans;
+      span_jobs[num_spans] = i;
+    }
+  }
+
+  int ret = 0;
+  if (num_spans > 0 && uring_submit(ring, num_spans) < 0) {
+    for (size_t i = 0; i < n; i++) {
+      rets[i] = -1;
+    }
+    ret = -1;
+  }
+
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_cqe(ring))) {
+    size_t span = cqe->user_data;
+    if (cqe->res < 0 || (size_t)cqe->res != spans[span].len) {
+      rets[span_jobs[span]] = -1;
+    }
+    uring_seen(ring);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (rets[i] < 0) {
+      rets[i] = disk_io_run(&jobs[i]);
+    }
+  }
+
+  return ret;
+}
+
+// Takes up to `max` jobs off the queue, waiting for the first one
+size_t disk_io_take(disk_device_t *d, disk_job_t *jobs, size_t max) {
+  pthread_mutex_lock(&d->lock);
+  while (d->len == 0) {
+    pthread_cond_wait(&d->not_empty, &d->lock);
+  }
+
+  size_t n = 0;
+  while (d->len > 0 && n < max) {
+    jobs[n++] = d->jobs[d->head];
+    d->head = (d->head + 1) % DISK_IO_QUEUE_LEN;
+    d->len--;
+  }
+  pthread_cond_broadcast(&d->not_full);
+  pthread_mutex_unlock(&d->lock);
+
+  return n;
+}
+
+// Counts finished jobs off the bytes queued on the device
+void disk_io_finished(disk_device_t *d, const disk_job_t *jobs, size_t n) {
+  pthread_mutex_lock(&d->lock);
+  for (size_t i = 0; i < n; i++) {
+    d->queued -= jobs[i].len;
+  }
+  bool drained = d->congested && d->queued < DISK_IO_LOW_WATER &&
+                 d->len < DISK_IO_QUEUE_LEN / 4;
+  if (drained) {
+    __atomic_store_n(&d->congested, false, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  // Connections held back their requests while we were behind
+  if (drained) {
+    reactor_pool_notify();
+  }
+}
+
+void *disk_io_worker(void *arg) {
+  disk_device_t *d = arg;
+  disk_job_t jobs[DISK_IO_URING_BATCH];
+  int rets[DISK_IO_URING_BATCH];
+
+  // Only backends reading and writing file descriptors go through a ring,
+  // the others are memory copies
+  uring_t ring;
+  bool use_ring = uring_enabled() && storage_backend()->fd_io &&
+                  uring_init(&ring, URING_ENTRIES) == 0;
+
+  while (true) {
+    size_t n = disk_io_take(d, jobs, use_ring ? DISK_IO_URING_BATCH : 1);
+    if (use_ring && disk_io_run_batch(&ring, jobs, rets, n) < 0) {
+      log_printf(LOG_WARNING, "Disk thread stops using io_uring\n");
+      use_ring = false;
+    } else if (!use_ring) {
+      rets[0] = disk_io_run(&jobs[0]);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      jobs[i].done(&jobs[i], rets[i]);
+    }
+    disk_io_finished(d, jobs, n);
+  }
+
+  return NULL;
+}
+
+// Called with disk_devices_lock held
+int disk_io_device(dev_t dev) {
+  for (size_t i = 0; i < num_disk_devices; i++) {
+    if (disk_devices[i].dev == dev) {
+      return i;
+    }
+  }
+
+  if (num_disk_devices == DISK_IO_MAX_DEVICES) {
+    return -1;
+  }
+
+  disk_device_t *d = &disk_devices[num_disk_devices];
+  d->dev = dev;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->not_empty, NULL);
+  pthread_cond_init(&d->not_full, NULL);
+  d->head = 0;
+  d->len = 0;
+  d->queued = 0;
+  d->congested = false;
+  d->num_threads = 0;
+
+  for (size_t i = 0; i < DISK_IO_THREADS_PER_DEVICE; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, disk_io_worker, d) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    d->num_threads++;
+  }
+
+  if (d->num_threads == 0) {
+    return -1;
+  }
+
+  return num_disk_devices++;
+}
+
+int disk_io_add_torrent(metainfo_t *torrent) {
+  uint8_t *file_devices = malloc(torrent->info.files_count);
+  if (!file_devices) {
+    return -1;
+  }
+
+  uint32_t devices = 0;
+  pthread_mutex_lock(&disk_devices_lock);
+  for (size_t i = 0; i < torrent->info.files_count; i++) {
+    struct stat st;
+    dev_t dev = dl_file_stat(torrent->files[i], &st) == 0 ? st.st_dev : 0;
+    int device = disk_io_device(dev);
+    if (device < 0) {
+      pthread_mutex_unlock(&disk_devices_lock);
+      free(file_devices);
+      return -1;
+    }
+
+    file_devices[i] = device;
+    devices |= 1u << device;
+  }
+  pthread_mutex_unlock(&disk_devices_lock);
+
+  log_printf(LOG_INFO, "Files of %s are on %d devices\n", torrent->info.name,
+             __builtin_popcount(devices));
+  torrent->disk_devices = devices;
+  torrent->file_devices = file_devices;
+  return 0;
+}
+
+// A job spanning files is queued on the device of its first byte. Returns
+// false if the queue is full and the caller does not `wait`.
+bool disk_io_queue(const disk_job_t *job, bool wait) {
+  size_t file = piece_request_file_at(job->torrent, job->offset);
+  disk_device_t *d = &disk_devices[job->torrent->file_devices[file]];
+
+  pthread_mutex_lock(&d->lock);
+  while (d->len == DISK_IO_QUEUE_LEN) {
+    if (!wait) {
+      pthread_mutex_unlock(&d->lock);
+      return false;
+    }
+    pthread_cond_wait(&d->not_full, &d->lock);
+  }
+  d->jobs[(d->head + d->len) % DISK_IO_QUEUE_LEN] = *job;
+  d->len++;
+  d->queued += job->len;
+  if (d->queued >= DISK_IO_HIGH_WATER || d->len > DISK_IO_QUEUE_LEN / 2) {
+    __atomic_store_n(&d->congested, true, __ATOMIC_RELEASE);
+  }
+  pthread_cond_signal(&d->not_empty);
+  pthread_mutex_unlock(&d->lock);
+
+  return true;
+}
+
+void disk_io_submit(const disk_job_t *job) {
+  if (!job->torrent->file_devices) {
+    job->done(job, disk_io_run(job));
+    return;
+  }
+
+  disk_io_queue(job, true);
+}
+
+void disk_io_submit_nowait(const disk_job_t *job) {
+  if (!job->torrent->file_devices || !disk_io_queue(job, false)) {
+    job->done(job, disk_io_run(job));
+  }
+}
+
+void *disk_io_block_get(void) {
+  void *block = NULL;
+  pthread_mutex_lock(&disk_blocks_lock);
+  if (num_disk_blocks > 0) {
+    block = disk_blocks[--num_disk_blocks];
+  }
+  pthread_mutex_unlock(&disk_blocks_lock);
+
+  return block ? block : malloc(DISK_IO_BLOCK_SIZE);
+}
+
+void disk_io_block_put(void *block) {
+  pthread_mutex_lock(&disk_blocks_lock);
+  if (num_disk_blocks < DISK_IO_BLOCK_POOL) {
+    disk_blocks[num_disk_blocks++] = block;
+    block = NULL;
+  }
+  pthread_mutex_unlock(&disk_blocks_lock);
+
+  free(block);
+}
+
+bool disk_io_congested(const metainfo_t *torrent) {
+  uint32_t devices = torrent->disk_devices;
+  while (devices) {
+    int i = __builtin_ctz(devices);
+    if (__atomic_load_n(&disk_devices[i].congested, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+    devices &= devices - 1;
+  }
+
+  return false;
+}
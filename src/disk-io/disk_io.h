@@ -0,0 +1,81 @@
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include "../file-parser/file-parser.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DISK_IO_MAX_DEVICES 16
+#define DISK_IO_THREADS_PER_DEVICE 2
+#define DISK_IO_QUEUE_LEN 256
+// Jobs a disk thread with an io_uring takes off its queue and submits at once
+#define DISK_IO_URING_BATCH 16
+// A device with this many bytes queued holds back new block requests until
+// it is down to DISK_IO_LOW_WATER again
+#define DISK_IO_HIGH_WATER (32 * 1024 * 1024)
+#define DISK_IO_LOW_WATER (16 * 1024 * 1024)
+// Received blocks on their way to storage are held in buffers of this size,
+// and up to DISK_IO_BLOCK_POOL of them are kept around for reuse
+#define DISK_IO_BLOCK_SIZE (16 * 1024)
+#define DISK_IO_BLOCK_POOL 256
+
+typedef enum {
+  DISK_OP_READ,
+  DISK_OP_WRITE,
+} disk_op_t;
+
+struct disk_job;
+typedef void (*disk_done_fn)(const struct disk_job *job, int ret);
+
+// Reads or writes bytes [offset, offset + len) of `torrent` from or to
+// `buf`, then calls `done` from the disk thread with the result of
+// storage_read() or storage_write().
+typedef struct disk_job {
+  metainfo_t *torrent;
+  disk_op_t op;
+  size_t offset;
+  size_t len;
+  void *buf;
+  disk_done_fn done;
+  void *ctx;
+} disk_job_t;
+
+// Jobs on the files of one device, served by its own threads so a slow disk
+// only holds up its own work. Jobs are taken off the queue in order, but the
+// threads run them side by side and they can finish in any order: nothing
+// may depend on an earlier job being done. `queued` counts the bytes of the
+// jobs queued or running.
+typedef struct {
+  dev_t dev;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  disk_job_t jobs[DISK_IO_QUEUE_LEN];
+  size_t head;
+  size_t len;
+  size_t queued;
+  bool congested;
+  size_t num_threads;
+} disk_device_t;
+
+// Sorts the files of `torrent` by the device they are on, starting threads
+// for devices not seen before. Storage that is not on disk gets a device of
+// its own. Until this is done, jobs of the torrent run on the caller's
+// thread.
+int disk_io_add_torrent(metainfo_t *torrent);
+// Thread safe. Waits for a free slot while the device's queue is full, so it
+// is not to be called from the reactor threads.
+void disk_io_submit(const disk_job_t *job);
+// Thread safe, for the reactor threads: with the device's queue full the job
+// runs on the caller's thread instead of waiting for a slot.
+void disk_io_submit_nowait(const disk_job_t *job);
+// Thread safe. A DISK_IO_BLOCK_SIZE buffer, NULL if out of memory
+void *disk_io_block_get(void);
+void disk_io_block_put(void *block);
+// Whether a device of the torrent has more queued than it keeps up with.
+// reactor_pool_notify() is called once it caught up.
+bool disk_io_congested(const metainfo_t *torrent);
+
+#endif // DISK_IO_H
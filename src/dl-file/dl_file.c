@@ -1,6 +1,7 @@
 #include "dl_file.h"
 #include "../log/log.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -8,66 +9,89 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include <sys/mman.h>
-
-dl_file_t *dl_file_create_and_open(size_t size, const char *path) {
-  char newpath[512];
-  strcpy(newpath, path);
-  strcat(newpath, ".incomplete");
-
-  int fd = open(path, O_CREAT | O_RDWR, 0777);
+#define INCOMPLETE_SUFFIX ".incomplete"
+
+int dl_file_open_fd(dl_file_t *file) {
+  char path[512];
+  strcpy(path, file->path);
+  path[strlen(path) - strlen(INCOMPLETE_SUFFIX)] = '\0';
+
+  // Data from an earlier run is kept, the recheck finds out what is usable
+  bool incomplete = true;
+  file->fresh = false;
+  int fd = open(file->path, O_RDWR);
+  if (fd < 0 && errno == ENOENT) {
+    incomplete = false;
+    fd = open(path, O_RDWR);
+    if (fd < 0 && errno == ENOENT) {
+      file->fresh = true;
+      fd = open(path, O_CREAT | O_RDWR, 0777);
+    }
+  }
   if (fd < 0) {
     goto fail_open;
   }
 
-  if (ftruncate(fd, size) < 0) {
+  // Truncating bumps the mtime even to the same size, which would make the
+  // resume record look stale
+  struct stat stats;
+  if (fstat(fd, &stats) < 0) {
+    goto fail_truncate;
+  }
+  if ((size_t)stats.st_size != file->size && ftruncate(fd, file->size) < 0) {
     goto fail_truncate;
   }
 
-  struct stat stats;
-  fstat(fd, &stats);
-  assert((size_t)stats.st_size == size);
-
-  uint8_t *mem =
-      mmap(NULL, stats.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (!mem) {
-    goto fail_mmap;
+  if (!incomplete) {
+    rename(path, file->path);
   }
 
-  dl_file_t *file = malloc(sizeof(dl_file_t) + strlen(newpath) + 1);
+  log_printf(LOG_INFO, "Successfully %s file at %s\n",
+             file->fresh ? "created and opened" : "reopened", path);
+  return fd;
+
+fail_truncate:
+  close(fd);
+fail_open:
+  log_printf(LOG_ERROR, "Unable to (create and) open file at %s\n", path);
+  return -1;
+}
+
+dl_file_t *dl_file_create_and_open(const storage_backend_t *backend,
+                                   size_t size, const char *path) {
+  size_t path_len = strlen(path) + strlen(INCOMPLETE_SUFFIX);
+  dl_file_t *file = malloc(sizeof(dl_file_t) + path_len + 1);
   if (!file) {
-    goto fail_alloc;
+    return NULL;
   }
 
   pthread_mutex_init(&file->file_lock, NULL);
+  file->backend = backend;
   file->size = size;
-  file->data = mem;
-  memcpy(file->path, newpath, strlen(newpath));
-  file->path[strlen(newpath)] = '\0';
-
-  rename(path, newpath);
-
-  close(fd);
-  log_printf(LOG_INFO, "Successfully created and opened file at %s\n", path);
+  file->data = NULL;
+  file->fd = -1;
+  file->dirty = 0;
+  file->fresh = true;
+  strcpy(file->path, path);
+  strcat(file->path, INCOMPLETE_SUFFIX);
+
+  if (backend->open(file) < 0) {
+    log_printf(LOG_ERROR, "Unable to open %s on %s storage\n", path,
+               backend->name);
+    pthread_mutex_destroy(&file->file_lock);
+    free(file);
+    return NULL;
+  }
 
   return file;
-
-fail_alloc:
-  munmap(mem, stats.st_size);
-fail_mmap:
-fail_truncate:
-  close(fd);
-fail_open:
-  log_printf(LOG_ERROR, "Unable to (create and) open file at %s\n", path);
-  return NULL;
 }
 
 int dl_file_close_and_free(dl_file_t *file) {
-  int ret = munmap(file->data, file->size);
+  file->backend->close(file);
   pthread_mutex_destroy(&file->file_lock);
   free(file);
 
-  return ret;
+  return 0;
 }
 
 void dl_file_getfilemem(const dl_file_t *file, filemem_t *out) {
@@ -76,13 +100,64 @@ void dl_file_getfilemem(const dl_file_t *file, filemem_t *out) {
 }
 
 int dl_file_complete(dl_file_t *file) {
+  if (!file->backend->persistent) {
+    return 0;
+  }
+
   char oldpath[512];
   strncpy(oldpath, file->path, sizeof(oldpath));
-  char *trim = strstr(file->path, ".incomplete");
+  char *trim = strstr(file->path, INCOMPLETE_SUFFIX);
   assert(trim && trim > file->path);
 
+  pthread_mutex_lock(&file->file_lock);
   *trim = '\0';
   rename(oldpath, file->path);
+  pthread_mutex_unlock(&file->file_lock);
 
   return 0;
 }
+
+int dl_file_read(dl_file_t *file, size_t offset, void *buf, size_t len) {
+  assert(offset + len <= file->size);
+  if (file->backend->mapped) {
+    memcpy(buf, file->data + offset, len);
+    return 0;
+  }
+
+  return file->backend->read(file, offset, buf, len);
+}
+
+int dl_file_write(dl_file_t *file, size_t offset, const void *buf,
+                  size_t len) {
+  assert(offset + len <= file->size);
+  if (file->backend->mapped) {
+    memcpy(file->data + offset, buf, len);
+    return 0;
+  }
+
+  return file->backend->write(file, offset, buf, len);
+}
+
+int dl_file_sync(dl_file_t *file) { return file->backend->sync(file); }
+
+int dl_file_advise(dl_file_t *file, size_t offset, size_t len) {
+  assert(offset + len <= file->size);
+  if (!file->backend->advise || len == 0) {
+    return 0;
+  }
+
+  return file->backend->advise(file, offset, len);
+}
+
+int dl_file_stat(dl_file_t *file, struct stat *out) {
+  if (!file->backend->persistent) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pthread_mutex_lock(&file->file_lock);
+  int ret = stat(file->path, out);
+  pthread_mutex_unlock(&file->file_lock);
+
+  return ret;
+}
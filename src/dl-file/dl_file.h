@@ -2,13 +2,49 @@
 #define DL_FILE_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
+struct dl_file;
+
+// Where the data of a file lives, see src/storage for the implementations.
+// Backends that keep the whole file in `data` are `mapped`: everything reads
+// and writes it directly, so they leave `read` and `write` NULL.
+typedef struct storage_backend {
+  const char *name;
+  bool mapped;
+  // The data ends up in the file at `path` and survives the process
+  bool persistent;
+  // Writes are dropped and reads return zeros, nothing can be verified
+  bool discards;
+  // Reads and writes are plain pread()/pwrite() on `fd`, which can as well
+  // be issued elsewhere, e.g. through io_uring
+  bool fd_io;
+  // Sets up `data` or `fd` for a file of `size` bytes and decides `fresh`
+  int (*open)(struct dl_file *file);
+  int (*read)(struct dl_file *file, size_t offset, void *buf, size_t len);
+  int (*write)(struct dl_file *file, size_t offset, const void *buf,
+               size_t len);
+  int (*sync)(struct dl_file *file);
+  // Optional: starts reading a range in, without waiting for it
+  int (*advise)(struct dl_file *file, size_t offset, size_t len);
+  void (*close)(struct dl_file *file);
+} storage_backend_t;
+
+// A file of the torrent. `fresh` files did not exist before, so none of
+// their data has been downloaded yet. `path` is where the data is kept while
+// downloading, with an `.incomplete` suffix.
 typedef struct dl_file {
   pthread_mutex_t file_lock;
+  const storage_backend_t *backend;
   size_t size;
   uint8_t *data;
+  int fd;
+  // Bytes written since the backend last started writeback, if it does that
+  size_t dirty;
+  bool fresh;
   char path[];
 } dl_file_t;
 
@@ -20,6 +56,20 @@ typedef struct filemem {
 int dl_file_close_and_free(dl_file_t *file);
 void dl_file_getfilemem(const dl_file_t *file, filemem_t *out);
 int dl_file_complete(dl_file_t *file);
-dl_file_t *dl_file_create_and_open(size_t size, const char *path);
+int dl_file_read(dl_file_t *file, size_t offset, void *buf, size_t len);
+int dl_file_write(dl_file_t *file, size_t offset, const void *buf, size_t len);
+// Writes the data back to disk, returning once it is there
+int dl_file_sync(dl_file_t *file);
+// Hints that bytes [offset, offset + len) are about to be read
+int dl_file_advise(dl_file_t *file, size_t offset, size_t len);
+// stat() of the file, safe against it being renamed on completion
+int dl_file_stat(dl_file_t *file, struct stat *out);
+// Opens the file on `backend`. Disk backends reopen what an earlier run left
+// at `path` (or its `.incomplete` copy), or create the file.
+dl_file_t *dl_file_create_and_open(const storage_backend_t *backend,
+                                   size_t size, const char *path);
+// For disk backends: opens or creates the file, sized to `file->size`, and
+// returns its descriptor
+int dl_file_open_fd(dl_file_t *file);
 
 #endif // DL_FILE_H
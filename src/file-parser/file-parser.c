@@ -1,4 +1,10 @@
 #include "file-parser.h"
+#include "../piece-picker/piece_picker.h"
+#include "../resume/resume.h"
+#include "../storage/storage.h"
+#include "../read-cache/read_cache.h"
+#include "../write-cache/write_cache.h"
+#include "../sha1/sha1.h"
 #include <openssl/sha.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -29,29 +35,35 @@ piece_hash *split_piece_hashes(const char *buf, size_t len) {
 }
 
 unsigned char *compute_info_hash(const char *in_buf, size_t start, size_t end) {
-  OpenSSL_add_all_algorithms();
-  ERR_load_crypto_strings();
-  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-  const EVP_MD *hashptr = EVP_get_digestbyname("SHA1");
-
-  EVP_DigestInit(ctx, hashptr);
-
-  unsigned char buf[end - start + 1];
+  unsigned char *outbuf = malloc(SHA1_DIGEST_LEN);
+  if (!outbuf) {
+    return NULL;
+  }
 
-  for (size_t i = start, j = 0; i <= end; i++, j++) {
-    buf[j] = in_buf[i];
+  if (sha1(in_buf + start, end - start + 1, outbuf) < 0) {
+    free(outbuf);
+    return NULL;
   }
 
-  EVP_DigestUpdate(ctx, buf, end - start + 1);
+  return outbuf;
+}
 
-  unsigned int outlen;
-  EVP_DigestFinal_ex(ctx, buf, &outlen);
-  EVP_MD_CTX_free(ctx);
+piece_state_t piece_state_get(const metainfo_t *torrent, size_t piece) {
+  return __atomic_load_n(&torrent->sh.piece_states[piece], __ATOMIC_ACQUIRE);
+}
 
-  unsigned char *outbuf = malloc(outlen);
-  memcpy(outbuf, buf, outlen);
+piece_state_t piece_state_swap(metainfo_t *torrent, size_t piece,
+                               piece_state_t state) {
+  return __atomic_exchange_n(&torrent->sh.piece_states[piece], (char)state,
+                             __ATOMIC_ACQ_REL);
+}
 
-  return outbuf;
+bool piece_state_cas(metainfo_t *torrent, size_t piece, piece_state_t from,
+                     piece_state_t to) {
+  char expected = from;
+  return __atomic_compare_exchange_n(&torrent->sh.piece_states[piece],
+                                     &expected, (char)to, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 }
 
 info_t parse_info(hash_table_t *parsed) {
@@ -82,6 +94,7 @@ info_t parse_info(hash_table_t *parsed) {
     for (size_t i = 0; i < files_list.len; i++) {
       BencodeType *length = HT_LOOKUP(&files_list.values[i].asDict, "length");
       info.files[i].length = length->asInt;
+      info.length += info.files[i].length;
       HT_DELETE(&files_list.values[i].asDict, "length");
       BencodeType *path = HT_LOOKUP(&files_list.values[i].asDict, "path");
 
@@ -131,21 +144,36 @@ metainfo_t parse_file(char *filename) {
   metainfo.info = parse_info(&info->asDict);
   memcpy(metainfo.info_hash, info->sha1_digest, SHA_DIGEST_LENGTH);
 
-  metainfo.files = calloc(metainfo.info.files_count, sizeof(filemem_t));
-
   pthread_mutex_init(&metainfo.sh.sh_lock, NULL);
-  metainfo.max_peers = 50;
+  pthread_mutex_init(&metainfo.sh.picker_lock, NULL);
+  pthread_mutex_init(&metainfo.sh.hash_lock, NULL);
+  metainfo.max_peers = TORRENT_MAX_PEERS_DEFAULT;
+  metainfo.max_half_open = TORRENT_MAX_HALF_OPEN_DEFAULT;
+  metainfo.max_requests = TORRENT_MAX_REQUESTS_DEFAULT;
   metainfo.sh.piece_states = malloc(metainfo.info.num_pieces);
   memset(metainfo.sh.piece_states, PIECE_STATE_NOT_REQUESTED,
          metainfo.info.num_pieces);
+  metainfo.sh.picker =
+      piece_picker_create(metainfo.info.num_pieces, metainfo.info.piece_length,
+                          metainfo.info.length);
+  metainfo.sh.hashers = piece_hashers_create(metainfo.info.num_pieces);
   metainfo.sh.pieces_left = metainfo.info.num_pieces;
+  metainfo.sh.have_log = calloc(metainfo.info.num_pieces, sizeof(uint32_t));
+  metainfo.sh.have_log_len = 0;
+  metainfo.sh.hash_parked = malloc(metainfo.info.num_pieces * sizeof(uint32_t));
+  metainfo.sh.hash_parked_head = 0;
+  metainfo.sh.hash_parked_len = 0;
+  metainfo.sh.have_log_reserved = 0;
   metainfo.sh.state = TORRENT_STATE_LEECHING;
   metainfo.sh.completed = false;
   metainfo.sh.peer_connections = malloc(sizeof(peer_connections_t));
   da_init(metainfo.sh.peer_connections, sizeof(peer_connection_t));
+  metainfo.sh.candidates = malloc(sizeof(peers_t));
+  da_init(metainfo.sh.candidates, sizeof(peer_t));
+  metainfo.sh.half_open = 0;
 
   if (metainfo.info.mode == INFO_MULTI) {
-    metainfo.files = calloc(metainfo.info.files_count, sizeof(dl_file_t *));
+    metainfo.files = calloc(metainfo.info.files_count + 1, sizeof(dl_file_t *));
     for (size_t i = 0; i < metainfo.info.files_count; i++) {
       file_info_t *cur_file = &metainfo.info.files[i];
       char path[512];
@@ -162,7 +190,8 @@ metainfo_t parse_file(char *filename) {
         }
       }
       log_printf(LOG_INFO, "Target file: %s\n", path);
-      metainfo.files[i] = dl_file_create_and_open(cur_file->length, path);
+      metainfo.files[i] = dl_file_create_and_open(storage_backend(),
+                                                 cur_file->length, path);
     }
   } else {
     assert(metainfo.info.mode == INFO_SINGLE);
@@ -177,9 +206,22 @@ metainfo_t parse_file(char *filename) {
         .path = (char *[]){path},
     };
 
-    metainfo.files = calloc(1, sizeof(peer_connections_t));
-    metainfo.files[0] = dl_file_create_and_open(metainfo.info.length, path);
+    metainfo.files = calloc(2, sizeof(dl_file_t *));
+    metainfo.files[0] = dl_file_create_and_open(storage_backend(),
+                                                metainfo.info.length, path);
   }
 
+  metainfo.file_offsets =
+      malloc((metainfo.info.files_count + 1) * sizeof(size_t));
+  metainfo.file_offsets[0] = 0;
+  for (size_t i = 0; i < metainfo.info.files_count; i++) {
+    metainfo.file_offsets[i + 1] =
+        metainfo.file_offsets[i] + metainfo.info.files[i].length;
+  }
+
+  metainfo.write_cache = write_cache_create(metainfo.info.num_pieces);
+  metainfo.read_cache = read_cache_create(metainfo.info.num_pieces);
+  metainfo.resumed = resume_load(&metainfo) == 0;
+
   return metainfo;
 }
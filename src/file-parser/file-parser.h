@@ -52,9 +52,11 @@ typedef struct {
   file_info_t *files;
 } info_t;
 
+struct peer_conn;
+
 typedef struct {
   peer_t peer;
-  pthread_t thread;
+  struct peer_conn *conn;
 } peer_connection_t;
 
 typedef struct {
@@ -63,6 +65,12 @@ typedef struct {
     peer_connection_t *values;
 } peer_connections_t;
 
+typedef struct {
+    size_t len;
+    size_t cap;
+    peer_t *values;
+} peers_t;
+
 typedef struct metainfo_t {
   char *announce;
   size_t announce_list_size;
@@ -70,15 +78,60 @@ typedef struct metainfo_t {
   info_t info;
   char info_hash[SHA_DIGEST_LENGTH];
   size_t max_peers;
+  // How many outgoing connects may be in progress at once
+  size_t max_half_open;
+  // Upper bound for the per-peer request queue, in blocks
+  size_t max_requests;
+  // Nothing a connection does per message takes sh_lock: piece state,
+  // counters and the have log are atomics, and the picker has its own lock.
+  // The two locks are never held together.
   struct {
+    // Read and written atomically, like `completed`
     torrent_state_t state;
+    // Guards the connection list, the candidates and half_open
     pthread_mutex_t sh_lock;
     peer_connections_t *peer_connections;
+    // Peers learned from trackers that we have not dialed yet
+    peers_t *candidates;
+    size_t half_open;
+    // A piece_state_t per piece, only accessed through piece_state_*()
     char *piece_states;
+    // Guards the picker
+    pthread_mutex_t picker_lock;
+    struct piece_picker *picker;
+    // Streaming hash state of every piece, see sha1.h
+    struct piece_hasher *hashers;
+    // Downloaded pieces waiting for room in the hash queue, a ring of
+    // num_pieces entries from `hash_parked_head`. Guarded by hash_lock.
+    pthread_mutex_t hash_lock;
+    uint32_t *hash_parked;
+    size_t hash_parked_head;
+    size_t hash_parked_len;
+    // Atomic
     size_t pieces_left;
+    // Pieces in the order they were completed. Writers reserve a slot in
+    // `have_log_reserved` and publish it by moving `have_log_len` past it in
+    // order; connections read lock-free up to `have_log_len`.
+    uint32_t *have_log;
+    size_t have_log_len;
+    size_t have_log_reserved;
     bool completed;
   } sh;
   dl_file_t **files;
+  // Pieces being downloaded, until they are verified. NULL if disabled.
+  struct write_cache *write_cache;
+  // Verified pieces peers are downloading from us. NULL if disabled.
+  struct read_cache *read_cache;
+  // Disk I/O device of each file, and the set of them. NULL until the
+  // torrent is added to the disk threads.
+  uint8_t *file_devices;
+  uint32_t disk_devices;
+  // Where each file starts in the torrent, files_count + 1 entries: the last
+  // one is the total length
+  size_t *file_offsets;
+  // The piece states came from a resume record that matched the files on
+  // disk, so they need no recheck
+  bool resumed;
 } metainfo_t;
 
 #define HT_LOOKUP(ht, key) hash_table_lookup(ht, key, strlen(key))
@@ -86,6 +139,21 @@ typedef struct metainfo_t {
 
 #define MAX_BUFSIZE 2048
 
+// Limits parse_file() gives every torrent, see metainfo_t
+#define TORRENT_MAX_PEERS_DEFAULT 50
+#define TORRENT_MAX_HALF_OPEN_DEFAULT 32
+#define TORRENT_MAX_REQUESTS_DEFAULT 250
+// Highest max_requests can be set to
+#define TORRENT_MAX_REQUESTS_LIMIT 4096
+
 metainfo_t parse_file(char *filename);
 
+piece_state_t piece_state_get(const metainfo_t *torrent, size_t piece);
+// Sets the piece's state, returning the one it replaced
+piece_state_t piece_state_swap(metainfo_t *torrent, size_t piece,
+                               piece_state_t state);
+// Moves the piece from `from` to `to`. Fails if it is not in `from`.
+bool piece_state_cas(metainfo_t *torrent, size_t piece, piece_state_t from,
+                     piece_state_t to);
+
 #endif // FILE_PARSER_H
@@ -0,0 +1,110 @@
+#include "hash_pool.h"
+#include "../log/log.h"
+#include "../sha1/sha1.h"
+#include <unistd.h>
+
+hash_queue_t hash_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+pthread_t hash_threads[HASH_POOL_MAX_THREADS];
+size_t num_hash_threads = 0;
+
+void *hash_pool_worker(void *arg) {
+  (void)arg;
+  hash_queue_t *q = &hash_queue;
+
+  while (true) {
+    pthread_mutex_lock(&q->lock);
+    while (q->len == 0) {
+      pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+
+    hash_job_t job = q->jobs[q->head];
+    q->head = (q->head + 1) % HASH_POOL_QUEUE_LEN;
+    q->len--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+
+    if (job.num_pieces <= 1) {
+      bool valid = torrent_sha1_verify(job.torrent, job.piece);
+      job.done(&job, valid);
+      continue;
+    }
+
+    bool valid[HASH_JOB_MAX_PIECES];
+    torrent_sha1_verify_many(job.torrent, job.piece, job.num_pieces, valid);
+    for (size_t i = 0; i < job.num_pieces; i++) {
+      hash_job_t one = job;
+      one.piece = job.piece + i;
+      one.num_pieces = 1;
+      job.done(&one, valid[i]);
+    }
+  }
+
+  return NULL;
+}
+
+int hash_pool_init(size_t nthreads) {
+  if (nthreads == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+  }
+
+  if (nthreads > HASH_POOL_MAX_THREADS) {
+    nthreads = HASH_POOL_MAX_THREADS;
+  }
+
+  for (size_t i = 0; i < nthreads; i++) {
+    if (pthread_create(&hash_threads[i], NULL, hash_pool_worker, NULL) != 0) {
+      break;
+    }
+    pthread_detach(hash_threads[i]);
+    num_hash_threads++;
+  }
+
+  if (num_hash_threads == 0) {
+    return -1;
+  }
+
+  log_printf(LOG_INFO, "Started %zu hashing threads\n", num_hash_threads);
+  return 0;
+}
+
+int hash_pool_submit(const hash_job_t *job) {
+  hash_queue_t *q = &hash_queue;
+  if (num_hash_threads == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (q->len == HASH_POOL_QUEUE_LEN) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  q->jobs[(q->head + q->len) % HASH_POOL_QUEUE_LEN] = *job;
+  q->len++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+int hash_pool_try_submit(const hash_job_t *job) {
+  hash_queue_t *q = &hash_queue;
+  if (num_hash_threads == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  if (q->len == HASH_POOL_QUEUE_LEN) {
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+  }
+  q->jobs[(q->head + q->len) % HASH_POOL_QUEUE_LEN] = *job;
+  q->len++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+
+  return 1;
+}
@@ -0,0 +1,48 @@
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+#include "../file-parser/file-parser.h"
+#include "../sha1/sha1_engine.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HASH_POOL_MAX_THREADS 8
+#define HASH_POOL_QUEUE_LEN 256
+#define HASH_JOB_MAX_PIECES SHA1_LANES
+
+struct hash_job;
+typedef void (*hash_done_fn)(const struct hash_job *job, bool valid);
+
+// Verifies `num_pieces` pieces of `torrent` from `piece` on against their
+// SHA1, then calls `done` for each of them from the worker thread that hashed
+// it. Pieces nobody is downloading can be batched, up to
+// HASH_JOB_MAX_PIECES, to be hashed side by side.
+typedef struct hash_job {
+  metainfo_t *torrent;
+  size_t piece;
+  size_t num_pieces;
+  hash_done_fn done;
+  void *ctx;
+} hash_job_t;
+
+// Fixed size ring of jobs shared by all workers
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  hash_job_t jobs[HASH_POOL_QUEUE_LEN];
+  size_t head;
+  size_t len;
+} hash_queue_t;
+
+int hash_pool_init(size_t nthreads);
+// Thread safe. Waits for a free slot while the queue is full, which holds
+// back whoever produces pieces faster than they can be hashed.
+int hash_pool_submit(const hash_job_t *job);
+// Thread safe, for reactor threads that must not wait on the hashing
+// threads. Returns 1 once queued, 0 if the queue is full and -1 if there is
+// nobody to hash.
+int hash_pool_try_submit(const hash_job_t *job);
+
+#endif // HASH_POOL_H
@@ -1,54 +1,126 @@
+#include "disk-io/disk_io.h"
 #include "file-parser/file-parser.h"
+#include "hash-pool/hash_pool.h"
 #include "log/log.h"
 #include "peer-connection/peer-connection.h"
 #include "peer-id/peer-id.h"
+#include "peer-listener/peer_listener.h"
+#include "reactor/reactor.h"
+#include "read-cache/read_cache.h"
+#include "recheck/recheck.h"
+#include "resume/resume.h"
+#include "sha1/sha1_engine.h"
+#include "storage/storage.h"
 #include "tracker/tracker_announce.h"
 #include "tracker/tracker_request.h"
+#include "uring/uring.h"
 #include "url/url.h"
-#include <pthread.h>
+#include "write-cache/write_cache.h"
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #define TRACKER_RETRY_INTERVAL 15
+// Largest cache budget taken from the command line
+#define CACHE_MAX_MIB (1024 * 1024)
+
+int usage(const char *name) {
+  printf("usage: %s [-c max peers] [-o max connects] [-p port]\n"
+         "       [-q max requests] [-r cache MiB] [-s storage] [-u]\n"
+         "       [-w cache MiB] [file name]\n",
+         name);
+  return 1;
+}
 
-int create_peer_connection(peer_t *peer, metainfo_t *torrent) {
-  peer_connection_t conn;
-  conn.peer = *peer;
-
-  peer_arg_t *arg = malloc(sizeof(peer_arg_t));
-  if (!arg) {
-    return -1;
-  }
-
-  arg->torrent = torrent;
-  arg->peer = *peer;
-  arg->sockfd = -1;
-
-  if (peer_connection_create(&conn.thread, arg) < 0) {
-    log_printf(LOG_ERROR, "Could not create peer thread\n");
-    free(arg);
-
+// The option's value if it is a number in [min, max], -1 otherwise
+long parse_arg(const char *arg, long min, long max) {
+  char *end;
+  errno = 0;
+  long value = strtol(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value < min ||
+      value > max) {
     return -1;
   }
 
-  pthread_mutex_lock(&torrent->sh.sh_lock);
-  if (torrent->max_peers == torrent->sh.peer_connections->len) {
-    pthread_mutex_unlock(&torrent->sh.sh_lock);
-    return 0;
-  }
-
-  da_append(torrent->sh.peer_connections, conn);
-
-  pthread_mutex_unlock(&torrent->sh.sh_lock);
-
-  return 0;
+  return value;
 }
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
-  if (argc < 2) {
-    printf("usage: %s [file name]\n", argv[0]);
+  // Every thread inherits the mask, so only the sigtimedwait() below sees
+  // these and the resume record is saved on the way out
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  uint16_t port = PEER_LISTEN_PORT_DEFAULT;
+  int opt;
+  storage_kind_t storage = STORAGE_MMAP;
+  // Zero keeps the torrent's defaults
+  long max_peers = 0;
+  long max_half_open = 0;
+  long max_requests = 0;
+  long mib;
+  while ((opt = getopt(argc, argv, "c:o:p:q:r:s:uw:")) != -1) {
+    switch (opt) {
+    case 'c':
+      if ((max_peers = parse_arg(optarg, 1, UINT16_MAX)) < 0) {
+        return usage(argv[0]);
+      }
+      break;
+    case 'o':
+      if ((max_half_open = parse_arg(optarg, 1, UINT16_MAX)) < 0) {
+        return usage(argv[0]);
+      }
+      break;
+    case 'p': {
+      long p = parse_arg(optarg, 1, UINT16_MAX);
+      if (p < 0) {
+        return usage(argv[0]);
+      }
+      port = p;
+      break;
+    }
+    case 'q':
+      max_requests = parse_arg(optarg, 1, TORRENT_MAX_REQUESTS_LIMIT);
+      if (max_requests < 0) {
+        return usage(argv[0]);
+      }
+      break;
+    case 'r':
+      if ((mib = parse_arg(optarg, 0, CACHE_MAX_MIB)) < 0) {
+        return usage(argv[0]);
+      }
+      read_cache_set_budget((size_t)mib * 1024 * 1024);
+      break;
+    case 's':
+      storage = storage_kind_from_name(optarg);
+      if (storage == STORAGE_MAX) {
+        printf("unknown storage %s: mmap, pread, memory or null\n", optarg);
+        return 1;
+      }
+      break;
+    case 'u':
+      uring_use(true);
+      break;
+    case 'w':
+      if ((mib = parse_arg(optarg, 0, CACHE_MAX_MIB)) < 0) {
+        return usage(argv[0]);
+      }
+      write_cache_set_budget((size_t)mib * 1024 * 1024);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
     return 0;
   }
   srand(time(NULL));
@@ -57,14 +129,70 @@ int main(int argc, char **argv) {
   log_set_logfile(stdout);
   log_set_lvl(LOG_DEBUG);
 
-  metainfo_t file = parse_file(argv[1]);
-  file.max_peers = 50;
+  sha1_engine_init();
+  log_printf(LOG_INFO, "Hashing with %s, %s for batches\n",
+             sha1_impl_name(sha1_engine_impl()),
+             sha1_multi_name(sha1_engine_multi()));
+
+  storage_use(storage);
+  log_printf(LOG_INFO, "Storing data with %s\n", storage_kind_name(storage));
+
+  metainfo_t file = parse_file(argv[optind]);
+  if (max_peers > 0) {
+    file.max_peers = max_peers;
+  }
+  if (max_half_open > 0) {
+    file.max_half_open = max_half_open;
+  }
+  if (max_requests > 0) {
+    file.max_requests = max_requests;
+  }
+
+  if (hash_pool_init(0) < 0) {
+    log_printf(LOG_ERROR, "Could not start hashing threads\n");
+    return 1;
+  }
+
+  // Without disk threads, pieces are written and read on the threads that
+  // need them
+  if (disk_io_add_torrent(&file) < 0) {
+    log_printf(LOG_WARNING, "Not using disk threads\n");
+  }
+
+  if (!file.resumed && torrent_recheck(&file) < 0) {
+    log_printf(LOG_ERROR, "Could not check the data already on disk\n");
+    return 1;
+  }
+
+  if (file.sh.pieces_left == 0) {
+    torrent_complete(&file);
+  }
+
+  if (read_cache_start(&file) < 0) {
+    log_printf(LOG_WARNING, "Not caching the pieces we upload\n");
+    file.read_cache = NULL;
+  }
+
+  if (reactor_pool_init(0) < 0) {
+    log_printf(LOG_ERROR, "Could not start peer reactors\n");
+    return 1;
+  }
+
+  // Without a listener we can still download from the peers we reach
+  if (peer_listener_add_torrent(&file) < 0 || peer_listener_start(port) < 0) {
+    log_printf(LOG_WARNING, "Not accepting incoming peer connections\n");
+  }
+
+  if (resume_start(&file) < 0) {
+    log_printf(LOG_WARNING, "Not saving resume records\n");
+  }
 
   url_t announce_url = file.announce ? url_from_string(file.announce)
                                      : url_from_string(file.announce_list[0]);
 
   bool started = false;
-  bool completed = false;
+  // Only announce completion if it happens in this run
+  bool completed = __atomic_load_n(&file.sh.completed, __ATOMIC_ACQUIRE);
   unsigned interval;
   while (true) {
     tracker_request_t *req = build_tracker_announce_request(&file);
@@ -73,7 +201,8 @@ int main(int argc, char **argv) {
       started = true;
     }
 
-    bool read_completed = file.sh.completed;
+    bool read_completed =
+        __atomic_load_n(&file.sh.completed, __ATOMIC_ACQUIRE);
     if (!completed && read_completed) {
       req->event = EVENT_COMPLETED;
     }
@@ -83,9 +212,7 @@ int main(int argc, char **argv) {
     if (res) {
       log_printf(LOG_DEBUG, "Tracker interval is %ld\n", res->interval);
       interval = res->interval;
-      for (size_t i = 0; i < res->num_peers; i++) {
-        create_peer_connection(&res->peers[i], &file);
-      }
+      peer_connection_add_candidates(&file, res->peers, res->num_peers);
       log_printf(LOG_INFO, "%ld connected peers\n",
                  file.sh.peer_connections->len);
     } else {
@@ -100,7 +227,25 @@ int main(int argc, char **argv) {
     }
 
     log_printf(LOG_DEBUG, "Sleeping for %ld\n", interval);
-    sleep(interval);
+    struct timespec timeout = {.tv_sec = interval};
+    int sig = sigtimedwait(&stop_signals, NULL, &timeout);
+    if (sig == SIGINT || sig == SIGTERM) {
+      log_printf(LOG_INFO, "Stopping, saving the resume record\n");
+      break;
+    }
+  }
+
+  if (file.read_cache) {
+    pthread_mutex_lock(&file.read_cache->lock);
+    log_printf(LOG_INFO, "Read cache: %zu hits, %zu misses, %zu evictions\n",
+               file.read_cache->hits, file.read_cache->misses,
+               file.read_cache->evictions);
+    pthread_mutex_unlock(&file.read_cache->lock);
+  }
+
+  if (resume_save(&file) < 0) {
+    log_printf(LOG_ERROR, "Could not save the resume record\n");
+    return 1;
   }
 
   return 0;
@@ -1,31 +1,34 @@
 #ifndef PEER_CONNECTION_H
 #define PEER_CONNECTION_H
 #include "../file-parser/file-parser.h"
-#include "../piece-request/piece_request.h"
+#include "../peer-msg/peer_msg.h"
 #include "../queue/queue.h"
+#include "../reactor/reactor.h"
 #include "../tracker/peer_parser.h"
-#include <pthread.h>
+#include <arpa/inet.h>
 #include <stdint.h>
 
 #define KB (1 << 10)
 #define PEER_REQUEST_SIZE (16 * KB)
 
-typedef struct {
-  metainfo_t *torrent;
-  peer_t peer;
-  int sockfd;
-} peer_arg_t;
-
 typedef struct {
   bool choked;
   bool interested;
 } peer_state_t;
 
+// A block we asked the peer for and have not received yet
+typedef struct {
+  uint32_t piece;
+  uint32_t begin;
+  uint32_t len;
+  long requested_at;
+} local_request_t;
+
 typedef struct {
   size_t len;
   size_t cap;
-  piece_request_t *values;
-} piece_requests_t;
+  local_request_t *values;
+} local_requests_t;
 
 typedef struct {
   peer_state_t local;
@@ -36,12 +39,73 @@ typedef struct {
   size_t bitlen;
   uint32_t blocks_sent;
   uint32_t block_recvd;
-  piece_requests_t *local_requests;
+  local_requests_t *local_requests;
   queue_t *peer_requests;
+  // The first of `peer_requests` waits for its piece to be read into the
+  // read cache, the connection is notified once it is there
+  bool read_pending;
+  // New blocks are not requested while the disks are behind, the connection
+  // is notified once they caught up
+  bool disk_throttled;
 
+  // Request pipeline, in PEER_REQUEST_SIZE blocks. The blocks in flight are
+  // the ones in `local_requests`.
+  uint32_t queue_depth;
+  uint32_t max_queue_depth;
+  long min_rtt;
+  long min_rtt_stamp;
+  size_t rate;
+  long rate_window_start;
+  size_t rate_window_bytes;
 } conn_state_t;
 
-int peer_connection_create(pthread_t *thread, peer_arg_t *arg);
-void peer_connection_queue_name(pthread_t thread, char *out, size_t len);
+typedef enum {
+  CONN_PHASE_CONNECTING,
+  CONN_PHASE_HANDSHAKING,
+  CONN_PHASE_ACTIVE,
+} conn_phase_t;
+
+// A peer connection is a state machine driven by one of the reactor threads.
+// `src.fd` is the (non-blocking) socket to the peer, `have_cursor` how far
+// into the torrent's have log we have told the peer about. Timestamps are
+// reactor_now_ms() values. `inbound` connections start out handshaking and
+// without a torrent, which the peer's handshake picks.
+typedef struct peer_conn {
+  reactor_source_t src;
+  reactor_t *reactor;
+  metainfo_t *torrent;
+  peer_t peer;
+  char ipstr[INET_ADDRSTRLEN];
+  bool inbound;
+  // Counts against the torrent's max_half_open until the connect resolves
+  bool half_open;
+  // Counts against the listener's PEER_LISTEN_MAX_PENDING until the peer's
+  // handshake arrives
+  bool pending;
+  conn_phase_t phase;
+  peer_reader_t reader;
+  peer_writer_t writer;
+  // EPOLLOUT is part of the interest set
+  bool want_write;
+  // What the reactor's ring is sending for us
+  struct iovec send_iov[PEER_WRITER_MAX_IOV];
+  struct msghdr send_hdr;
+  long phase_start;
+  long last_msg_time;
+  long last_sent_request_time;
+  size_t have_cursor;
+  conn_state_t *state;
+} peer_conn_t;
+
+// Queues peers we are not connected to yet and dials them, racing up to
+// max_half_open connects at once and never exceeding max_peers.
+void peer_connection_add_candidates(metainfo_t *torrent, const peer_t *peers,
+                                    size_t num_peers);
+// Dials queued candidates while the torrent has room for more connections
+void peer_connection_dial(metainfo_t *torrent);
+// Takes over a socket accepted by the listener
+int peer_connection_accept(int sockfd, const struct sockaddr_in *addr);
+// Switches to seeding once every piece is downloaded
+void torrent_complete(metainfo_t *torrent);
 
 #endif // !PEER_CONNECTION_H
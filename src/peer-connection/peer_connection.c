@@ -1,28 +1,42 @@
 #include "../bitfield/bitfield.h"
+#include "../disk-io/disk_io.h"
 #include "../byte-str/byte_str.h"
+#include "../hash-pool/hash_pool.h"
+#include "../peer-listener/peer_listener.h"
 #include "../peer-msg/peer_msg.h"
+#include "../piece-picker/piece_picker.h"
 #include "../queue/queue.h"
+#include "../read-cache/read_cache.h"
 #include "../sha1/sha1.h"
+#include "../write-cache/write_cache.h"
 #include "peer-connection.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <mqueue.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
 #define PEER_TIMEOUT_SEC 120
 #define PEER_KEEPALIVE_INTERVAL 60
+#define PEER_CONNECT_TIMEOUT_SEC 5
+#define PEER_MAX_CANDIDATES 500
+#define SEC_MS 1000
 
-mqd_t peer_queue_open(int flags);
-void queue_cleanup(void *arg);
+#define PEER_MIN_QUEUE_DEPTH 4
+#define PEER_PIPELINE_GAIN 2
+#define PEER_RATE_WINDOW_MS 500
+#define PEER_MIN_RTT_WINDOW_MS (10 * SEC_MS)
+#define PEER_RECV_BUDGET (1 << 20)
+#define PEER_WRITE_BACKLOG (256 * 1024)
 
 uint8_t *make_bitfield(const metainfo_t *torrent) {
   size_t num_pieces = torrent->info.num_pieces;
@@ -33,7 +47,7 @@ uint8_t *make_bitfield(const metainfo_t *torrent) {
   }
 
   for (size_t i = 0; i < num_pieces; i++) {
-    if (torrent->sh.piece_states[i] == PIECE_STATE_HAVE) {
+    if (piece_state_get(torrent, i) == PIECE_STATE_HAVE) {
       BITFIELD_SET(i, ret);
     }
   }
@@ -41,7 +55,7 @@ uint8_t *make_bitfield(const metainfo_t *torrent) {
   return ret;
 }
 
-conn_state_t *conn_state_init(metainfo_t *torrent) {
+conn_state_t *conn_state_init(metainfo_t *torrent, size_t *have_cursor) {
   conn_state_t *state = malloc(sizeof(conn_state_t));
   if (!state) {
     return state;
@@ -53,9 +67,9 @@ conn_state_t *conn_state_init(metainfo_t *torrent) {
   state->remote.interested = false;
 
   state->bitlen = torrent->info.num_pieces;
-  uint16_t num_bytes = BITFIELD_NUM_BYTES(state->bitlen);
+  size_t num_bytes = BITFIELD_NUM_BYTES(state->bitlen);
 
-  state->peer_have = malloc(num_bytes);
+  state->peer_have = calloc(num_bytes, 1);
   if (!state->peer_have) {
     goto fail_peer_have;
   }
@@ -70,32 +84,47 @@ conn_state_t *conn_state_init(metainfo_t *torrent) {
     goto fail_peer_requests;
   }
 
-  state->local_requests = malloc(sizeof(piece_requests_t));
+  state->local_requests = malloc(sizeof(local_requests_t));
   if (!state->local_requests) {
     goto fail_local_requests;
   }
-  da_init(state->local_requests, sizeof(piece_request_t));
+  da_init(state->local_requests, sizeof(local_request_t));
   if (!state->local_requests->values) {
     goto fail_local_request_values;
   }
 
-  pthread_mutex_lock(&torrent->sh.sh_lock);
+  // A piece is marked as had before it is logged, so everything logged
+  // before the cursor is part of the bitfield. Pieces logged later may be in
+  // it too, service_have_events() skips those.
+  *have_cursor = __atomic_load_n(&torrent->sh.have_log_len, __ATOMIC_ACQUIRE);
   state->local_have = make_bitfield(torrent);
-  pthread_mutex_unlock(&torrent->sh.sh_lock);
   if (!state->local_have) {
     goto fail_local_have;
   }
 
   state->blocks_sent = 0;
   state->block_recvd = 0;
+  state->read_pending = false;
+  state->disk_throttled = false;
+
+  state->queue_depth = PEER_MIN_QUEUE_DEPTH;
+  state->max_queue_depth = torrent->max_requests > PEER_MIN_QUEUE_DEPTH
+                               ? torrent->max_requests
+                               : PEER_MIN_QUEUE_DEPTH;
+  state->min_rtt = -1;
+  state->min_rtt_stamp = 0;
+  state->rate = 0;
+  state->rate_window_start = reactor_now_ms();
+  state->rate_window_bytes = 0;
 
   return state;
 
+fail_local_have:
+  free(state->local_requests->values);
 fail_local_request_values:
   free(state->local_requests);
-fail_local_have:
 fail_local_requests:
-  free(state->peer_requests);
+  queue_free(state->peer_requests);
 fail_peer_requests:
   free(state->peer_wants);
 fail_peer_wants:
@@ -117,6 +146,9 @@ void conn_state_cleanup(void *arg) {
   free(state->local_have);
   queue_free(state->peer_requests);
 
+  free(state->local_requests->values);
+  free(state->local_requests);
+
   free(state);
 }
 
@@ -124,86 +156,28 @@ void print_ip(peer_t *peer, char *outbuf, size_t buf_len) {
   inet_ntop(AF_INET, &peer->addr.sa_in.sin_addr, outbuf, buf_len);
 }
 
-void peer_connection_cleanup(void *arg) {
-  peer_arg_t *parg = (peer_arg_t *)arg;
-  if (parg->sockfd >= 0) {
-    shutdown(parg->sockfd, SHUT_RDWR);
-    close(parg->sockfd);
-  }
-
-  char ipstr[INET_ADDRSTRLEN];
-  print_ip(&parg->peer, ipstr, INET_ADDRSTRLEN);
-  log_printf(LOG_INFO, "Closed peer connection %s\n", ipstr);
-
-  free(arg);
-}
-
-int handshake(int sockfd, char info_hash[20], char out_peer_id[20]) {
-  if (peer_send_handshake(sockfd, info_hash) < 0) {
-    return -1;
-  }
-
-  if (peer_recv_handshake(sockfd, info_hash, out_peer_id) < 0) {
-    return -1;
-  }
-
-  return 0;
-}
-
-int peer_connect(peer_arg_t *arg) {
-  char ipstr[INET_ADDRSTRLEN];
-  print_ip(&arg->peer, ipstr, sizeof(ipstr));
-
+int peer_connect(peer_conn_t *conn) {
   int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sockfd < 0) {
     return sockfd;
   }
-  socklen_t len = sizeof(arg->peer.addr.sa_in);
-  int result = connect(sockfd, &arg->peer.addr.sa, len);
+  socklen_t len = sizeof(conn->peer.addr.sa_in);
+  int result = connect(sockfd, &conn->peer.addr.sa, len);
   if (result < 0 && errno != EINPROGRESS) {
     close(sockfd);
     return -1;
   }
 
-  struct timeval timeout;
-  timeout.tv_sec = 5;
-  timeout.tv_usec = 0;
-  fd_set fdset;
-  FD_ZERO(&fdset);
-  FD_SET(sockfd, &fdset);
-  if (select(sockfd + 1, NULL, &fdset, NULL, &timeout)) {
-    int err;
-    socklen_t len = sizeof(int);
-    getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
-    if (err) {
-      close(sockfd);
-      return -1;
-    }
-  } else { // Timeout
-    log_printf(LOG_INFO, "Peer %s timed out after %u seconds\n", ipstr, 5);
-    close(sockfd);
-    return -1;
-  }
-
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
-  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval));
-
-  int opts = fcntl(sockfd, F_GETFL);
-  opts &= ~O_NONBLOCK;
-  fcntl(sockfd, F_SETFL, opts);
-
-  log_printf(LOG_INFO, "Connection to peer %s estabilished successfully\n",
-             ipstr);
-
   return sockfd;
 }
 
-void unchoke(int sockfd, conn_state_t *state, const metainfo_t *torrent) {
+void unchoke(peer_writer_t *out, conn_state_t *state,
+             const metainfo_t *torrent) {
   peer_msg_t unchoke_msg = {
       .type = MSG_UNCHOKE,
   };
 
-  if (peer_msg_send(sockfd, &unchoke_msg, torrent) < 0) {
+  if (peer_msg_send(out, &unchoke_msg, torrent) < 0) {
     return;
   }
 
@@ -211,30 +185,58 @@ void unchoke(int sockfd, conn_state_t *state, const metainfo_t *torrent) {
   log_printf(LOG_DEBUG, "Unchoked peer\n");
 }
 
-void service_have_events(int sockfd, mqd_t queue, const metainfo_t *torrent,
-                         uint8_t *havebf) {
+void service_have_events(peer_conn_t *conn) {
+  metainfo_t *torrent = conn->torrent;
   peer_msg_t msg = {
       .type = MSG_HAVE,
   };
 
-  uint32_t have;
-  int ret;
-  while ((ret = mq_receive(queue, (char *)&have, sizeof(uint32_t), 0)) ==
-         sizeof(uint32_t)) {
+  size_t len = __atomic_load_n(&torrent->sh.have_log_len, __ATOMIC_ACQUIRE);
+  while (conn->have_cursor < len) {
+    uint32_t have = torrent->sh.have_log[conn->have_cursor++];
+    if (BITFIELD_ISSET(have, conn->state->local_have)) {
+      continue;
+    }
+
+    BITFIELD_SET(have, conn->state->local_have);
     msg.payload.have = have;
-    BITFIELD_SET(have, havebf);
-    if (peer_msg_send(sockfd, &msg, torrent) < 0) {
+    if (peer_msg_send(&conn->writer, &msg, torrent) < 0) {
       break;
     }
     log_printf(LOG_INFO, "Event serviced: have (%u) sent to peer\n", have);
   }
 }
 
-void service_peer_requests(int sockfd, conn_state_t *state,
-                           const metainfo_t *torrent) {
+// Only blocks of pieces we told the peer we have, and no larger than what
+// peers are expected to ask for, are served.
+bool valid_peer_request(const conn_state_t *state, const metainfo_t *torrent,
+                        const request_msg_t *request) {
+  if (request->index >= state->bitlen ||
+      !BITFIELD_ISSET(request->index, state->local_have)) {
+    return false;
+  }
+
+  if (request->length == 0 || request->length > PEER_REQUEST_SIZE) {
+    return false;
+  }
+
+  size_t piece_len =
+      piece_picker_piece_len(torrent->sh.picker, request->index);
+  return request->begin < piece_len &&
+         request->length <= piece_len - request->begin;
+}
+
+// Stops once PEER_WRITE_BACKLOG bytes are waiting for the socket, the rest
+// is served as the peer drains what is queued. Blocks are sent from the read
+// cache when it has their piece, a request for a piece still being loaded
+// holds up the ones behind it so blocks go out in the order asked.
+int service_peer_requests(peer_writer_t *out, conn_state_t *state,
+                          const metainfo_t *torrent) {
   log_printf(LOG_DEBUG, "Servicing piece requests...\n");
+  state->read_pending = false;
   request_msg_t request;
-  while (dequeue(state->peer_requests, &request) == 0) {
+  while (out->pending < PEER_WRITE_BACKLOG &&
+         queue_peek(state->peer_requests, &request) == 0) {
     log_printf(LOG_DEBUG,
                "popped request: \n"
                "    index: %u\n"
@@ -242,103 +244,96 @@ void service_peer_requests(int sockfd, conn_state_t *state,
                "    begin: %u\n",
                request.index, request.length, request.begin);
 
+    if (state->remote.choked || !valid_peer_request(state, torrent, &request)) {
+      log_printf(LOG_WARNING, "Dropping invalid request for piece %u\n",
+                 request.index);
+      dequeue(state->peer_requests, &request);
+      continue;
+    }
+
+    read_cache_entry_t *entry;
+    int cached = read_cache_get(torrent, request.index, &entry);
+    if (cached == 0) {
+      state->read_pending = true;
+      break;
+    }
+    dequeue(state->peer_requests, &request);
+
     peer_msg_t out_msg;
     out_msg.type = MSG_PIECE;
     out_msg.payload.piece.index = request.index;
     out_msg.payload.piece.blocklen = request.length;
     out_msg.payload.piece.begin = request.begin;
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    if (peer_msg_send(sockfd, &out_msg, torrent) < 0) {
-      return;
+    int ret = cached == 1
+                  ? peer_msg_send_cached(out, &out_msg.payload.piece, entry)
+                  : peer_msg_send(out, &out_msg, torrent);
+    if (ret < 0) {
+      return -1;
     }
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
     state->blocks_sent++;
   }
-}
-
-int notify_peers_have(metainfo_t *torrent, size_t have_index) {
-  pthread_mutex_lock(&torrent->sh.sh_lock);
-  int ret = 0;
 
-  for (size_t i = 0; i < torrent->sh.peer_connections->len; i++) {
-    peer_connection_t *conn = &torrent->sh.peer_connections->values[i];
-    if (pthread_equal(conn->thread, pthread_self()) == 0) {
-      continue;
-    }
+  return 0;
+}
 
-    char queue_name[64];
-    peer_connection_queue_name(conn->thread, queue_name, sizeof(queue_name));
-    mqd_t queue = mq_open(queue_name, O_WRONLY | O_NONBLOCK);
-    if (queue == (mqd_t)-1) {
-      ret = -1;
-      log_printf(LOG_ERROR, "Could not open queue for sending: %s\n",
-                 queue_name);
-    } else {
-      if (mq_send(queue, (char *)&have_index, sizeof(size_t), 0) < 0 &&
-          errno != EAGAIN) {
-        log_printf(LOG_ERROR, "Failed to send have event to peer threads\n");
-      }
-      mq_close(queue);
-    }
+// Publishes a completed piece to every connection. Each piece is appended to
+// the have log exactly once (by whoever flipped it to PIECE_STATE_HAVE), and
+// connections read it lock-free from their own cursor. Slots are published in
+// the order they were reserved, so readers never see a hole; waiting on an
+// earlier writer only spans its single store.
+void notify_peers_have(metainfo_t *torrent, size_t have_index) {
+  size_t slot =
+      __atomic_fetch_add(&torrent->sh.have_log_reserved, 1, __ATOMIC_RELAXED);
+  assert(slot < torrent->info.num_pieces);
+
+  torrent->sh.have_log[slot] = have_index;
+  while (__atomic_load_n(&torrent->sh.have_log_len, __ATOMIC_ACQUIRE) != slot) {
+    sched_yield();
   }
-
-  pthread_mutex_unlock(&torrent->sh.sh_lock);
-
-  return ret;
+  __atomic_store_n(&torrent->sh.have_log_len, slot + 1, __ATOMIC_RELEASE);
 }
 
 void torrent_complete(metainfo_t *torrent) {
-  pthread_mutex_lock(&torrent->sh.sh_lock);
-  torrent->sh.completed = true;
-  torrent->sh.state = TORRENT_STATE_SEEDING;
-  pthread_mutex_unlock(&torrent->sh.sh_lock);
+  __atomic_store_n(&torrent->sh.state, TORRENT_STATE_SEEDING,
+                   __ATOMIC_RELEASE);
+  __atomic_store_n(&torrent->sh.completed, true, __ATOMIC_RELEASE);
 
   for (size_t i = 0; i < torrent->info.files_count; i++) {
     dl_file_complete(torrent->files[i]);
   }
   log_printf(LOG_INFO, "Torrent completed\n");
+  if (torrent->write_cache) {
+    log_printf(LOG_INFO, "Write cache: %zu pieces written back, %zu bypassed\n",
+               torrent->write_cache->flushed, torrent->write_cache->bypassed);
+  }
 }
 
-void handle_piece_dl_completion(int sockfd, metainfo_t *torrent, size_t index) {
+void handle_piece_dl_completion(metainfo_t *torrent, size_t index) {
   assert(index < torrent->info.num_pieces);
-  bool completed = false;
-  pthread_mutex_lock(&torrent->sh.sh_lock);
-  if (torrent->sh.piece_states[index] != PIECE_STATE_HAVE) {
-    torrent->sh.piece_states[index] = PIECE_STATE_HAVE;
-    torrent->sh.pieces_left--;
-
-    assert(torrent->sh.pieces_left < torrent->info.num_pieces);
-
-    if (torrent->sh.pieces_left == 0) {
-      torrent->sh.completed = true;
-      completed = true;
-    }
+  // Only the thread that flips the piece counts it
+  if (piece_state_swap(torrent, index, PIECE_STATE_HAVE) == PIECE_STATE_HAVE) {
+    return;
   }
 
-  size_t pieces_left = torrent->sh.pieces_left;
-
-  pthread_mutex_unlock(&torrent->sh.sh_lock);
-
+  notify_peers_have(torrent, index);
+  size_t pieces_left =
+      __atomic_sub_fetch(&torrent->sh.pieces_left, 1, __ATOMIC_ACQ_REL);
+  assert(pieces_left < torrent->info.num_pieces);
   log_printf(LOG_DEBUG, "pieces left: %ld\n", pieces_left);
 
-  if (completed) {
+  if (pieces_left == 0) {
     torrent_complete(torrent);
   }
 
-  peer_msg_t msg;
-  msg.type = MSG_HAVE;
-  msg.payload.have = index;
-  peer_msg_send(sockfd, &msg, torrent);
-
-  notify_peers_have(torrent, index);
+  reactor_pool_notify();
 }
 
-void show_interested(int sockfd, conn_state_t *state,
+void show_interested(peer_writer_t *out, conn_state_t *state,
                      const metainfo_t *torrent) {
   peer_msg_t interested_msg;
   interested_msg.type = MSG_INTERESTED;
 
-  if (peer_msg_send(sockfd, &interested_msg, torrent) < 0) {
+  if (peer_msg_send(out, &interested_msg, torrent) < 0) {
     return;
   }
 
@@ -346,12 +341,12 @@ void show_interested(int sockfd, conn_state_t *state,
   log_printf(LOG_DEBUG, "Showed interested to the peer\n");
 }
 
-void show_not_interested(int sockfd, conn_state_t *state,
+void show_not_interested(peer_writer_t *out, conn_state_t *state,
                          const metainfo_t *torrent) {
   peer_msg_t not_interested_msg;
   not_interested_msg.type = MSG_NOT_INTERESTED;
 
-  if (peer_msg_send(sockfd, &not_interested_msg, torrent) < 0) {
+  if (peer_msg_send(out, &not_interested_msg, torrent) < 0) {
     return;
   }
 
@@ -359,52 +354,281 @@ void show_not_interested(int sockfd, conn_state_t *state,
   log_printf(LOG_DEBUG, "Showed not interested to the peer\n");
 }
 
-void process_piece_msg(int sockfd, conn_state_t *state, piece_msg_t *msg,
-                       metainfo_t *torrent) {
-  log_printf(LOG_INFO, "Processing piece\n");
+// Keeps the request queue about one bandwidth-delay product deep. The rate
+// is measured over PEER_RATE_WINDOW_MS windows and the delay is the minimum
+// request round trip seen over the last PEER_MIN_RTT_WINDOW_MS, so requests
+// queued up at the peer do not inflate it. PEER_PIPELINE_GAIN lets the depth
+// grow until the link, not the queue, is what limits the rate.
+void pipeline_update(conn_state_t *state, const local_request_t *req,
+                     long now) {
+  long rtt = now - req->requested_at;
+  if (state->min_rtt < 0 || rtt < state->min_rtt ||
+      now - state->min_rtt_stamp > PEER_MIN_RTT_WINDOW_MS) {
+    state->min_rtt = rtt;
+    state->min_rtt_stamp = now;
+  }
+
+  state->rate_window_bytes += req->len;
+  long elapsed = now - state->rate_window_start;
+  if (elapsed < PEER_RATE_WINDOW_MS) {
+    return;
+  }
+
+  // Follow increases right away so the queue ramps up quickly, but smooth
+  // decreases so a single slow window does not drain it
+  size_t sample = state->rate_window_bytes * 1000 / elapsed;
+  state->rate = sample > state->rate ? sample : (3 * state->rate + sample) / 4;
+  state->rate_window_start = now;
+  state->rate_window_bytes = 0;
+
+  long delay = state->min_rtt > 0 ? state->min_rtt : 1;
+  size_t bdp = state->rate * delay / 1000;
+  size_t depth = PEER_PIPELINE_GAIN * bdp / PEER_REQUEST_SIZE + 1;
+  if (depth < PEER_MIN_QUEUE_DEPTH) {
+    depth = PEER_MIN_QUEUE_DEPTH;
+  }
+  if (depth > state->max_queue_depth) {
+    depth = state->max_queue_depth;
+  }
 
+  if (depth != state->queue_depth) {
+    log_printf(LOG_DEBUG,
+               "Request queue depth %u -> %zu (rate %zu B/s, rtt %ld ms)\n",
+               state->queue_depth, depth, state->rate, state->min_rtt);
+  }
+  state->queue_depth = depth;
+}
+
+// Hands the blocks in flight back to the picker. Must hold picker_lock.
+void abort_local_requests(conn_state_t *state, metainfo_t *torrent) {
   for (size_t i = 0; i < state->local_requests->len; i++) {
-    piece_request_t *curr = &state->local_requests->values[i];
+    local_request_t *req = &state->local_requests->values[i];
+    uint32_t block = req->begin / PEER_REQUEST_SIZE;
+    if (piece_picker_abort_block(torrent->sh.picker, req->piece, block)) {
+      piece_state_cas(torrent, req->piece, PIECE_STATE_REQUESTED,
+                      PIECE_STATE_NOT_REQUESTED);
+    }
+  }
 
-    if (curr->piece_index == msg->index) {
-      for (size_t j = 0; j < curr->block_requests->len; j++) {
-        block_request_t *br = &curr->block_requests->values[j];
+  state->local_requests->len = 0;
+}
 
-        if (br->len == msg->blocklen && br->begin == msg->begin) {
-          br->completed = true;
-          curr->blocks_left--;
-          break;
-        }
-      }
+// Peers drop pending requests when they choke us, so those blocks need to be
+// asked for again, possibly from someone else.
+void pipeline_reset(conn_state_t *state, metainfo_t *torrent) {
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  abort_local_requests(state, torrent);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+}
 
-      if (curr->blocks_left == 0) {
-        bool valid = torrent_sha1_verify(torrent, curr->piece_index);
-
-        if (!valid) {
-          log_printf(LOG_WARNING,
-                     "Piece downloaded does not have expected SHA1 hash\n");
-
-          pthread_mutex_lock(&torrent->sh.sh_lock);
-          torrent->sh.piece_states[curr->piece_index] =
-              PIECE_STATE_NOT_REQUESTED;
-          pthread_mutex_unlock(&torrent->sh.sh_lock);
-        } else {
-          log_printf(LOG_INFO, "Successfully downloaded a piece %u\n",
-                     curr->piece_index);
-          handle_piece_dl_completion(sockfd, torrent, curr->piece_index);
-        }
-      }
+// The piece is downloaded again
+void piece_rejected(metainfo_t *torrent, uint32_t index) {
+  // Before the blocks can be picked again, so none of them lands in the
+  // dropped copy
+  write_cache_discard(torrent->write_cache, index);
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  piece_state_swap(torrent, index, PIECE_STATE_NOT_REQUESTED);
+  piece_picker_piece_failed(torrent->sh.picker, index);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+}
+
+// Runs once a verified piece is in storage, on a disk thread if it had to be
+// written back from the write cache
+void piece_written(metainfo_t *torrent, uint32_t index, int ret) {
+  if (ret < 0) {
+    piece_rejected(torrent, index);
+    return;
+  }
+
+  log_printf(LOG_INFO, "Successfully downloaded a piece %u\n", index);
+
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  piece_picker_piece_done(torrent->sh.picker, index);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  handle_piece_dl_completion(torrent, index);
+  // A duplicate block arriving during the flush may have started a new copy
+  write_cache_discard(torrent->write_cache, index);
+}
+
+void piece_verified(const hash_job_t *job, bool valid);
+
+// Hands parked pieces to the hashing threads while their queue has room.
+// Must hold hash_lock. Returns what the last hash_pool_try_submit() did.
+int hash_parked_pieces(metainfo_t *torrent) {
+  size_t num_pieces = torrent->info.num_pieces;
+  int ret = 1;
+  while (torrent->sh.hash_parked_len > 0) {
+    hash_job_t job = {
+        .torrent = torrent,
+        .piece = torrent->sh.hash_parked[torrent->sh.hash_parked_head],
+        .num_pieces = 1,
+        .done = piece_verified,
+    };
+    if ((ret = hash_pool_try_submit(&job)) <= 0) {
+      break;
+    }
+
+    torrent->sh.hash_parked_head =
+        (torrent->sh.hash_parked_head + 1) % num_pieces;
+    torrent->sh.hash_parked_len--;
+  }
+
+  return ret;
+}
+
+// Runs on a hashing thread once a downloaded piece has been checked
+void piece_verified(const hash_job_t *job, bool valid) {
+  metainfo_t *torrent = job->torrent;
+
+  // A slot of the hash queue is free again
+  pthread_mutex_lock(&torrent->sh.hash_lock);
+  hash_parked_pieces(torrent);
+  pthread_mutex_unlock(&torrent->sh.hash_lock);
+
+  if (!valid) {
+    log_printf(LOG_WARNING,
+               "Piece downloaded does not have expected SHA1 hash\n");
+    piece_rejected(torrent, job->piece);
+    return;
+  }
+
+  // Peers may ask for the piece as soon as we announce it, which waits
+  // until it is written
+  write_cache_flush(torrent, job->piece, piece_written);
+}
+
+// Queues the piece for hashing without waiting on the hashing threads: with
+// their queue full, the piece is parked and piece_verified() hands it over
+// once a slot frees up. A piece is only downloaded once at a time, so
+// num_pieces entries are enough.
+void verify_piece(metainfo_t *torrent, uint32_t index) {
+  pthread_mutex_lock(&torrent->sh.hash_lock);
+  size_t tail = (torrent->sh.hash_parked_head + torrent->sh.hash_parked_len) %
+                torrent->info.num_pieces;
+  torrent->sh.hash_parked[tail] = index;
+  torrent->sh.hash_parked_len++;
+  int ret = hash_parked_pieces(torrent);
+  pthread_mutex_unlock(&torrent->sh.hash_lock);
+
+  if (ret < 0) {
+    log_printf(LOG_ERROR, "Could not queue piece %u for hashing\n", index);
+  }
+}
+
+// Counts a block that is in place, in the write cache or in storage.
+// Blocks arriving after we gave up on them (e.g. after a choke) are just as
+// good, so count them whoever they were requested from.
+void block_arrived(metainfo_t *torrent, const piece_msg_t *msg,
+                   bool requested) {
+  uint32_t block = msg->begin / PEER_REQUEST_SIZE;
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  int completed = -1;
+  if (msg->begin % PEER_REQUEST_SIZE == 0 &&
+      msg->blocklen ==
+          piece_picker_block_len(torrent->sh.picker, msg->index, block)) {
+    completed = piece_picker_block_received(torrent->sh.picker, msg->index,
+                                            block, requested);
+  }
+  size_t prefix =
+      piece_picker_received_prefix(torrent->sh.picker, msg->index);
+  uint32_t epoch = torrent_sha1_epoch(torrent, msg->index);
+  bool endgame = piece_picker_endgame(torrent->sh.picker);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  // Hash what arrived in order while it is still in cache
+  if (completed >= 0) {
+    torrent_sha1_update(torrent, msg->index, prefix, epoch);
+  }
+
+  // Other peers may have the same block in flight: wake their connections up
+  // so they cancel it
+  if (completed >= 0 && endgame) {
+    reactor_pool_notify();
+  }
+
+  if (completed == 1) {
+    verify_piece(torrent, msg->index);
+  }
+}
+
+// Runs once a block received into memory is written, on a disk thread unless
+// the disk's queue was full
+void block_stored(const disk_job_t *job, int ret) {
+  metainfo_t *torrent = job->torrent;
+  piece_msg_t msg = {
+      .index = job->offset / torrent->info.piece_length,
+      .begin = job->offset % torrent->info.piece_length,
+      .blocklen = job->len,
+  };
+  bool requested = (uintptr_t)job->ctx;
+  disk_io_block_put(job->buf);
+
+  if (ret >= 0) {
+    block_arrived(torrent, &msg, requested);
+    return;
+  }
+
+  log_printf(LOG_ERROR, "Could not write block %u+%zu of piece %u\n",
+             msg.begin, msg.blocklen, msg.index);
+  // Our request is gone, so nobody would ask for the block again
+  if (requested) {
+    uint32_t block = msg.begin / PEER_REQUEST_SIZE;
+    pthread_mutex_lock(&torrent->sh.picker_lock);
+    if (piece_picker_abort_block(torrent->sh.picker, msg.index, block)) {
+      piece_state_cas(torrent, msg.index, PIECE_STATE_REQUESTED,
+                      PIECE_STATE_NOT_REQUESTED);
     }
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
   }
 }
 
-void process_msg(int sockfd, peer_msg_t *msg, conn_state_t *state,
-                 metainfo_t *torrent) {
+void process_piece_msg(peer_conn_t *conn, piece_msg_t *msg) {
+  log_printf(LOG_INFO, "Processing piece\n");
+  conn_state_t *state = conn->state;
+  metainfo_t *torrent = conn->torrent;
+
+  bool requested = false;
+  for (size_t i = 0; i < state->local_requests->len; i++) {
+    local_request_t *req = &state->local_requests->values[i];
+    if (req->piece == msg->index && req->begin == msg->begin &&
+        req->len == msg->blocklen) {
+      pipeline_update(state, req, reactor_now_ms());
+      *req = state->local_requests->values[--state->local_requests->len];
+      requested = true;
+      break;
+    }
+  }
+
+  if (!msg->data) {
+    block_arrived(torrent, msg, requested);
+    return;
+  }
+
+  // The block only counts once it is in storage, where it is hashed from
+  disk_job_t job = {
+      .torrent = torrent,
+      .op = DISK_OP_WRITE,
+      .offset = (size_t)msg->index * torrent->info.piece_length + msg->begin,
+      .len = msg->blocklen,
+      .buf = msg->data,
+      .done = block_stored,
+      .ctx = (void *)(uintptr_t)requested,
+  };
+  disk_io_submit_nowait(&job);
+}
+
+void process_msg(peer_conn_t *conn, peer_msg_t *msg) {
+  peer_writer_t *out = &conn->writer;
+  conn_state_t *state = conn->state;
+  metainfo_t *torrent = conn->torrent;
+
   switch (msg->type) {
   case MSG_KEEPALIVE:
     break;
   case MSG_CHOKE:
     state->local.choked = true;
+    pipeline_reset(state, torrent);
     break;
   case MSG_UNCHOKE:
     log_printf(LOG_DEBUG, "Unchoked\n");
@@ -417,29 +641,40 @@ void process_msg(int sockfd, peer_msg_t *msg, conn_state_t *state,
     state->remote.interested = false;
     break;
   case MSG_HAVE:
+    if (msg->payload.have >= state->bitlen ||
+        BITFIELD_ISSET(msg->payload.have, state->peer_have)) {
+      break;
+    }
     if (!state->local.interested &&
-        BITFIELD_ISSET(msg->payload.have, state->local_have)) {
-      show_interested(sockfd, state, torrent);
+        !BITFIELD_ISSET(msg->payload.have, state->local_have)) {
+      show_interested(out, state, torrent);
     }
     BITFIELD_SET(msg->payload.have, state->peer_have);
+
+    pthread_mutex_lock(&torrent->sh.picker_lock);
+    piece_picker_inc(torrent->sh.picker, msg->payload.have);
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
     break;
   case MSG_BITFIELD:
     assert(msg->payload.bitfield->size == BITFIELD_NUM_BYTES(state->bitlen));
-    memcpy(state->peer_have, msg->payload.bitfield->str,
-           BITFIELD_NUM_BYTES(state->bitlen));
 
-    pthread_mutex_lock(&torrent->sh.sh_lock);
     bool interested = false;
+    pthread_mutex_lock(&torrent->sh.picker_lock);
     for (size_t i = 0; i < torrent->info.num_pieces; i++) {
-      if (torrent->sh.piece_states[i] != PIECE_STATE_HAVE &&
-          BITFIELD_ISSET(i, state->peer_have)) {
-        interested = true;
-        break;
+      if (BITFIELD_ISSET(i, msg->payload.bitfield->str) &&
+          !BITFIELD_ISSET(i, state->peer_have)) {
+        BITFIELD_SET(i, state->peer_have);
+        piece_picker_inc(torrent->sh.picker, i);
       }
     }
-    pthread_mutex_unlock(&torrent->sh.sh_lock);
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+    for (size_t i = 0; i < torrent->info.num_pieces && !interested; i++) {
+      interested = BITFIELD_ISSET(i, msg->payload.bitfield->str) &&
+                   piece_state_get(torrent, i) != PIECE_STATE_HAVE;
+    }
     if (interested) {
-      show_interested(sockfd, state, torrent);
+      show_interested(out, state, torrent);
     }
     break;
 
@@ -453,12 +688,18 @@ void process_msg(int sockfd, peer_msg_t *msg, conn_state_t *state,
                msg->payload.request.begin);
 
     enqueue(state->peer_requests, &msg->payload.request);
+    read_cache_prefetch(torrent, msg->payload.request.index);
     break;
   case MSG_PIECE:
-    process_piece_msg(sockfd, state, &msg->payload.piece, torrent);
+    process_piece_msg(conn, &msg->payload.piece);
     state->block_recvd++;
     break;
   case MSG_CANCEL:
+    if (queue_remove(state->peer_requests, &msg->payload.request) == 0) {
+      log_printf(LOG_DEBUG, "Peer cancelled request for piece %u\n",
+                 msg->payload.request.index);
+    }
+    break;
   case MSG_PORT:
     break;
   default:
@@ -466,292 +707,809 @@ void process_msg(int sockfd, peer_msg_t *msg, conn_state_t *state,
   }
 }
 
-int process_queued_messages(int sockfd, metainfo_t *torrent,
-                            conn_state_t *state, time_t *last) {
-  while (peer_msg_buff_nonempty(sockfd)) {
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    pthread_testcancel();
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+// Decodes everything the peer sent so far. Reads until the socket is
+// drained, or until PEER_RECV_BUDGET bytes so one busy peer cannot starve
+// the others on this reactor (epoll is level-triggered, we come back).
+int process_queued_messages(peer_conn_t *conn) {
+  int sockfd = conn->src.fd;
+  size_t budget = PEER_RECV_BUDGET;
 
+  while (true) {
     peer_msg_t msg;
-    if (peer_msg_recv(sockfd, &msg, torrent) < 0) {
+    int ret;
+    while ((ret = peer_reader_next(&conn->reader, sockfd, conn->torrent,
+                                   &msg)) == 1) {
+      conn->last_msg_time = reactor_now_ms();
+
+      process_msg(conn, &msg);
+      if (msg.type == MSG_BITFIELD) {
+        byte_str_free(msg.payload.bitfield);
+      }
+    }
+
+    if (ret < 0) {
       return -1;
     }
-    *last = time(NULL);
 
-    process_msg(sockfd, &msg, state, torrent);
-    if (msg.type == MSG_BITFIELD) {
-      byte_str_free(msg.payload.bitfield);
+    ssize_t n = peer_reader_fill(&conn->reader, sockfd);
+    if (n <= 0) {
+      return n;
+    }
+
+    if ((size_t)n >= budget) {
+      return 0;
     }
+    budget -= n;
   }
+}
+
+int torrent_next_block(metainfo_t *torrent, uint8_t *peer_have_bf,
+                       local_request_t *out) {
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+
+  uint32_t piece, block;
+  if (piece_picker_pick_block(torrent->sh.picker, peer_have_bf, &piece,
+                              &block) < 0) {
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
+    return -1;
+  }
+
+  piece_state_cas(torrent, piece, PIECE_STATE_NOT_REQUESTED,
+                  PIECE_STATE_REQUESTED);
+  out->piece = piece;
+  out->begin = block * PEER_REQUEST_SIZE;
+  out->len = piece_picker_block_len(torrent->sh.picker, piece, block);
+
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
 
   return 0;
 }
 
-int torrent_next_request(metainfo_t *torrent, uint8_t *peer_have_bf,
-                         size_t *out) {
-  bool has_nr = false, has_r = false;
+bool local_request_in_flight(void *ctx, uint32_t piece, uint32_t block) {
+  const local_requests_t *requests = ctx;
+  for (size_t i = 0; i < requests->len; i++) {
+    if (requests->values[i].piece == piece &&
+        requests->values[i].begin == block * PEER_REQUEST_SIZE) {
+      return true;
+    }
+  }
 
-  uint32_t nr, r;
+  return false;
+}
 
-  pthread_mutex_lock(&torrent->sh.sh_lock);
-  for (size_t i = 0; i < torrent->info.num_pieces; i++) {
-    if (torrent->sh.piece_states[i] == PIECE_STATE_REQUESTED &&
-        BITFIELD_ISSET(i, peer_have_bf)) {
-      r = i;
-      has_r = true;
+// Endgame: every block left is in flight somewhere, so ask this peer too
+// instead of waiting on the slowest one. Duplicates are cancelled as soon as
+// the first copy arrives.
+int torrent_next_duplicate(metainfo_t *torrent, conn_state_t *state,
+                           local_request_t *out) {
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+
+  uint32_t piece, block;
+  if (piece_picker_pick_duplicate(torrent->sh.picker, state->peer_have,
+                                  local_request_in_flight,
+                                  state->local_requests, &piece, &block) < 0) {
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
+    return -1;
+  }
+
+  out->piece = piece;
+  out->begin = block * PEER_REQUEST_SIZE;
+  out->len = piece_picker_block_len(torrent->sh.picker, piece, block);
+
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  log_printf(LOG_DEBUG, "Endgame: requesting block %u of piece %u again\n",
+             block, piece);
+  return 0;
+}
+
+// Drops the requests for blocks someone else delivered first and tells the
+// peer not to send them.
+int cancel_stale_requests(peer_writer_t *out, conn_state_t *state,
+                          metainfo_t *torrent) {
+  local_requests_t *requests = state->local_requests;
+  size_t len = requests->len;
+
+  // Stale requests are swapped past the end of the list, where they stay
+  // until the cancels are queued
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  for (size_t i = 0; i < requests->len;) {
+    local_request_t *req = &requests->values[i];
+    uint32_t block = req->begin / PEER_REQUEST_SIZE;
+    if (piece_picker_block_wanted(torrent->sh.picker, req->piece, block)) {
+      i++;
+      continue;
     }
 
-    if (torrent->sh.piece_states[i] == PIECE_STATE_NOT_REQUESTED &&
-        BITFIELD_ISSET(i, peer_have_bf)) {
-      nr = i;
-      has_nr = true;
+    piece_picker_abort_block(torrent->sh.picker, req->piece, block);
+    local_request_t stale = *req;
+    *req = requests->values[--requests->len];
+    requests->values[requests->len] = stale;
+  }
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  for (size_t i = requests->len; i < len; i++) {
+    peer_msg_t cancel = {
+        .type = MSG_CANCEL,
+        .payload.request =
+            {
+                .index = requests->values[i].piece,
+                .begin = requests->values[i].begin,
+                .length = requests->values[i].len,
+            },
+    };
+
+    if (peer_msg_send(out, &cancel, torrent) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int send_requests(peer_writer_t *out, conn_state_t *state, metainfo_t *torrent,
+                  long *last_sent_request_time) {
+  // Blocks already in flight still arrive, they go to the write cache
+  state->disk_throttled = disk_io_congested(torrent);
+  while (state->local_requests->len < state->queue_depth &&
+         !state->disk_throttled) {
+    local_request_t req;
+    if (torrent_next_block(torrent, state->peer_have, &req) < 0 &&
+        torrent_next_duplicate(torrent, state, &req) < 0) {
+      log_printf(LOG_INFO, "Could not find a block to request\n");
+      if (state->local.interested && state->local_requests->len == 0) {
+        show_not_interested(out, state, torrent);
+      }
       break;
     }
+
+    peer_msg_t to_send;
+    to_send.type = MSG_REQUEST;
+    to_send.payload.request = (request_msg_t){
+        .index = req.piece,
+        .length = req.len,
+        .begin = req.begin,
+    };
+
+    long now = reactor_now_ms();
+    *last_sent_request_time = now;
+    req.requested_at = now;
+    // Track the block before sending, so it goes back to the picker if the
+    // connection dies
+    da_append(state->local_requests, req);
+
+    log_printf(LOG_DEBUG,
+               "Sending block request: \n"
+               "    piece_index: %u\n"
+               "    length: %u\n"
+               "    begin: %u\n",
+               req.piece, req.len, req.begin);
+    if (peer_msg_send(out, &to_send, torrent) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int peer_conn_pump(peer_conn_t *conn) {
+  conn_state_t *state = conn->state;
+
+  if (state->peer_requests->size > 0) {
+    if (service_peer_requests(&conn->writer, state, conn->torrent) < 0) {
+      return -1;
+    }
+  }
+
+  if (!state->local.choked && state->local.interested) {
+    if (send_requests(&conn->writer, state, conn->torrent,
+                      &conn->last_sent_request_time) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Asks for EPOLLOUT while some of the writer's queue is left, or while peer
+// requests wait for the backlog to drain.
+int peer_conn_watch(peer_conn_t *conn) {
+  // Requests waiting on the read cache are picked up on its notification,
+  // and a send through the ring reports back by itself
+  bool sending = conn->src.send_queued || conn->src.send_in_flight;
+  bool want_write =
+      !sending &&
+      (conn->writer.pending > 0 ||
+       (conn->state && conn->state->peer_requests->size > 0 &&
+        !conn->state->read_pending));
+  if (want_write == conn->want_write) {
+    return 0;
   }
 
-  if (!has_nr && !has_r) {
+  conn->want_write = want_write;
+  return reactor_modify(conn->reactor, &conn->src,
+                        want_write ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// Sends what is queued on the writer. With a ring, the send goes out along
+// with the other connections' at the end of the loop iteration.
+int peer_conn_flush(peer_conn_t *conn) {
+  if (conn->reactor->ring && conn->writer.pending > 0) {
+    if (reactor_queue_send(conn->reactor, &conn->src) < 0) {
+      return -1;
+    }
+    return peer_conn_watch(conn);
+  }
+
+  if (peer_writer_flush(&conn->writer, conn->src.fd, conn->torrent) < 0) {
+    return -1;
+  }
+
+  return peer_conn_watch(conn);
+}
+
+// Counts the connection against the torrent's max_peers. Fails if the
+// torrent already has as many connections as it wants.
+int peer_conn_register(peer_conn_t *conn, metainfo_t *torrent) {
+  peer_connection_t entry = {
+      .peer = conn->peer,
+      .conn = conn,
+  };
+
+  pthread_mutex_lock(&torrent->sh.sh_lock);
+  if (torrent->sh.peer_connections->len >= torrent->max_peers) {
     pthread_mutex_unlock(&torrent->sh.sh_lock);
     return -1;
   }
+  da_append(torrent->sh.peer_connections, entry);
+  pthread_mutex_unlock(&torrent->sh.sh_lock);
 
-  size_t ret = has_nr ? nr : r;
-  torrent->sh.piece_states[ret] = PIECE_STATE_REQUESTED;
+  conn->torrent = torrent;
+  return 0;
+}
 
+void peer_conn_unregister(peer_conn_t *conn) {
+  metainfo_t *torrent = conn->torrent;
+  pthread_mutex_lock(&torrent->sh.sh_lock);
+  peer_connections_t *conns = torrent->sh.peer_connections;
+  for (size_t i = 0; i < conns->len; i++) {
+    if (conns->values[i].conn == conn) {
+      conns->values[i] = conns->values[--conns->len];
+      break;
+    }
+  }
   pthread_mutex_unlock(&torrent->sh.sh_lock);
+}
 
-  log_printf(LOG_INFO, "Going to request piece %ld\n", ret);
+// Forgets what the peer had and hands the blocks it was downloading for us
+// back to the picker.
+void peer_conn_release_pieces(peer_conn_t *conn) {
+  metainfo_t *torrent = conn->torrent;
+  conn_state_t *state = conn->state;
 
-  *out = ret;
-  return 0;
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  piece_picker_remove_peer(torrent->sh.picker, state->peer_have);
+  abort_local_requests(state, torrent);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
 }
 
-// TODO: check values for better performance
-#define PEER_NUM_OUTSTANDING_REQUESTS 1
+void peer_conn_leave_half_open(peer_conn_t *conn) {
+  if (!conn->half_open) {
+    return;
+  }
 
-int send_requests(int sockfd, conn_state_t *state, metainfo_t *torrent,
-                  time_t *last_sent_request_time) {
-  int n = PEER_NUM_OUTSTANDING_REQUESTS - state->local_requests->len;
-  if (n <= 0) {
-    return 0;
+  metainfo_t *torrent = conn->torrent;
+  conn->half_open = false;
+  pthread_mutex_lock(&torrent->sh.sh_lock);
+  torrent->sh.half_open--;
+  pthread_mutex_unlock(&torrent->sh.sh_lock);
+}
+
+void peer_conn_leave_pending(peer_conn_t *conn) {
+  if (conn->pending) {
+    conn->pending = false;
+    peer_listener_release();
   }
+}
 
-  bool not_interested = false;
+void peer_conn_close(peer_conn_t *conn) {
+  reactor_detach(conn->reactor, &conn->src);
+  peer_conn_leave_pending(conn);
+  // Accepted connections only belong to a torrent after the handshake
+  if (conn->torrent) {
+    peer_conn_unregister(conn);
+  }
 
-  for (int i = 0; i < n; i++) {
-    size_t req_index;
-    if (torrent_next_request(torrent, state->peer_have, &req_index) < 0) {
-      log_printf(LOG_INFO, "Could not find a piece to request\n");
-      not_interested = true;
-      break;
-    }
+  shutdown(conn->src.fd, SHUT_RDWR);
+  close(conn->src.fd);
+
+  if (conn->state) {
+    peer_conn_release_pieces(conn);
+    conn_state_cleanup(conn->state);
+  }
+  peer_reader_free(&conn->reader);
+
+  log_printf(LOG_INFO, "Closed peer connection %s\n", conn->ipstr);
+
+  // The slot is free again, give it to the next candidate
+  if (conn->torrent) {
+    peer_conn_leave_half_open(conn);
+    peer_connection_dial(conn->torrent);
+  }
+
+  // The kernel may still be reading the writer, peer_conn_on_sent() frees
+  // it once the send is back
+  if (!conn->src.send_in_flight) {
+    peer_writer_free(&conn->writer);
+    reactor_defer_free(conn->reactor, conn);
+  }
+}
 
-    log_printf(LOG_INFO, "Requesting piece %ld\n", req_index);
-
-    piece_request_t *request = piece_request_create(torrent, req_index);
-    da_append(state->local_requests, *request);
-    log_printf(LOG_DEBUG, "Created piece request\n");
-
-    for (size_t j = 0; j < request->block_requests->len; j++) {
-      block_request_t *br = &request->block_requests->values[j];
-
-      peer_msg_t to_send;
-      to_send.type = MSG_REQUEST;
-      to_send.payload.request = (request_msg_t){
-          .index = request->piece_index,
-          .length = br->len,
-          .begin = br->begin,
-      };
-
-      *last_sent_request_time = time(NULL);
-      log_printf(LOG_DEBUG,
-                 "Sending block request: \n"
-                 "    piece_index: %ld\n"
-                 "    length: %ld\n"
-                 "    begin: %ld\n",
-                 request->piece_index, br->len, br->begin);
-      if (peer_msg_send(sockfd, &to_send, torrent) < 0) {
-        return -1;
+// Next point in time the connection has to wake up even if the peer stays
+// silent: to give up on connecting, to send a keep-alive or to time out.
+void peer_conn_schedule(peer_conn_t *conn) {
+  long deadline;
+  if (conn->phase != CONN_PHASE_ACTIVE) {
+    deadline = conn->phase_start + PEER_CONNECT_TIMEOUT_SEC * SEC_MS;
+  } else {
+    deadline = conn->last_msg_time + PEER_TIMEOUT_SEC * SEC_MS;
+    if (conn->last_sent_request_time >= 0) {
+      long keepalive =
+          conn->last_sent_request_time + PEER_KEEPALIVE_INTERVAL * SEC_MS;
+      if (keepalive < deadline) {
+        deadline = keepalive;
       }
     }
+  }
+
+  reactor_schedule(conn->reactor, &conn->src, deadline);
+}
+
+// The writer is pinned until the send is back, so the iovecs stay valid
+// while more messages are queued
+void peer_conn_on_send(reactor_t *r, reactor_source_t *src,
+                       struct io_uring_sqe *sqe) {
+  (void)r;
+  peer_conn_t *conn = (peer_conn_t *)src;
+  int iovcnt = peer_writer_iov(&conn->writer, conn->torrent, conn->send_iov);
+  peer_writer_pin(&conn->writer);
+
+  sqe->fd = src->fd;
+  if (iovcnt < 0) {
+    // Still needs a completion, an empty header fails the connection
+    conn->send_hdr.msg_iovlen = 0;
+    sqe->opcode = IORING_OP_NOP;
+    return;
+  }
+
+  conn->send_hdr = (struct msghdr){
+      .msg_iov = conn->send_iov,
+      .msg_iovlen = iovcnt,
+  };
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->send_hdr;
+  sqe->len = 1;
+  // Returns -EAGAIN when the socket is full instead of waiting for room,
+  // EPOLLOUT tells when to try again
+  sqe->msg_flags = MSG_DONTWAIT;
+}
+
+void peer_conn_on_sent(reactor_t *r, reactor_source_t *src, int res) {
+  peer_conn_t *conn = (peer_conn_t *)src;
+  peer_writer_unpin(&conn->writer);
+  if (!src->attached) {
+    // Closed while the send was in flight
+    peer_writer_free(&conn->writer);
+    reactor_defer_free(r, conn);
+    return;
+  }
+
+  if (conn->send_hdr.msg_iovlen == 0) {
+    res = -EINVAL;
+  }
+  if (res < 0 && res != -EAGAIN) {
+    log_printf(LOG_ERROR, "Could not send data to peer\n");
+    peer_conn_close(conn);
+    return;
+  }
+
+  // What was queued meanwhile goes out with the next batch, what the
+  // socket did not take waits for EPOLLOUT
+  int ret;
+  if (res > 0) {
+    peer_writer_consume(&conn->writer, res);
+    ret = peer_conn_flush(conn);
+  } else {
+    ret = peer_conn_watch(conn);
+  }
+  if (ret < 0) {
+    peer_conn_close(conn);
+  }
+}
+
+void peer_conn_on_notify(reactor_t *r, reactor_source_t *src) {
+  (void)r;
+  peer_conn_t *conn = (peer_conn_t *)src;
+  if (conn->phase != CONN_PHASE_ACTIVE) {
+    return;
+  }
+
+  service_have_events(conn);
+
+  metainfo_t *torrent = conn->torrent;
+  if (conn->state->read_pending &&
+      service_peer_requests(&conn->writer, conn->state, torrent) < 0) {
+    peer_conn_close(conn);
+    return;
+  }
+  if (conn->state->disk_throttled && peer_conn_pump(conn) < 0) {
+    peer_conn_close(conn);
+    return;
+  }
+
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  bool endgame = piece_picker_endgame(torrent->sh.picker);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  // In endgame, notifications also mean blocks arrived elsewhere: cancel our
+  // copies and use the free slots for what is still outstanding
+  if (endgame) {
+    if (cancel_stale_requests(&conn->writer, conn->state, torrent) < 0 ||
+        peer_conn_pump(conn) < 0) {
+      peer_conn_close(conn);
+      return;
+    }
+  }
 
-    piece_request_free(request);
+  if (peer_conn_flush(conn) < 0) {
+    peer_conn_close(conn);
   }
+}
 
-  if (state->local.interested && not_interested) {
-    show_not_interested(sockfd, state, torrent);
+int peer_conn_activate(peer_conn_t *conn) {
+  conn->state = conn_state_init(conn->torrent, &conn->have_cursor);
+  if (!conn->state) {
+    return -1;
   }
 
+  conn_state_t *state = conn->state;
+  peer_msg_t bitmsg = {
+      .type = MSG_BITFIELD,
+      .payload.bitfield =
+          byte_str_new(BITFIELD_NUM_BYTES(state->bitlen), state->local_have),
+  };
+  int ret = peer_msg_send(&conn->writer, &bitmsg, conn->torrent);
+  byte_str_free(bitmsg.payload.bitfield);
+  if (ret < 0) {
+    return -1;
+  }
+
+  unchoke(&conn->writer, state, conn->torrent);
+
+  conn->phase = CONN_PHASE_ACTIVE;
+  conn->phase_start = reactor_now_ms();
+  conn->last_msg_time = conn->phase_start;
+  conn->last_sent_request_time = -1;
+
   return 0;
 }
 
-void *peer_connection(void *arg) {
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-  pthread_cleanup_push(peer_connection_cleanup, arg);
-  {
-    int sockfd;
+int peer_conn_on_connected(peer_conn_t *conn) {
+  int err;
+  socklen_t len = sizeof(int);
+  if (getsockopt(conn->src.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+    log_printf(LOG_INFO, "Could not connect to peer %s\n", conn->ipstr);
+    return -1;
+  }
 
-    peer_arg_t *parg = (peer_arg_t *)arg;
-    if (parg->sockfd < 0) {
-      sockfd = peer_connect(arg);
-      if (sockfd < 0) {
-        goto fail_init;
-      }
+  log_printf(LOG_INFO, "Connection to peer %s estabilished successfully\n",
+             conn->ipstr);
+
+  peer_conn_leave_half_open(conn);
+  peer_connection_dial(conn->torrent);
+
+  if (peer_send_handshake(&conn->writer, conn->torrent->info_hash) < 0) {
+    return -1;
+  }
+
+  conn->phase = CONN_PHASE_HANDSHAKING;
+  conn->phase_start = reactor_now_ms();
 
-      parg->sockfd = sockfd;
+  conn->want_write = false;
+  return reactor_modify(conn->reactor, &conn->src, EPOLLIN);
+}
+
+// The peer spoke first: route it to the torrent it asked for and answer
+// with our own handshake.
+int peer_conn_on_inbound_handshake(peer_conn_t *conn,
+                                   const char info_hash[20]) {
+  peer_conn_leave_pending(conn);
+
+  metainfo_t *torrent = peer_listener_find_torrent(info_hash);
+  if (!torrent) {
+    log_printf(LOG_INFO, "Peer %s asked for a torrent we do not have\n",
+               conn->ipstr);
+    return -1;
+  }
+
+  if (peer_conn_register(conn, torrent) < 0) {
+    log_printf(LOG_INFO, "Refusing peer %s, too many connections\n",
+               conn->ipstr);
+    return -1;
+  }
+
+  return peer_send_handshake(&conn->writer, torrent->info_hash);
+}
+
+int peer_conn_on_handshake(peer_conn_t *conn) {
+  char info_hash[20];
+  char out_peer_id[20];
+  int ret;
+
+  while ((ret = peer_reader_handshake(&conn->reader, info_hash,
+                                      out_peer_id)) == 0) {
+    ssize_t n = peer_reader_fill(&conn->reader, conn->src.fd);
+    if (n <= 0) {
+      return n;
+    }
+  }
+
+  if (ret < 0) {
+    log_printf(LOG_ERROR, "Handshake failed\n");
+    return -1;
+  }
+
+  if (conn->inbound) {
+    if (peer_conn_on_inbound_handshake(conn, info_hash) < 0) {
+      return -1;
+    }
+  } else if (memcmp(info_hash, conn->torrent->info_hash, 20) != 0) {
+    log_printf(LOG_ERROR, "Received wrong info_hash from peer\n");
+    return -1;
+  }
+
+  log_printf(LOG_INFO, "Successful handshake with peer %.20s\n", out_peer_id);
+
+  if (peer_conn_activate(conn) < 0) {
+    return -1;
+  }
+
+  // Whatever the peer sent right after its handshake is already buffered
+  if (process_queued_messages(conn) < 0) {
+    return -1;
+  }
+
+  return peer_conn_pump(conn);
+}
+
+void peer_conn_on_event(reactor_t *r, reactor_source_t *src, uint32_t events) {
+  (void)r;
+  peer_conn_t *conn = (peer_conn_t *)src;
+  int ret = 0;
+
+  switch (conn->phase) {
+  case CONN_PHASE_CONNECTING:
+    if (events & EPOLLERR) {
+      log_printf(LOG_INFO, "Could not connect to peer %s\n", conn->ipstr);
+      ret = -1;
     } else {
-      sockfd = parg->sockfd;
+      ret = peer_conn_on_connected(conn);
     }
+    break;
+  case CONN_PHASE_HANDSHAKING:
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      ret = -1;
+    } else {
+      ret = peer_conn_on_handshake(conn);
+    }
+    break;
+  case CONN_PHASE_ACTIVE:
+    if (events & EPOLLERR) {
+      ret = -1;
+      break;
+    }
+    ret = process_queued_messages(conn);
+    if (ret == 0) {
+      ret = peer_conn_pump(conn);
+    }
+    break;
+  }
 
-    char ipstr[INET_ADDRSTRLEN];
-    print_ip(&parg->peer, ipstr, INET_ADDRSTRLEN);
+  if (ret == 0) {
+    ret = peer_conn_flush(conn);
+  }
 
-    char out_peer_id[20];
-    if (handshake(sockfd, parg->torrent->info_hash, out_peer_id) < 0) {
-      log_printf(LOG_ERROR, "Handshake failed\n");
-      goto fail_init;
-    };
+  if (ret < 0) {
+    peer_conn_close(conn);
+  } else {
+    peer_conn_schedule(conn);
+  }
+}
 
-    log_printf(LOG_INFO, "Successful handshake with peer %s\n", out_peer_id);
+void peer_conn_on_timer(reactor_t *r, reactor_source_t *src) {
+  (void)r;
+  peer_conn_t *conn = (peer_conn_t *)src;
+  long curr = reactor_now_ms();
 
-    mqd_t queue = peer_queue_open(O_RDONLY | O_CREAT | O_NONBLOCK);
-    if (queue == (mqd_t)-1) {
-      goto fail_init;
+  if (conn->phase != CONN_PHASE_ACTIVE) {
+    log_printf(LOG_INFO, "Peer %s timed out after %u seconds\n", conn->ipstr,
+               PEER_CONNECT_TIMEOUT_SEC);
+    peer_conn_close(conn);
+    return;
+  }
+
+  if (curr - conn->last_msg_time >= PEER_TIMEOUT_SEC * SEC_MS) {
+    log_printf(LOG_WARNING, "Connection with peer [%s] timed out\n",
+               conn->ipstr);
+    peer_conn_close(conn);
+    return;
+  }
+
+  if (conn->last_sent_request_time >= 0 &&
+      curr - conn->last_sent_request_time >= PEER_KEEPALIVE_INTERVAL * SEC_MS) {
+    log_printf(LOG_INFO, "A minute has passed since the last request, "
+                         "sending keep-alive msg\n");
+    peer_msg_t keepalive_msg;
+    keepalive_msg.type = MSG_KEEPALIVE;
+    if (peer_msg_send(&conn->writer, &keepalive_msg, conn->torrent) < 0 ||
+        peer_conn_flush(conn) < 0) {
+      peer_conn_close(conn);
+      return;
     }
-    pthread_cleanup_push(queue_cleanup, NULL);
-    {
-      conn_state_t *state = conn_state_init(parg->torrent);
-      if (!state) {
-        goto fail_init_state;
-      }
-      pthread_cleanup_push(conn_state_cleanup, state);
-      {
-        peer_msg_t bitmsg = {
-            .type = MSG_BITFIELD,
-            .payload.bitfield = byte_str_new(BITFIELD_NUM_BYTES(state->bitlen),
-                                             state->local_have),
-        };
-        if (peer_msg_send(sockfd, &bitmsg, parg->torrent) < 0) {
-          byte_str_free(bitmsg.payload.bitfield);
-          goto abort_conn;
-        }
-        byte_str_free(bitmsg.payload.bitfield);
-
-        unchoke(sockfd, state, parg->torrent);
-        time_t last_msg_time = time(NULL);
-        time_t last_sent_request_time = -1;
-        while (true) {
-          time_t curr = time(NULL);
-          if (curr - last_msg_time > PEER_TIMEOUT_SEC) {
-            log_printf(LOG_WARNING, "Connection with peer [%s] timed out\n",
-                       ipstr);
-            goto abort_conn;
-          }
-          if (last_sent_request_time >= 0 &&
-              curr - last_sent_request_time > PEER_KEEPALIVE_INTERVAL) {
-            log_printf(LOG_INFO, "A minute has passed since the last request, "
-                                 "sending keep-alive msg\n");
-            peer_msg_t keepalive_msg;
-            keepalive_msg.type = MSG_KEEPALIVE;
-            if (peer_msg_send(sockfd, &keepalive_msg, parg->torrent) < 0) {
-              goto abort_conn;
-            }
-
-            last_sent_request_time = time(NULL);
-          }
-
-          pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-          pthread_testcancel();
-          // usleep(250000);
-          pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-          service_have_events(sockfd, queue, parg->torrent, state->local_have);
-
-          if (process_queued_messages(sockfd, parg->torrent, state,
-                                      &last_msg_time) < 0) {
-            goto abort_conn;
-          }
-
-          if (state->peer_requests->size > 0) {
-            service_peer_requests(sockfd, state, parg->torrent);
-          } else {
-            if (!state->local.choked && state->local.interested) {
-              if (send_requests(sockfd, state, parg->torrent,
-                                &last_sent_request_time) < 0) {
-                goto abort_conn;
-              }
-            }
-          }
-        }
-
-      abort_conn:;
-      }
-      pthread_cleanup_pop(1);
-    fail_init_state:;
-    };
-    pthread_cleanup_pop(1);
-  fail_init:;
-  };
-  pthread_cleanup_pop(1);
-  pthread_exit(NULL);
+
+    conn->last_sent_request_time = curr;
+  }
+
+  peer_conn_schedule(conn);
 }
 
-int peer_connection_create(pthread_t *thread, peer_arg_t *arg) {
-  if (pthread_create(thread, NULL, peer_connection, arg)) {
-    log_printf(LOG_ERROR, "Failed to create peer conneciton thread\n");
+int peer_conn_dial(metainfo_t *torrent, const peer_t *peer) {
+  peer_conn_t *conn = calloc(1, sizeof(peer_conn_t));
+  if (!conn) {
     return -1;
-  };
+  }
+
+  conn->peer = *peer;
+  conn->phase = CONN_PHASE_CONNECTING;
+  conn->phase_start = reactor_now_ms();
+  print_ip(&conn->peer, conn->ipstr, sizeof(conn->ipstr));
+
+  if (peer_reader_init(&conn->reader) < 0) {
+    free(conn);
+    return -1;
+  }
+
+  if (peer_writer_init(&conn->writer) < 0) {
+    goto fail_writer;
+  }
+
+  if (peer_conn_register(conn, torrent) < 0) {
+    goto fail_register;
+  }
+
+  conn->src.fd = peer_connect(conn);
+  if (conn->src.fd < 0) {
+    log_printf(LOG_INFO, "Could not connect to peer %s\n", conn->ipstr);
+    goto fail;
+  }
+
+  conn->src.on_event = peer_conn_on_event;
+  conn->src.on_timer = peer_conn_on_timer;
+  conn->src.on_notify = peer_conn_on_notify;
+  conn->src.on_send = peer_conn_on_send;
+  conn->src.on_sent = peer_conn_on_sent;
+  conn->src.deadline = conn->phase_start + PEER_CONNECT_TIMEOUT_SEC * SEC_MS;
+  conn->reactor = reactor_pool_next();
+
+  // From here on the connection gives its half-open slot back itself
+  conn->half_open = true;
+  if (reactor_attach(conn->reactor, &conn->src, EPOLLOUT) < 0) {
+    conn->half_open = false;
+    close(conn->src.fd);
+    goto fail;
+  }
 
   return 0;
-}
 
-void peer_connection_queue_name(pthread_t thread, char *out, size_t len) {
-  assert(len >= strlen("/") + 2 * sizeof(pthread_t) + strlen("_queue") + 1);
+fail:
+  peer_conn_unregister(conn);
+fail_register:
+  peer_writer_free(&conn->writer);
+fail_writer:
+  peer_reader_free(&conn->reader);
+  free(conn);
+  return -1;
+}
 
-  size_t plen = 0;
-  plen += snprintf(out, len - plen, "/");
+bool same_peer(const peer_t *a, const peer_t *b) {
+  return a->addr.sa_in.sin_addr.s_addr == b->addr.sa_in.sin_addr.s_addr &&
+         a->addr.sa_in.sin_port == b->addr.sa_in.sin_port;
+}
 
-  for (uint8_t *cp = (uint8_t *)thread;
-       cp < ((uint8_t *)thread) + sizeof(pthread_t); cp++) {
-    plen += snprintf(out + plen, len - plen, "%02X", *cp);
-    if (plen == len)
+void peer_connection_dial(metainfo_t *torrent) {
+  while (true) {
+    pthread_mutex_lock(&torrent->sh.sh_lock);
+    peers_t *candidates = torrent->sh.candidates;
+    if (candidates->len == 0 ||
+        torrent->sh.half_open >= torrent->max_half_open ||
+        torrent->sh.peer_connections->len >= torrent->max_peers) {
+      pthread_mutex_unlock(&torrent->sh.sh_lock);
       return;
-  }
+    }
+
+    peer_t peer = candidates->values[--candidates->len];
+    torrent->sh.half_open++;
+    pthread_mutex_unlock(&torrent->sh.sh_lock);
 
-  snprintf(out + plen, len - plen, "_queue");
+    if (peer_conn_dial(torrent, &peer) < 0) {
+      pthread_mutex_lock(&torrent->sh.sh_lock);
+      torrent->sh.half_open--;
+      pthread_mutex_unlock(&torrent->sh.sh_lock);
+    }
+  }
 }
 
-void queue_cleanup(void *arg) {
-  (void)arg;
-  char queue_name[64];
-  peer_connection_queue_name(pthread_self(), queue_name, sizeof(queue_name));
-  if (mq_unlink(queue_name) < 0) {
-    log_printf(LOG_ERROR, "Failed to close queue %s\n", queue_name);
-  } else {
-    log_printf(LOG_DEBUG, "Successfully closed queue %s\n", queue_name);
+void peer_connection_add_candidates(metainfo_t *torrent, const peer_t *peers,
+                                    size_t num_peers) {
+  pthread_mutex_lock(&torrent->sh.sh_lock);
+  peers_t *candidates = torrent->sh.candidates;
+  peer_connections_t *conns = torrent->sh.peer_connections;
+
+  for (size_t i = 0; i < num_peers && candidates->len < PEER_MAX_CANDIDATES;
+       i++) {
+    bool known = false;
+    for (size_t j = 0; !known && j < conns->len; j++) {
+      known = same_peer(&peers[i], &conns->values[j].peer);
+    }
+    for (size_t j = 0; !known && j < candidates->len; j++) {
+      known = same_peer(&peers[i], &candidates->values[j]);
+    }
+
+    if (!known) {
+      da_append(candidates, peers[i]);
+    }
   }
+  pthread_mutex_unlock(&torrent->sh.sh_lock);
+
+  peer_connection_dial(torrent);
 }
 
-mqd_t peer_queue_open(int flags) {
-  char queue_name[64];
-  peer_connection_queue_name(pthread_self(), queue_name, sizeof(queue_name));
+int peer_connection_accept(int sockfd, const struct sockaddr_in *addr) {
+  peer_conn_t *conn = calloc(1, sizeof(peer_conn_t));
+  if (!conn) {
+    close(sockfd);
+    return -1;
+  }
 
-  struct mq_attr attr;
-  attr.mq_flags = O_NONBLOCK;
-  attr.mq_maxmsg = 10;
-  attr.mq_msgsize = sizeof(unsigned int);
-  attr.mq_curmsgs = 0;
+  if (peer_reader_init(&conn->reader) < 0) {
+    free(conn);
+    close(sockfd);
+    return -1;
+  }
 
-  mqd_t result = mq_open(queue_name, flags, 0600, &attr);
-  if (result != (mqd_t)-1) {
-    log_printf(LOG_INFO,
-               "successfully opened mqueue from receiver thread: %s\n",
-               queue_name);
-  } else {
-    log_printf(LOG_WARNING, "Failed to open mqueue in received thread: %s\n",
-               queue_name);
-    perror("mq_open");
+  if (peer_writer_init(&conn->writer) < 0) {
+    peer_reader_free(&conn->reader);
+    free(conn);
+    close(sockfd);
+    return -1;
   }
 
-  return result;
+  conn->peer.addr.sa_in = *addr;
+  conn->inbound = true;
+  conn->pending = true;
+  conn->phase = CONN_PHASE_HANDSHAKING;
+  conn->phase_start = reactor_now_ms();
+  print_ip(&conn->peer, conn->ipstr, sizeof(conn->ipstr));
+  log_printf(LOG_INFO, "Accepted connection from peer %s\n", conn->ipstr);
+
+  conn->src.fd = sockfd;
+  conn->src.on_event = peer_conn_on_event;
+  conn->src.on_timer = peer_conn_on_timer;
+  conn->src.on_notify = peer_conn_on_notify;
+  conn->src.on_send = peer_conn_on_send;
+  conn->src.on_sent = peer_conn_on_sent;
+  conn->src.deadline = conn->phase_start + PEER_CONNECT_TIMEOUT_SEC * SEC_MS;
+  conn->reactor = reactor_pool_next();
+
+  return reactor_attach(conn->reactor, &conn->src, EPOLLIN);
 }
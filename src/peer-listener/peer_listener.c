@@ -0,0 +1,152 @@
+#define _GNU_SOURCE // accept4
+#include "peer_listener.h"
+#include "../deps/stb_bencode.h"
+#include "../log/log.h"
+#include "../peer-connection/peer-connection.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  metainfo_t **values;
+} torrents_t;
+
+uint16_t listen_port = PEER_LISTEN_PORT_DEFAULT;
+
+peer_listener_t listener;
+torrents_t torrents;
+pthread_mutex_t torrents_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int peer_listener_add_torrent(metainfo_t *torrent) {
+  torrents_t *list = &torrents;
+
+  pthread_mutex_lock(&torrents_lock);
+  if (!list->values) {
+    da_init(list, sizeof(metainfo_t *));
+    if (!list->values) {
+      pthread_mutex_unlock(&torrents_lock);
+      return -1;
+    }
+  }
+  da_append(list, torrent);
+  pthread_mutex_unlock(&torrents_lock);
+
+  return 0;
+}
+
+metainfo_t *peer_listener_find_torrent(const char info_hash[20]) {
+  metainfo_t *ret = NULL;
+
+  pthread_mutex_lock(&torrents_lock);
+  for (size_t i = 0; i < torrents.len; i++) {
+    if (memcmp(torrents.values[i]->info_hash, info_hash, 20) == 0) {
+      ret = torrents.values[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&torrents_lock);
+
+  return ret;
+}
+
+void peer_listener_release(void) {
+  __atomic_sub_fetch(&listener.pending, 1, __ATOMIC_RELAXED);
+}
+
+// Accepting again after a pause for file descriptors
+void peer_listener_on_timer(reactor_t *r, reactor_source_t *src) {
+  reactor_modify(r, src, EPOLLIN);
+}
+
+void peer_listener_on_event(reactor_t *r, reactor_source_t *src,
+                            uint32_t events) {
+  (void)events;
+
+  // Level-triggered: drain the backlog, whatever is left wakes us up again
+  while (true) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int sockfd = accept4(src->fd, (struct sockaddr *)&addr, &len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sockfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+
+      log_printf(LOG_ERROR, "Could not accept peer connection: %s\n",
+                 strerror(errno));
+      // The backlog stays readable, so without a pause we would be woken up
+      // again right away until a descriptor frees up
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        reactor_modify(r, src, 0);
+        reactor_schedule(r, src, reactor_now_ms() + PEER_LISTEN_BACKOFF_MS);
+      }
+      return;
+    }
+
+    if (__atomic_load_n(&listener.pending, __ATOMIC_RELAXED) >=
+        PEER_LISTEN_MAX_PENDING) {
+      log_printf(LOG_INFO, "Refusing peer, too many pending handshakes\n");
+      close(sockfd);
+      continue;
+    }
+
+    __atomic_add_fetch(&listener.pending, 1, __ATOMIC_RELAXED);
+    if (peer_connection_accept(sockfd, &addr) < 0) {
+      peer_listener_release();
+    }
+  }
+}
+
+int peer_listener_start(uint16_t port) {
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
+    goto fail_socket;
+  }
+
+  int one = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    goto fail_bind;
+  }
+
+  if (listen(sockfd, PEER_LISTEN_BACKLOG) < 0) {
+    goto fail_bind;
+  }
+
+  listener.src.fd = sockfd;
+  listener.src.on_event = peer_listener_on_event;
+  listener.src.on_timer = peer_listener_on_timer;
+  listener.src.deadline = REACTOR_NO_DEADLINE;
+  listener.reactor = reactor_pool_next();
+  if (reactor_attach(listener.reactor, &listener.src, EPOLLIN) < 0) {
+    goto fail_bind;
+  }
+
+  listen_port = port;
+  log_printf(LOG_INFO, "Listening for peers on port %hu\n", port);
+
+  return 0;
+
+fail_bind:
+  close(sockfd);
+fail_socket:
+  log_printf(LOG_ERROR, "Could not listen on port %hu: %s\n", port,
+             strerror(errno));
+  return -1;
+}
@@ -0,0 +1,38 @@
+#ifndef PEER_LISTENER_H
+#define PEER_LISTENER_H
+
+#include "../file-parser/file-parser.h"
+#include "../reactor/reactor.h"
+#include <stdint.h>
+
+#define PEER_LISTEN_PORT_DEFAULT 6889
+#define PEER_LISTEN_BACKLOG 128
+// Accepted connections that have not sent their handshake yet, more are
+// closed right away
+#define PEER_LISTEN_MAX_PENDING 32
+// How long accepting pauses once we run out of file descriptors
+#define PEER_LISTEN_BACKOFF_MS 1000
+
+// Port announced to trackers
+extern uint16_t listen_port;
+
+// Accepts incoming peer connections on one of the reactors. Accepted sockets
+// become peer connections that learn which torrent they belong to from the
+// info_hash in the peer's handshake.
+typedef struct peer_listener {
+  reactor_source_t src;
+  reactor_t *reactor;
+  // Read and written atomically, connections give their slot back from the
+  // reactor they run on
+  size_t pending;
+} peer_listener_t;
+
+int peer_listener_start(uint16_t port);
+// Thread safe: an accepted connection got its handshake or went away, so it
+// no longer counts against PEER_LISTEN_MAX_PENDING
+void peer_listener_release(void);
+// Makes a torrent reachable by incoming connections
+int peer_listener_add_torrent(metainfo_t *torrent);
+metainfo_t *peer_listener_find_torrent(const char info_hash[20]);
+
+#endif // PEER_LISTENER_H
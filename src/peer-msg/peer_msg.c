@@ -1,209 +1,426 @@
 #include "peer_msg.h"
 #include "../bitfield/bitfield.h"
+#include "../disk-io/disk_io.h"
 #include "../file-parser/file-parser.h"
 #include "../log/log.h"
 #include "../peer-connection/peer-connection.h"
 #include "../peer-id/peer-id.h"
+#include "../piece-picker/piece_picker.h"
 #include "../piece-request/piece_request.h"
+#include "../read-cache/read_cache.h"
+#include "../storage/storage.h"
+#include "../write-cache/write_cache.h"
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/socket.h>
 
-int send_buff(int sockfd, char *buff, size_t bufflen) {
-  size_t total_sent = 0;
-  while (total_sent < bufflen || bufflen == 0) {
-    ssize_t n = send(sockfd, buff + total_sent, bufflen - total_sent, 0);
-    if (n < 0) {
-      log_printf(LOG_ERROR, "Could not send data to peer\n");
-      return -1;
-    }
-
-    total_sent += n;
-
-    if (bufflen == 0) {
-      break;
-    }
-  }
-
-  if (total_sent == bufflen) {
+uint32_t msgbuf_len(msg_type_t type, const metainfo_t *torrent) {
+  switch (type) {
+  case MSG_KEEPALIVE:
     return 0;
-  } else {
-    return -1;
+  case MSG_PIECE:
+    return 1 + 2 * sizeof(uint32_t) + PEER_REQUEST_SIZE;
+  case MSG_BITFIELD:
+    return 1 + BITFIELD_NUM_BYTES(torrent->info.num_pieces);
+  case MSG_REQUEST:
+  case MSG_CANCEL:
+    return 1 + 3 * sizeof(uint32_t);
+  case MSG_HAVE:
+    return 1 + sizeof(uint32_t);
+  case MSG_PORT:
+    return 1 + sizeof(uint16_t);
+  default:
+    return 1;
   }
 }
 
-int peer_send_handshake(int sockfd, char info_hash[20]) {
-  const char *pstr = "BitTorrent protocol";
-  uint8_t pstrlen = strlen(pstr);
-  char reserved[8] = {0};
-  size_t offset = 0;
-
-  size_t bufflen = 1 + pstrlen + sizeof(reserved) + 20 + sizeof(peer_id);
-  char req_buf[bufflen];
-  req_buf[0] = pstrlen;
-  offset++;
-
-  memcpy(req_buf + offset, pstr, pstrlen);
-  offset += pstrlen;
+int peer_writer_init(peer_writer_t *w) {
+  w->buf = malloc(PEER_WRITER_MIN_CAP);
+  if (!w->buf) {
+    return -1;
+  }
 
-  memcpy(req_buf + offset, reserved, sizeof(reserved));
-  offset += sizeof(reserved);
+  w->cap = PEER_WRITER_MIN_CAP;
+  w->start = 0;
+  w->end = 0;
+  w->blocks = NULL;
+  w->blocks_cap = 0;
+  w->num_blocks = 0;
+  w->pending = 0;
+  w->pinned = false;
+  w->retired = NULL;
 
-  memcpy(req_buf + offset, info_hash, 20);
-  offset += 20;
+  return 0;
+}
 
-  memcpy(req_buf + offset, peer_id, sizeof(peer_id));
-  offset += sizeof(peer_id);
+void peer_writer_free(peer_writer_t *w) {
+  for (size_t i = 0; i < w->num_blocks; i++) {
+    if (w->blocks[i].cached) {
+      read_cache_put(w->blocks[i].cached);
+    }
+  }
+  free(w->buf);
+  free(w->retired);
+  free(w->blocks);
+}
 
-  assert(offset == bufflen);
+// A pinned buffer is copied rather than moved when it grows, the old one is
+// kept until the writer is unpinned
+int peer_writer_grow(peer_writer_t *w, size_t cap) {
+  if (w->pinned && !w->retired) {
+    uint8_t *buf = malloc(cap);
+    if (!buf) {
+      return -1;
+    }
+    memcpy(buf, w->buf, w->end);
+    w->retired = w->buf;
+    w->buf = buf;
+    w->cap = cap;
+    return 0;
+  }
 
-  return send_buff(sockfd, req_buf, bufflen);
+  uint8_t *buf = realloc(w->buf, cap);
+  if (!buf) {
+    return -1;
+  }
+  w->buf = buf;
+  w->cap = cap;
+  return 0;
 }
 
-int peer_recv(int sockfd, char *outbuff, size_t len) {
-  size_t received = 0;
-  ssize_t nb;
-
-  do {
-    nb = recv(sockfd, outbuff + received, len - received, 0);
-    if (nb < 0) {
-      return -1;
+// Makes room for `len` more bytes at the end of the buffer
+uint8_t *peer_writer_reserve(peer_writer_t *w, size_t len) {
+  if (w->end + len > w->cap && w->start > 0 && !w->pinned) {
+    memmove(w->buf, w->buf + w->start, w->end - w->start);
+    for (size_t i = 0; i < w->num_blocks; i++) {
+      w->blocks[i].buf_end -= w->start;
     }
+    w->end -= w->start;
+    w->start = 0;
+  }
 
-    received += nb;
-  } while (nb > 0 && received < len);
+  if (w->end + len > w->cap) {
+    size_t cap = w->cap * 2;
+    if (cap < w->end + len) {
+      cap = w->end + len;
+    }
 
-  if (received == len) {
-    return 0;
+    if (peer_writer_grow(w, cap) < 0) {
+      return NULL;
+    }
   }
 
-  return -1;
+  uint8_t *out = w->buf + w->end;
+  w->end += len;
+  w->pending += len;
+  return out;
 }
 
-int peer_recv_handshake(int sockfd, char info_hash[20], char out_peer_id[20]) {
+static inline uint8_t *write_u32(uint8_t *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(uint32_t));
+  return p + sizeof(uint32_t);
+}
+
+int peer_send_handshake(peer_writer_t *w, char info_hash[20]) {
   const char *pstr = "BitTorrent protocol";
   uint8_t pstrlen = strlen(pstr);
   char reserved[8] = {0};
-  size_t offset = 0;
 
   size_t bufflen = 1 + pstrlen + sizeof(reserved) + 20 + sizeof(peer_id);
-  char buff[bufflen];
+  uint8_t *p = peer_writer_reserve(w, bufflen);
+  if (!p) {
+    return -1;
+  }
+
+  *p++ = pstrlen;
+  memcpy(p, pstr, pstrlen);
+  p += pstrlen;
+  memcpy(p, reserved, sizeof(reserved));
+  p += sizeof(reserved);
+  memcpy(p, info_hash, 20);
+  p += 20;
+  memcpy(p, peer_id, sizeof(peer_id));
+
+  return 0;
+}
 
-  if (peer_recv(sockfd, buff, bufflen) < 0) {
+// Storage that is not mapped in memory cannot be sent in place: the block is
+// read into the buffer right away.
+int peer_msg_copy_piece(peer_writer_t *w, const piece_msg_t *piece,
+                        const metainfo_t *torrent) {
+  size_t header = sizeof(uint32_t) + 1 + 2 * sizeof(uint32_t);
+  uint8_t *p = peer_writer_reserve(w, header + piece->blocklen);
+  if (!p) {
     return -1;
   }
 
-  if (buff[offset] != pstrlen) {
+  size_t offset = (size_t)piece->index * torrent->info.piece_length +
+                  piece->begin;
+  if (storage_read(torrent, offset, p + header, piece->blocklen) < 0) {
+    log_printf(LOG_ERROR, "Could not read block %u+%zu of piece %u\n",
+               piece->begin, piece->blocklen, piece->index);
+    w->end -= header + piece->blocklen;
+    w->pending -= header + piece->blocklen;
     return -1;
   }
-  offset++;
 
-  if (strncmp(buff + offset, pstr, pstrlen) != 0) {
+  p = write_u32(p, 1 + 2 * sizeof(uint32_t) + piece->blocklen);
+  *p++ = MSG_PIECE;
+  p = write_u32(p, piece->index);
+  write_u32(p, piece->begin);
+
+  log_printf(LOG_INFO, "Sending block %u+%zu of piece %u\n", piece->begin,
+             piece->blocklen, piece->index);
+  return 0;
+}
+
+// Only the header is buffered, the block itself is sent in place when the
+// writer is flushed.
+int peer_writer_add_block(peer_writer_t *w, const piece_msg_t *piece,
+                          struct read_cache_entry *cached) {
+  if (w->num_blocks == w->blocks_cap) {
+    size_t cap = w->blocks_cap ? w->blocks_cap * 2 : 8;
+    peer_out_block_t *blocks = realloc(w->blocks, cap * sizeof(*blocks));
+    if (!blocks) {
+      return -1;
+    }
+    w->blocks = blocks;
+    w->blocks_cap = cap;
+  }
+
+  uint8_t *p = peer_writer_reserve(w, sizeof(uint32_t) + 1 +
+                                          2 * sizeof(uint32_t));
+  if (!p) {
     return -1;
   }
-  offset += pstrlen;
+  p = write_u32(p, 1 + 2 * sizeof(uint32_t) + piece->blocklen);
+  *p++ = MSG_PIECE;
+  p = write_u32(p, piece->index);
+  write_u32(p, piece->begin);
+
+  w->blocks[w->num_blocks++] = (peer_out_block_t){
+      .buf_end = w->end,
+      .block = *piece,
+      .sent = 0,
+      .cached = cached,
+  };
+  w->pending += piece->blocklen;
+
+  log_printf(LOG_INFO, "Sending block %u+%zu of piece %u\n", piece->begin,
+             piece->blocklen, piece->index);
+  return 0;
+}
 
-  // Skip reserved
-  offset += 8;
+int peer_msg_send_piece(peer_writer_t *w, const piece_msg_t *piece,
+                        const metainfo_t *torrent) {
+  if (!storage_mapped(torrent)) {
+    return peer_msg_copy_piece(w, piece, torrent);
+  }
 
-  if (strncmp(buff + offset, info_hash, 20) != 0) {
-    log_printf(LOG_ERROR, "Received wrong info_hash from peer\n");
+  struct iovec iov[PIECE_MAX_SPANS];
+  if (piece_request_spans(torrent, piece->index, piece->begin,
+                          piece->blocklen, iov, PIECE_MAX_SPANS) < 0) {
+    log_printf(LOG_ERROR, "Block %u+%zu of piece %u is out of range\n",
+               piece->begin, piece->blocklen, piece->index);
     return -1;
   }
 
-  offset += 20;
+  return peer_writer_add_block(w, piece, NULL);
+}
 
-  memcpy(out_peer_id, buff + offset, 20);
+int peer_msg_send_cached(peer_writer_t *w, const piece_msg_t *piece,
+                         struct read_cache_entry *entry) {
+  assert(piece->begin + piece->blocklen <= entry->len);
+  if (peer_writer_add_block(w, piece, entry) < 0) {
+    read_cache_put(entry);
+    return -1;
+  }
 
   return 0;
 }
 
-uint32_t msgbuf_len(msg_type_t type, const metainfo_t *torrent) {
-  switch (type) {
-  case MSG_KEEPALIVE:
-    return 0;
-  case MSG_PIECE:
-    return 1 + 2 * sizeof(uint32_t) + PEER_REQUEST_SIZE;
-  case MSG_BITFIELD:
-    return 1 + BITFIELD_NUM_BYTES(torrent->info.num_pieces);
-  case MSG_REQUEST:
-    return 1 + 3 * sizeof(uint32_t);
-  case MSG_HAVE:
-  case MSG_PORT:
-    return 1 + sizeof(uint32_t);
-  default:
-    return 1;
+int peer_msg_send(peer_writer_t *w, peer_msg_t *msg,
+                  const metainfo_t *torrent) {
+  if (msg->type == MSG_PIECE) {
+    return peer_msg_send_piece(w, &msg->payload.piece, torrent);
   }
-}
 
-int peer_msg_send(int sockfd, peer_msg_t *msg, const metainfo_t *torrent) {
   uint32_t len = msgbuf_len(msg->type, torrent);
   log_printf(LOG_INFO, "Sending message of type: %ld, len: %u\n", msg->type,
              len);
-  len = htonl(len);
 
-  if (send_buff(sockfd, (char *)&len, sizeof(uint32_t)) < 0) {
+  uint8_t *p = peer_writer_reserve(w, sizeof(uint32_t) + len);
+  if (!p) {
     return -1;
   }
+  p = write_u32(p, len);
 
   if (msg->type == MSG_KEEPALIVE) {
     return 0;
   }
-
-  char out = msg->type;
-  if (send_buff(sockfd, &out, 1) < 0) {
-    return -1;
-  }
+  *p++ = msg->type;
 
   switch (msg->type) {
-  case MSG_KEEPALIVE: {
-    if (send_buff(sockfd, "", 0) < 0) {
-      return -1;
-    }
-  }
   case MSG_CHOKE:
   case MSG_UNCHOKE:
   case MSG_INTERESTED:
   case MSG_NOT_INTERESTED:
-    assert(ntohl(len) == 1);
+    assert(len == 1);
     return 0;
-  case MSG_PIECE: { // TODO: Send pieces
-    break;
-  }
   case MSG_BITFIELD: {
     assert(msg->payload.bitfield);
-    return send_buff(sockfd, (char *)msg->payload.bitfield->str,
-                     msg->payload.bitfield->size);
+    assert(msg->payload.bitfield->size == len - 1);
+    memcpy(p, msg->payload.bitfield->str, msg->payload.bitfield->size);
+    return 0;
   }
-  case MSG_REQUEST: {
-    uint32_t u32 = htonl(msg->payload.request.index);
-    if (send_buff(sockfd, (char *)&u32, sizeof(uint32_t)) < 0) {
-      return -1;
-    }
-    u32 = htonl(msg->payload.request.begin);
-    if (send_buff(sockfd, (char *)&u32, sizeof(uint32_t)) < 0) {
-      return -1;
-    }
-    u32 = htonl(msg->payload.request.length);
-    if (send_buff(sockfd, (char *)&u32, sizeof(uint32_t)) < 0) {
-      return -1;
-    }
-
+  case MSG_REQUEST:
+  case MSG_CANCEL: {
+    p = write_u32(p, msg->payload.request.index);
+    p = write_u32(p, msg->payload.request.begin);
+    write_u32(p, msg->payload.request.length);
     return 0;
   }
   case MSG_HAVE: {
-    uint32_t payload = htonl(msg->payload.have);
-    return send_buff(sockfd, (char *)&payload, sizeof(uint32_t));
+    write_u32(p, msg->payload.have);
+    return 0;
   }
   case MSG_PORT: {
-    uint32_t port = htonl(msg->payload.listen_port);
-    return send_buff(sockfd, (char *)&port, sizeof(uint32_t));
+    uint16_t port = htons(msg->payload.listen_port);
+    memcpy(p, &port, sizeof(uint16_t));
+    return 0;
   }
   default:
     return -1;
   }
+}
+
+void peer_writer_pin(peer_writer_t *w) { w->pinned = true; }
+
+void peer_writer_unpin(peer_writer_t *w) {
+  w->pinned = false;
+  free(w->retired);
+  w->retired = NULL;
+}
+
+void peer_writer_consume(peer_writer_t *w, size_t n) {
+  w->pending -= n;
+
+  while (n > 0) {
+    if (w->num_blocks > 0 && w->start == w->blocks[0].buf_end) {
+      peer_out_block_t *out = &w->blocks[0];
+      size_t take = out->block.blocklen - out->sent;
+      if (take > n) {
+        take = n;
+      }
+      out->sent += take;
+      n -= take;
+
+      if (out->sent == out->block.blocklen) {
+        if (out->cached) {
+          read_cache_put(out->cached);
+        }
+        w->num_blocks--;
+        memmove(w->blocks, w->blocks + 1, w->num_blocks * sizeof(*out));
+      }
+      continue;
+    }
+
+    size_t limit = w->num_blocks > 0 ? w->blocks[0].buf_end : w->end;
+    size_t take = limit - w->start;
+    if (take > n) {
+      take = n;
+    }
+    w->start += take;
+    n -= take;
+  }
+
+  if (w->pending == 0) {
+    w->start = 0;
+    w->end = 0;
+  }
+}
+
+int peer_writer_iov(const peer_writer_t *w, const metainfo_t *torrent,
+                    struct iovec *iov) {
+  size_t iovcnt = 0;
+  size_t pos = w->start;
+  size_t i;
+
+  for (i = 0; i < w->num_blocks; i++) {
+    if (iovcnt + 1 + PIECE_MAX_SPANS > PEER_WRITER_MAX_IOV) {
+      break;
+    }
+
+    const peer_out_block_t *out = &w->blocks[i];
+    if (out->buf_end > pos) {
+      iov[iovcnt++] = (struct iovec){
+          .iov_base = w->buf + pos,
+          .iov_len = out->buf_end - pos,
+      };
+      pos = out->buf_end;
+    }
+
+    if (out->cached) {
+      iov[iovcnt++] = (struct iovec){
+          .iov_base = out->cached->data + out->block.begin + out->sent,
+          .iov_len = out->block.blocklen - out->sent,
+      };
+      continue;
+    }
+
+    size_t left = out->block.blocklen - out->sent;
+    int spans = piece_request_spans(torrent, out->block.index,
+                                    out->block.begin + out->sent, left,
+                                    iov + iovcnt, PIECE_MAX_SPANS);
+    if (spans < 0) {
+      return -1;
+    }
+    for (int s = 0; s < spans; s++) {
+      left -= iov[iovcnt++].iov_len;
+    }
+    // A block across more files than fit goes out over several sends
+    if (left > 0) {
+      break;
+    }
+  }
+
+  if (i == w->num_blocks && w->end > pos) {
+    iov[iovcnt++] = (struct iovec){
+        .iov_base = w->buf + pos,
+        .iov_len = w->end - pos,
+    };
+  }
+
+  return iovcnt;
+}
+
+int peer_writer_flush(peer_writer_t *w, int sockfd,
+                      const metainfo_t *torrent) {
+  while (w->pending > 0) {
+    struct iovec iov[PEER_WRITER_MAX_IOV];
+    int iovcnt = peer_writer_iov(w, torrent, iov);
+    if (iovcnt < 0) {
+      return -1;
+    }
+
+    struct msghdr hdr = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+    ssize_t n = sendmsg(sockfd, &hdr, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n < 0) {
+      log_printf(LOG_ERROR, "Could not send data to peer\n");
+      return -1;
+    }
+
+    peer_writer_consume(w, n);
+  }
 
   return 0;
 }
@@ -218,166 +435,338 @@ static inline bool valid_len(msg_type_t type, const metainfo_t *torrent,
   return len == msgbuf_len(type, torrent);
 }
 
-int peer_msg_recv_piece(int sockfd, peer_msg_t *out, const metainfo_t *torrent,
-                        uint32_t len) {
-  log_printf(LOG_INFO, "Receiving piece\n");
-  uint32_t u32, left = len;
-
-  if (peer_recv(sockfd, (char *)&u32, sizeof(u32)) < 0) {
+int peer_reader_init(peer_reader_t *r) {
+  r->buf = malloc(PEER_READER_MIN_CAP);
+  if (!r->buf) {
     return -1;
   }
 
-  out->payload.piece.index = ntohl(u32);
-  left -= sizeof(uint32_t);
+  r->cap = PEER_READER_MIN_CAP;
+  r->start = 0;
+  r->end = 0;
+  r->piece_left = 0;
+  r->cached = NULL;
+  r->dropping = false;
 
-  if (peer_recv(sockfd, (char *)&u32, sizeof(u32)) < 0) {
-    return -1;
+  return 0;
+}
+
+void peer_reader_free(peer_reader_t *r) {
+  if (r->cached) {
+    write_cache_put(r->cached);
   }
+  free(r->buf);
+}
 
-  out->payload.piece.begin = ntohl(u32);
-  left -= sizeof(uint32_t);
+ssize_t peer_reader_fill(peer_reader_t *r, int sockfd) {
+  // Whatever is left is the start of an incomplete message: move it to the
+  // front so the next read has the whole tail of the buffer
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
 
-  out->payload.piece.blocklen = left;
-  piece_request_t *pr = piece_request_create(torrent, out->payload.piece.index);
-  if (!pr) {
+  if (r->end == r->cap) {
     return -1;
   }
 
-  block_request_t *br = piece_request_block_at(pr, out->payload.piece.begin);
-  if (!br) {
-    log_printf(LOG_ERROR, "Could not find block_request\n");
+  ssize_t n = recv(sockfd, r->buf + r->end, r->cap - r->end, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  if (n <= 0) {
     return -1;
   }
 
-  for (size_t i = 0; i < br->filemems->len; i++) {
-    filemem_t mem = br->filemems->values[i];
-    log_printf(LOG_DEBUG, "Writing %zu bytes to %p\n", mem.size, mem.mem);
-    if (peer_recv(sockfd, mem.mem, mem.size) < 0) {
-      piece_request_free(pr);
+  r->end += n;
+  return n;
+}
+
+int peer_reader_handshake(peer_reader_t *r, char out_info_hash[20],
+                          char out_peer_id[20]) {
+  const char *pstr = "BitTorrent protocol";
+  uint8_t pstrlen = strlen(pstr);
+  size_t bufflen = 1 + pstrlen + 8 + 20 + sizeof(peer_id);
+
+  if (r->end - r->start < bufflen) {
+    return 0;
+  }
+
+  uint8_t *buff = r->buf + r->start;
+  if (buff[0] != pstrlen || memcmp(buff + 1, pstr, pstrlen) != 0) {
+    return -1;
+  }
+
+  // Skip reserved
+  size_t offset = 1 + pstrlen + 8;
+  memcpy(out_info_hash, buff + offset, 20);
+  memcpy(out_peer_id, buff + offset + 20, 20);
+
+  r->start += bufflen;
+  return 1;
+}
+
+static inline uint32_t read_u32(const uint8_t *buf) {
+  uint32_t u32;
+  memcpy(&u32, buf, sizeof(uint32_t));
+  return ntohl(u32);
+}
+
+// Where the next `len` bytes of the current block go: its write cache entry,
+// or the file mappings. Blocks we do not want go to `dropped`, and so does
+// the rest of the block once the entry is sealed, because its piece was
+// verified or dropped meanwhile.
+// Copies into the entry end with peer_reader_wrote().
+int peer_reader_spans(peer_reader_t *r, const metainfo_t *torrent, size_t len,
+                      uint8_t *dropped, struct iovec *iov) {
+  piece_msg_t *piece = &r->piece;
+  uint32_t done = piece->blocklen - r->piece_left;
+  if (r->cached && !write_cache_begin_write(r->cached)) {
+    write_cache_put(r->cached);
+    r->cached = NULL;
+    r->dropping = true;
+  }
+
+  if (r->dropping) {
+    iov[0] = (struct iovec){
+        .iov_base = dropped + done,
+        .iov_len = len,
+    };
+    return 1;
+  }
+
+  if (r->cached) {
+    iov[0] = (struct iovec){
+        .iov_base = r->cached->data + piece->begin + done,
+        .iov_len = len,
+    };
+    return 1;
+  }
+
+  return piece_request_spans(torrent, piece->index, piece->begin + done, len,
+                             iov, PIECE_MAX_SPANS);
+}
+
+void peer_reader_wrote(peer_reader_t *r) {
+  if (r->cached) {
+    write_cache_end_write(r->cached);
+  }
+}
+
+// Moves the rest of the current block into memory: first what is already
+// buffered, then straight from the socket.
+int peer_reader_piece(peer_reader_t *r, int sockfd, const metainfo_t *torrent,
+                      peer_msg_t *out) {
+  piece_msg_t *piece = &r->piece;
+  struct iovec iov[PIECE_MAX_SPANS];
+  uint8_t dropped[PEER_REQUEST_SIZE];
+
+  size_t buffered = r->end - r->start;
+  if (buffered > r->piece_left) {
+    buffered = r->piece_left;
+  }
+  while (buffered > 0) {
+    int spans = peer_reader_spans(r, torrent, buffered, dropped, iov);
+    if (spans < 0) {
       return -1;
     }
+
+    // Blocks across many files may take several rounds
+    for (int i = 0; i < spans; i++) {
+      memcpy(iov[i].iov_base, r->buf + r->start, iov[i].iov_len);
+      r->start += iov[i].iov_len;
+      r->piece_left -= iov[i].iov_len;
+      buffered -= iov[i].iov_len;
+    }
+    peer_reader_wrote(r);
   }
 
-  piece_request_free(pr);
-  return 0;
+  while (r->piece_left > 0) {
+    int spans = peer_reader_spans(r, torrent, r->piece_left, dropped, iov);
+    if (spans < 0) {
+      return -1;
+    }
+
+    ssize_t n = readv(sockfd, iov, spans);
+    peer_reader_wrote(r);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    r->piece_left -= n;
+  }
+
+  if (r->cached) {
+    write_cache_put(r->cached);
+    r->cached = NULL;
+  }
+  r->dropping = false;
+
+  out->type = MSG_PIECE;
+  out->payload.piece = *piece;
+  return 1;
 }
 
-int peer_msg_recv(int sockfd, peer_msg_t *out, const metainfo_t *torrent) {
-  uint32_t len;
-  if (peer_recv(sockfd, (char *)&len, sizeof(len)) < 0) {
+// Storage that is not mapped in memory gets the block copied out of the
+// buffer once all of it arrived, for a disk thread to write it (see
+// process_piece_msg()).
+int peer_reader_copy_piece(peer_reader_t *r, peer_msg_t *out) {
+  piece_msg_t *piece = &r->piece;
+  size_t header = sizeof(uint32_t) + 1 + 2 * sizeof(uint32_t);
+  if (r->end - r->start < header + piece->blocklen) {
+    return 0;
+  }
+
+  assert(piece->blocklen <= DISK_IO_BLOCK_SIZE);
+  uint8_t *data = disk_io_block_get();
+  if (!data) {
     return -1;
   }
+  memcpy(data, r->buf + r->start + header, piece->blocklen);
 
-  len = ntohl(len);
+  r->start += header + piece->blocklen;
+  out->type = MSG_PIECE;
+  out->payload.piece = *piece;
+  out->payload.piece.data = data;
+  return 1;
+}
 
-  log_printf(LOG_INFO, "Receiving message of length %u\n", len);
+// Whether the current block is one we are still missing. Anything else, be
+// it a block of a piece we have, one received already or one that does not
+// line up with the picker's blocks, must not overwrite what was verified or
+// hashed.
+bool peer_reader_block_wanted(const peer_reader_t *r, metainfo_t *torrent) {
+  const piece_msg_t *piece = &r->piece;
+  uint32_t block = piece->begin / PEER_REQUEST_SIZE;
+  if (piece->begin % PEER_REQUEST_SIZE != 0) {
+    return false;
+  }
 
-  if (len == 0) {
-    out->type = MSG_KEEPALIVE;
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  bool wanted =
+      piece_picker_block_wanted(torrent->sh.picker, piece->index, block) &&
+      piece->blocklen ==
+          piece_picker_block_len(torrent->sh.picker, piece->index, block);
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+
+  return wanted;
+}
+
+int peer_reader_next(peer_reader_t *r, int sockfd, metainfo_t *torrent,
+                     peer_msg_t *out) {
+  if (r->piece_left > 0) {
+    return peer_reader_piece(r, sockfd, torrent, out);
+  }
+
+  size_t avail = r->end - r->start;
+  if (avail < sizeof(uint32_t)) {
     return 0;
   }
 
-  uint8_t type;
-  if (peer_recv(sockfd, (char *)&type, 1) < 0) {
-    return -1;
+  uint8_t *buf = r->buf + r->start;
+  uint32_t len = read_u32(buf);
+  if (len == 0) {
+    r->start += sizeof(uint32_t);
+    out->type = MSG_KEEPALIVE;
+    return 1;
   }
 
-  if (type >= MSG_MAX) {
-    return -1;
+  if (avail < sizeof(uint32_t) + 1) {
+    return 0;
   }
 
-  if (!valid_len(type, torrent, len)) {
+  uint8_t type = buf[sizeof(uint32_t)];
+  if (type >= MSG_MAX || type == MSG_KEEPALIVE ||
+      !valid_len(type, torrent, len)) {
+    log_printf(LOG_ERROR, "Received invalid message (type %hhu, length %u)\n",
+               type, len);
     return -1;
   }
 
-  out->type = type;
-  uint32_t left = len - 1;
+  const uint8_t *payload = buf + sizeof(uint32_t) + 1;
+  if (type == MSG_PIECE) {
+    size_t header = sizeof(uint32_t) + 1 + 2 * sizeof(uint32_t);
+    if (avail < header) {
+      return 0;
+    }
 
-  switch (type) {
-  case MSG_CHOKE:
-  case MSG_UNCHOKE:
-  case MSG_INTERESTED:
-  case MSG_NOT_INTERESTED:
-    assert(left == 0);
-    break;
-  case MSG_PIECE:
-    assert(left > 0);
-    if (peer_msg_recv_piece(sockfd, out, torrent, left) < 0) {
+    r->piece.index = read_u32(payload);
+    r->piece.begin = read_u32(payload + sizeof(uint32_t));
+    r->piece.blocklen = len - 1 - 2 * sizeof(uint32_t);
+    r->piece.data = NULL;
+    // The last piece is shorter, and so is its write cache entry
+    if (r->piece.index >= torrent->info.num_pieces) {
+      log_printf(LOG_ERROR, "Received block of unknown piece\n");
       return -1;
     }
-    break;
-  case MSG_BITFIELD: {
-    char buf[left];
-    if (peer_recv(sockfd, buf, left) < 0) {
+    size_t piece_len =
+        piece_picker_piece_len(torrent->sh.picker, r->piece.index);
+    if (r->piece.begin > piece_len ||
+        r->piece.blocklen > piece_len - r->piece.begin) {
+      log_printf(LOG_ERROR, "Received block outside of its piece\n");
       return -1;
     }
 
-    out->payload.bitfield = byte_str_new(left, (uint8_t *)"");
-    if (!out->payload.bitfield) {
-      return -1;
+    if (!peer_reader_block_wanted(r, torrent)) {
+      r->dropping = true;
+    } else {
+      r->cached = write_cache_get(torrent, r->piece.index, true);
+      if (!r->cached && !storage_mapped(torrent)) {
+        return peer_reader_copy_piece(r, out);
+      }
     }
 
-    memcpy(out->payload.bitfield->str, buf, left);
-    break;
+    r->start += header;
+    r->piece_left = r->piece.blocklen;
+    return peer_reader_piece(r, sockfd, torrent, out);
   }
-  case MSG_REQUEST: {
-    char buf[left];
-    if (peer_recv(sockfd, buf, left) < 0) {
+
+  size_t total = sizeof(uint32_t) + len;
+  if (total > r->cap) {
+    // Only bitfields of large torrents get here
+    uint8_t *grown = realloc(r->buf, total);
+    if (!grown) {
       return -1;
     }
-    assert(left == 3 * sizeof(uint32_t));
-    uint32_t u32;
-    memcpy(&u32, buf, sizeof(uint32_t));
-    out->payload.request.index = ntohl(u32);
-
-    memcpy(&u32, buf + sizeof(uint32_t), sizeof(uint32_t));
-    out->payload.request.begin = ntohl(u32);
+    r->buf = grown;
+    r->cap = total;
+    return 0;
+  }
 
-    memcpy(&u32, buf + 2 * sizeof(uint32_t), sizeof(uint32_t));
-    out->payload.request.length = ntohl(u32);
-    break;
+  if (avail < total) {
+    return 0;
   }
-  case MSG_HAVE: {
-    uint32_t u32;
-    assert(left == sizeof(uint32_t));
-    if (peer_recv(sockfd, (char *)&u32, left) < 0) {
+
+  out->type = type;
+  switch (type) {
+  case MSG_BITFIELD:
+    out->payload.bitfield = byte_str_new(len - 1, (uint8_t *)payload);
+    if (!out->payload.bitfield) {
       return -1;
     }
-    out->payload.have = ntohl(u32);
     break;
-  }
+  case MSG_REQUEST:
+  case MSG_CANCEL:
+    out->payload.request.index = read_u32(payload);
+    out->payload.request.begin = read_u32(payload + sizeof(uint32_t));
+    out->payload.request.length = read_u32(payload + 2 * sizeof(uint32_t));
+    break;
+  case MSG_HAVE:
+    out->payload.have = read_u32(payload);
+    break;
   case MSG_PORT: {
-    uint32_t u32;
-    assert(left == sizeof(uint32_t));
-    if (peer_recv(sockfd, (char *)&u32, left) < 0) {
-      return -1;
-    }
-    out->payload.listen_port = ntohl(u32);
+    uint16_t port;
+    memcpy(&port, payload, sizeof(uint16_t));
+    out->payload.listen_port = ntohs(port);
     break;
   }
   default:
-    return -1;
-  }
-
-  log_printf(LOG_DEBUG, "Successfully received message from peer, Type %hhu\n",
-             type);
-
-  return 0;
-}
-
-bool peer_msg_buff_nonempty(int sockfd) {
-  uint32_t len;
-  int n = recv(sockfd, (char *)&len, sizeof(uint32_t), MSG_PEEK | MSG_DONTWAIT);
-  if ((uint32_t)n < sizeof(uint32_t)) {
-    return false;
-  }
-
-  len = ntohl(len);
-
-  int bytes_available;
-  if (ioctl(sockfd, FIONREAD, &bytes_available)) {
-    return false;
+    break;
   }
 
-  return (unsigned)bytes_available >= len + sizeof(uint16_t);
+  r->start += total;
+  return 1;
 }
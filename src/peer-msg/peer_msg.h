@@ -3,8 +3,12 @@
 
 #include "../byte-str/byte_str.h"
 #include "../file-parser/file-parser.h"
+#include "../piece-request/piece_request.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef struct {
   uint32_t index;
@@ -16,6 +20,9 @@ typedef struct {
   uint32_t index;
   uint32_t begin;
   size_t blocklen;
+  // A received block still to be written to storage, in a buffer from
+  // disk_io_block_get(). NULL once the block is in place.
+  uint8_t *data;
 } piece_msg_t;
 
 typedef enum {
@@ -38,16 +45,104 @@ typedef struct {
   union {
     uint32_t have;
     byte_str_t *bitfield;
+    // Also the payload of MSG_CANCEL
     request_msg_t request;
     piece_msg_t piece;
     uint32_t listen_port;
   } payload;
 } peer_msg_t;
 
-int peer_send_handshake(int sockfd, char info_hash[20]);
-int peer_recv_handshake(int sockfd, char info_hash[20], char out_peer_id[20]);
-int peer_msg_send(int sockfd, peer_msg_t *msg, const metainfo_t *torrent);
-bool peer_msg_buff_nonempty(int sockfd);
-int peer_msg_recv(int sockfd, peer_msg_t *out, const metainfo_t *torrent);
+#define PEER_READER_MIN_CAP (64 * 1024)
+
+// Per-connection receive buffer and resumable decoder. A read takes as much
+// as the socket has, then every complete message in the buffer is decoded
+// without further syscalls. Block payloads bypass the buffer when they can:
+// once a MSG_PIECE header is decoded the rest goes straight into the piece's
+// write cache entry (`cached`) or into mapped storage, and `piece_left`
+// tracks how much of it is still to come.
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t start;
+  size_t end;
+  piece_msg_t piece;
+  size_t piece_left;
+  struct write_cache_entry *cached;
+  // The current block is not wanted, or its entry was sealed while it
+  // arrived: the rest of it is thrown away
+  bool dropping;
+} peer_reader_t;
+
+#define PEER_WRITER_MIN_CAP 4096
+// Most iovecs a single send of the queue takes
+#define PEER_WRITER_MAX_IOV (1 + 4 * (1 + PIECE_MAX_SPANS))
+
+// A block queued for sending. `buf_end` is where the buffered bytes that go
+// out before it end, `sent` how much of the block already went out. The
+// block is sent from its piece's read cache entry if `cached`, from the file
+// mappings otherwise.
+typedef struct {
+  size_t buf_end;
+  piece_msg_t block;
+  size_t sent;
+  struct read_cache_entry *cached;
+} peer_out_block_t;
+
+// Per-connection output queue. Messages are serialized into `buf` and block
+// payloads in the read cache or on mapped storage are referenced in place, so
+// a flush sends everything queued with a single sendmsg. `pending` counts the
+// bytes not sent yet.
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t start;
+  size_t end;
+  peer_out_block_t *blocks;
+  size_t blocks_cap;
+  size_t num_blocks;
+  size_t pending;
+  // The queue is being sent from elsewhere: `buf` may still grow, but what
+  // is in it does not move and the old copy stays around as `retired`
+  bool pinned;
+  uint8_t *retired;
+} peer_writer_t;
+
+int peer_writer_init(peer_writer_t *w);
+void peer_writer_free(peer_writer_t *w);
+// Sends as much of the queue as the socket takes. Returns -1 on errors, what
+// does not fit stays queued.
+int peer_writer_flush(peer_writer_t *w, int sockfd, const metainfo_t *torrent);
+// Fills `iov`, PEER_WRITER_MAX_IOV entries, with the front of the queue for
+// sending it elsewhere. Returns the number of entries or -1 on errors.
+int peer_writer_iov(const peer_writer_t *w, const metainfo_t *torrent,
+                    struct iovec *iov);
+// Marks `n` bytes, in queue order, as sent
+void peer_writer_consume(peer_writer_t *w, size_t n);
+// Keeps the iovecs of peer_writer_iov() valid while messages are queued,
+// until the writer is unpinned. Nothing is consumed in between.
+void peer_writer_pin(peer_writer_t *w);
+void peer_writer_unpin(peer_writer_t *w);
+
+// Queue messages on the writer, nothing is sent until it is flushed
+int peer_send_handshake(peer_writer_t *w, char info_hash[20]);
+int peer_msg_send(peer_writer_t *w, peer_msg_t *msg, const metainfo_t *torrent);
+// Queues a block sent from its piece's read cache entry, the reference on the
+// entry is handed over to the writer
+int peer_msg_send_cached(peer_writer_t *w, const piece_msg_t *piece,
+                         struct read_cache_entry *entry);
+
+int peer_reader_init(peer_reader_t *r);
+void peer_reader_free(peer_reader_t *r);
+// Reads what the socket has into the buffer. Returns the number of bytes
+// read, 0 if there was nothing to read and -1 on EOF/error.
+ssize_t peer_reader_fill(peer_reader_t *r, int sockfd);
+// Decodes the peer's handshake. Returns 1 once decoded, 0 if more data is
+// needed and -1 if it is not a BitTorrent handshake.
+int peer_reader_handshake(peer_reader_t *r, char out_info_hash[20],
+                          char out_peer_id[20]);
+// Decodes the next message. Returns 1 with the message in `out`, 0 if more
+// data is needed and -1 on protocol errors.
+int peer_reader_next(peer_reader_t *r, int sockfd, metainfo_t *torrent,
+                     peer_msg_t *out);
 
 #endif // !PEER_MSG_H
@@ -0,0 +1,206 @@
+#include "peer_msg.h"
+#include "../disk-io/disk_io.h"
+#include "../log/log.h"
+#include "../peer-connection/peer-connection.h"
+#include "../piece-picker/piece_picker.h"
+#include "../storage/storage.h"
+#include "../write-cache/write_cache.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unity/unity.h>
+#include <unity/unity_internals.h>
+
+#define PIECE_LEN 32768
+// One full piece and a last one of 100 bytes, in a single file
+#define TOTAL_LEN (PIECE_LEN + 100)
+
+uint8_t data[TOTAL_LEN];
+metainfo_t torrent;
+peer_reader_t reader;
+int fds[2];
+
+void setUp() {
+  memset(&torrent, 0, sizeof(torrent));
+  torrent.info.files_count = 1;
+  torrent.info.piece_length = PIECE_LEN;
+  torrent.info.length = TOTAL_LEN;
+  torrent.info.num_pieces = 2;
+  torrent.files = calloc(2, sizeof(dl_file_t *));
+  torrent.files[0] = calloc(1, sizeof(dl_file_t) + 1);
+  torrent.files[0]->backend = &storage_memory_backend;
+  torrent.files[0]->size = TOTAL_LEN;
+  torrent.files[0]->data = data;
+  torrent.file_offsets = malloc(2 * sizeof(size_t));
+  torrent.file_offsets[0] = 0;
+  torrent.file_offsets[1] = TOTAL_LEN;
+  torrent.sh.piece_states = calloc(2, 1);
+  torrent.sh.picker = piece_picker_create(2, PIECE_LEN, TOTAL_LEN);
+  torrent.write_cache = write_cache_create(2);
+  pthread_mutex_init(&torrent.sh.picker_lock, NULL);
+
+  // The single block of the last piece is being downloaded
+  uint8_t have[1] = {0xc0};
+  uint32_t piece, block;
+  piece_picker_add_peer(torrent.sh.picker, have);
+  piece_picker_remove(torrent.sh.picker, 0);
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(torrent.sh.picker, have,
+                                               &piece, &block));
+  TEST_ASSERT_EQUAL(1, piece);
+
+  TEST_ASSERT_EQUAL(0, peer_reader_init(&reader));
+  TEST_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  // Like peer connections, the reader never waits for more data
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+}
+
+void tearDown() {
+  close(fds[0]);
+  close(fds[1]);
+  peer_reader_free(&reader);
+  write_cache_discard(torrent.write_cache, 1);
+  free(torrent.files[0]);
+  free(torrent.files);
+  free(torrent.file_offsets);
+  free(torrent.sh.piece_states);
+  piece_picker_free(torrent.sh.picker);
+}
+
+void send_bytes(const uint8_t *buf, size_t len) {
+  TEST_ASSERT_EQUAL(len, write(fds[1], buf, len));
+  TEST_ASSERT_TRUE(peer_reader_fill(&reader, fds[0]) > 0);
+}
+
+// Queues a piece message announcing `blocklen` bytes, followed by `sent`
+// bytes of its payload
+void send_block(uint32_t index, uint32_t begin, uint32_t blocklen,
+                size_t sent) {
+  uint8_t msg[13 + 256];
+  uint32_t len = htonl(1 + 8 + blocklen);
+  uint32_t index_be = htonl(index);
+  uint32_t begin_be = htonl(begin);
+  memcpy(msg, &len, 4);
+  msg[4] = MSG_PIECE;
+  memcpy(msg + 5, &index_be, 4);
+  memcpy(msg + 9, &begin_be, 4);
+  memset(msg + 13, 0xab, sent);
+  send_bytes(msg, 13 + sent);
+}
+
+void flushed(metainfo_t *torrent, uint32_t piece, int ret) {
+  (void)torrent;
+  (void)piece;
+  TEST_ASSERT_EQUAL(0, ret);
+}
+
+void test_block_in_short_last_piece_is_received() {
+  send_block(1, 0, 100, 100);
+
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_EQUAL(MSG_PIECE, msg.type);
+  TEST_ASSERT_EQUAL(100, msg.payload.piece.blocklen);
+
+  write_cache_entry_t *entry = write_cache_get(&torrent, 1, false);
+  TEST_ASSERT_NOT_NULL(entry);
+  TEST_ASSERT_EQUAL(100, entry->len);
+  TEST_ASSERT_EQUAL(0xab, entry->data[99]);
+  write_cache_put(entry);
+}
+
+void test_block_past_short_last_piece_is_rejected() {
+  // Fits piece_length, but runs past the 100 bytes of the last piece
+  send_block(1, 0, PEER_REQUEST_SIZE, 0);
+
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(-1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_FALSE(write_cache_holds(torrent.write_cache, 1));
+}
+
+void test_block_arriving_during_flush_is_dropped() {
+  send_block(1, 0, 100, 40);
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(0, peer_reader_next(&reader, fds[0], &torrent, &msg));
+
+  write_cache_entry_t *entry = write_cache_get(&torrent, 1, false);
+  TEST_ASSERT_NOT_NULL(entry);
+  memset(entry->data + 40, 0, 60);
+  write_cache_flush(&torrent, 1, flushed);
+
+  // The rest of the block arrives after the piece went to storage
+  uint8_t rest[60];
+  memset(rest, 0xcd, sizeof(rest));
+  send_bytes(rest, sizeof(rest));
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_EQUAL(100, msg.payload.piece.blocklen);
+  TEST_ASSERT_TRUE(entry->sealed);
+  TEST_ASSERT_EQUAL(0, entry->data[99]);
+  write_cache_put(entry);
+}
+
+void test_block_received_before_is_dropped() {
+  send_block(1, 0, 100, 100);
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_EQUAL(1, piece_picker_block_received(torrent.sh.picker, 1, 0,
+                                                   true));
+
+  // Hashed already, a second copy must not change it
+  write_cache_entry_t *entry = write_cache_get(&torrent, 1, false);
+  memset(entry->data, 0, 100);
+  send_block(1, 0, 100, 100);
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_EQUAL(0, entry->data[0]);
+  TEST_ASSERT_EQUAL(0, entry->data[99]);
+  write_cache_put(entry);
+}
+
+void test_block_of_piece_we_have_is_dropped() {
+  piece_picker_piece_done(torrent.sh.picker, 1);
+  torrent.sh.piece_states[1] = PIECE_STATE_HAVE;
+  memset(data + PIECE_LEN, 0x11, 100);
+
+  send_block(1, 0, 100, 100);
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_EQUAL(MSG_PIECE, msg.type);
+  TEST_ASSERT_EQUAL(0x11, data[PIECE_LEN]);
+  TEST_ASSERT_EQUAL(0x11, data[PIECE_LEN + 99]);
+}
+
+void test_block_without_cache_is_handed_over() {
+  write_cache_t *cache = torrent.write_cache;
+  torrent.write_cache = NULL;
+  storage_backend_t unmapped = storage_memory_backend;
+  unmapped.mapped = false;
+  torrent.files[0]->backend = &unmapped;
+  memset(data + PIECE_LEN, 0x11, 100);
+
+  // Storage that is not mapped is left to the disk threads: the block comes
+  // out in a buffer of its own
+  send_block(1, 0, 100, 100);
+  peer_msg_t msg;
+  TEST_ASSERT_EQUAL(1, peer_reader_next(&reader, fds[0], &torrent, &msg));
+  TEST_ASSERT_NOT_NULL(msg.payload.piece.data);
+  TEST_ASSERT_EQUAL(0xab, msg.payload.piece.data[99]);
+  TEST_ASSERT_EQUAL(0x11, data[PIECE_LEN]);
+  disk_io_block_put(msg.payload.piece.data);
+
+  torrent.write_cache = cache;
+}
+
+int main() {
+  log_set_logfile(stderr);
+  log_set_lvl(LOG_ERROR);
+  UNITY_BEGIN();
+  RUN_TEST(test_block_in_short_last_piece_is_received);
+  RUN_TEST(test_block_past_short_last_piece_is_rejected);
+  RUN_TEST(test_block_arriving_during_flush_is_dropped);
+  RUN_TEST(test_block_received_before_is_dropped);
+  RUN_TEST(test_block_of_piece_we_have_is_dropped);
+  RUN_TEST(test_block_without_cache_is_handed_over);
+  return UNITY_END();
+}
@@ -0,0 +1,505 @@
+#include "piece_picker.h"
+#include "../bitfield/bitfield.h"
+#include "../log/log.h"
+#include "../peer-connection/peer-connection.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void picker_swap(piece_picker_t *picker, size_t a, size_t b) {
+  uint32_t pa = picker->order[a];
+  uint32_t pb = picker->order[b];
+  picker->order[a] = pb;
+  picker->order[b] = pa;
+  picker->pos[pb] = a;
+  picker->pos[pa] = b;
+}
+
+int picker_grow_buckets(piece_picker_t *picker) {
+  if (picker->num_buckets + 1 == picker->bucket_cap) {
+    size_t cap = picker->bucket_cap * 2;
+    uint32_t *starts = realloc(picker->bucket_start, cap * sizeof(uint32_t));
+    if (!starts) {
+      return -1;
+    }
+    picker->bucket_start = starts;
+    picker->bucket_cap = cap;
+  }
+
+  // The new, empty, bucket starts where the array ends
+  picker->bucket_start[picker->num_buckets + 1] = picker->len;
+  picker->num_buckets++;
+  return 0;
+}
+
+piece_picker_t *piece_picker_create(size_t num_pieces, size_t piece_length,
+                                    size_t total_length) {
+  piece_picker_t *picker = calloc(1, sizeof(piece_picker_t));
+  if (!picker) {
+    return NULL;
+  }
+
+  picker->num_pieces = num_pieces;
+  picker->piece_length = piece_length;
+  picker->total_length = total_length;
+  picker->availability = calloc(num_pieces, sizeof(uint32_t));
+  picker->order = malloc(num_pieces * sizeof(uint32_t));
+  picker->pos = malloc(num_pieces * sizeof(uint32_t));
+  picker->bucket_cap = 16;
+  picker->bucket_start = malloc(picker->bucket_cap * sizeof(uint32_t));
+  picker->partials = calloc(num_pieces, sizeof(partial_piece_t *));
+  picker->active = malloc(num_pieces * sizeof(uint32_t));
+  picker->num_active = 0;
+  if (!picker->availability || !picker->order || !picker->pos ||
+      !picker->bucket_start || !picker->partials || !picker->active) {
+    piece_picker_free(picker);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < num_pieces; i++) {
+    picker->order[i] = i;
+  }
+
+  // Shuffle so peers with equal availability do not all start at piece 0
+  for (size_t i = num_pieces; i > 1; i--) {
+    size_t j = rand() % i;
+    uint32_t tmp = picker->order[i - 1];
+    picker->order[i - 1] = picker->order[j];
+    picker->order[j] = tmp;
+  }
+
+  for (size_t i = 0; i < num_pieces; i++) {
+    picker->pos[picker->order[i]] = i;
+  }
+
+  picker->len = num_pieces;
+  picker->num_buckets = 1;
+  picker->bucket_start[0] = 0;
+  picker->bucket_start[1] = num_pieces;
+
+  return picker;
+}
+
+void partial_free(partial_piece_t *partial) {
+  free(partial->blocks);
+  free(partial->requests);
+  free(partial);
+}
+
+void piece_picker_free(piece_picker_t *picker) {
+  if (picker->partials) {
+    for (size_t i = 0; i < picker->num_pieces; i++) {
+      if (picker->partials[i]) {
+        partial_free(picker->partials[i]);
+      }
+    }
+  }
+  free(picker->partials);
+  free(picker->active);
+  free(picker->availability);
+  free(picker->order);
+  free(picker->pos);
+  free(picker->bucket_start);
+  free(picker);
+}
+
+bool piece_picker_pickable(const piece_picker_t *picker, uint32_t piece) {
+  return picker->pos[piece] != PIECE_PICKER_NONE;
+}
+
+void piece_picker_inc(piece_picker_t *picker, uint32_t piece) {
+  assert(piece < picker->num_pieces);
+  uint32_t a = picker->availability[piece];
+
+  if (a + 1 == picker->num_buckets && picker_grow_buckets(picker) < 0) {
+    log_printf(LOG_ERROR, "Could not grow piece picker buckets\n");
+    return;
+  }
+
+  picker->availability[piece] = a + 1;
+  if (!piece_picker_pickable(picker, piece)) {
+    return;
+  }
+
+  // Last slot of bucket a becomes the first slot of bucket a + 1
+  size_t last = picker->bucket_start[a + 1] - 1;
+  picker_swap(picker, picker->pos[piece], last);
+  picker->bucket_start[a + 1]--;
+}
+
+void piece_picker_dec(piece_picker_t *picker, uint32_t piece) {
+  assert(piece < picker->num_pieces);
+  uint32_t a = picker->availability[piece];
+  assert(a > 0);
+
+  picker->availability[piece] = a - 1;
+  if (!piece_picker_pickable(picker, piece)) {
+    return;
+  }
+
+  // First slot of bucket a becomes the last slot of bucket a - 1
+  size_t first = picker->bucket_start[a];
+  picker_swap(picker, picker->pos[piece], first);
+  picker->bucket_start[a]++;
+}
+
+void piece_picker_add_peer(piece_picker_t *picker, const uint8_t *have) {
+  for (size_t i = 0; i < picker->num_pieces; i++) {
+    if (BITFIELD_ISSET(i, have)) {
+      piece_picker_inc(picker, i);
+    }
+  }
+}
+
+void piece_picker_remove_peer(piece_picker_t *picker, const uint8_t *have) {
+  for (size_t i = 0; i < picker->num_pieces; i++) {
+    if (BITFIELD_ISSET(i, have)) {
+      piece_picker_dec(picker, i);
+    }
+  }
+}
+
+void piece_picker_remove(piece_picker_t *picker, uint32_t piece) {
+  if (!piece_picker_pickable(picker, piece)) {
+    return;
+  }
+
+  // Bubble the piece through every bucket above its own to the end of the
+  // array, then drop it
+  for (size_t b = picker->availability[piece]; b < picker->num_buckets; b++) {
+    size_t last = picker->bucket_start[b + 1] - 1;
+    picker_swap(picker, picker->pos[piece], last);
+    picker->bucket_start[b + 1]--;
+  }
+
+  assert(picker->pos[piece] == picker->len - 1);
+  picker->len--;
+  picker->pos[piece] = PIECE_PICKER_NONE;
+}
+
+void piece_picker_restore(piece_picker_t *picker, uint32_t piece) {
+  if (piece_picker_pickable(picker, piece)) {
+    return;
+  }
+
+  // Append the piece as the last element of the top bucket, then walk it
+  // down to the bucket matching its availability
+  picker->order[picker->len] = piece;
+  picker->pos[piece] = picker->len;
+  picker->len++;
+  picker->bucket_start[picker->num_buckets] = picker->len;
+
+  for (size_t b = picker->num_buckets - 1; b > picker->availability[piece];
+       b--) {
+    size_t first = picker->bucket_start[b];
+    picker_swap(picker, picker->pos[piece], first);
+    picker->bucket_start[b]++;
+  }
+}
+
+int piece_picker_pick(piece_picker_t *picker, const uint8_t *have,
+                      uint32_t *out) {
+  // Nobody has the pieces in bucket 0
+  size_t start = picker->num_buckets > 1 ? picker->bucket_start[1]
+                                         : picker->len;
+
+  for (size_t i = start; i < picker->len; i++) {
+    uint32_t piece = picker->order[i];
+    if (BITFIELD_ISSET(piece, have)) {
+      piece_picker_remove(picker, piece);
+      *out = piece;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+size_t piece_picker_piece_len(const piece_picker_t *picker, uint32_t piece) {
+  assert(piece < picker->num_pieces);
+  size_t begin = (size_t)piece * picker->piece_length;
+  size_t left = picker->total_length - begin;
+  return left < picker->piece_length ? left : picker->piece_length;
+}
+
+uint32_t piece_picker_block_len(const piece_picker_t *picker, uint32_t piece,
+                                uint32_t block) {
+  size_t left = piece_picker_piece_len(picker, piece) -
+                (size_t)block * PEER_REQUEST_SIZE;
+  return left < PEER_REQUEST_SIZE ? left : PEER_REQUEST_SIZE;
+}
+
+partial_piece_t *partial_create(piece_picker_t *picker, uint32_t piece) {
+  partial_piece_t *partial = malloc(sizeof(partial_piece_t));
+  if (!partial) {
+    return NULL;
+  }
+
+  size_t len = piece_picker_piece_len(picker, piece);
+  partial->index = piece;
+  partial->num_blocks = (len + PEER_REQUEST_SIZE - 1) / PEER_REQUEST_SIZE;
+  partial->num_free = partial->num_blocks;
+  partial->num_received = 0;
+  partial->num_in_order = 0;
+  partial->blocks = calloc(partial->num_blocks, 1);
+  partial->requests = calloc(partial->num_blocks, 1);
+  if (!partial->blocks || !partial->requests) {
+    partial_free(partial);
+    return NULL;
+  }
+
+  partial->active_index = picker->num_active;
+  picker->active[picker->num_active++] = piece;
+  picker->partials[piece] = partial;
+
+  return partial;
+}
+
+void partial_remove(piece_picker_t *picker, partial_piece_t *partial) {
+  size_t i = partial->active_index;
+  uint32_t last = picker->active[--picker->num_active];
+  picker->active[i] = last;
+  picker->partials[last]->active_index = i;
+
+  picker->partials[partial->index] = NULL;
+  partial_free(partial);
+}
+
+int partial_take_block(partial_piece_t *partial, uint32_t *out_block) {
+  for (uint32_t i = 0; i < partial->num_blocks; i++) {
+    if (partial->blocks[i] == BLOCK_STATE_FREE) {
+      partial->blocks[i] = BLOCK_STATE_REQUESTED;
+      partial->requests[i] = 1;
+      partial->num_free--;
+      *out_block = i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int piece_picker_pick_block(piece_picker_t *picker, const uint8_t *have,
+                            uint32_t *out_piece, uint32_t *out_block) {
+  partial_piece_t *best = NULL;
+  for (size_t i = 0; i < picker->num_active; i++) {
+    partial_piece_t *partial = picker->partials[picker->active[i]];
+    if (partial->num_free == 0 || !BITFIELD_ISSET(partial->index, have)) {
+      continue;
+    }
+
+    if (!best || partial->num_free < best->num_free) {
+      best = partial;
+    }
+  }
+
+  if (!best) {
+    uint32_t piece;
+    if (piece_picker_pick(picker, have, &piece) < 0) {
+      return -1;
+    }
+
+    best = partial_create(picker, piece);
+    if (!best) {
+      piece_picker_restore(picker, piece);
+      return -1;
+    }
+  }
+
+  *out_piece = best->index;
+  return partial_take_block(best, out_block);
+}
+
+// Pieces nobody connected has (bucket 0) cannot be requested, so they do not
+// hold endgame back: it would never start while a peer that has them is
+// missing.
+bool piece_picker_endgame(const piece_picker_t *picker) {
+  size_t available = picker->num_buckets > 1 ? picker->bucket_start[1]
+                                             : picker->len;
+  if (available < picker->len) {
+    return false;
+  }
+
+  for (size_t i = 0; i < picker->num_active; i++) {
+    const partial_piece_t *partial = picker->partials[picker->active[i]];
+    if (partial->num_free > 0 && picker->availability[partial->index] > 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int piece_picker_pick_duplicate(piece_picker_t *picker, const uint8_t *have,
+                                bool (*in_flight)(void *ctx, uint32_t piece,
+                                                  uint32_t block),
+                                void *ctx, uint32_t *out_piece,
+                                uint32_t *out_block) {
+  if (!piece_picker_endgame(picker)) {
+    return -1;
+  }
+
+  partial_piece_t *best = NULL;
+  uint32_t best_block = 0;
+  for (size_t i = 0; i < picker->num_active; i++) {
+    partial_piece_t *partial = picker->partials[picker->active[i]];
+    if (!BITFIELD_ISSET(partial->index, have)) {
+      continue;
+    }
+
+    for (uint32_t b = 0; b < partial->num_blocks; b++) {
+      if (partial->blocks[b] != BLOCK_STATE_REQUESTED ||
+          partial->requests[b] == UINT8_MAX ||
+          (best && partial->requests[b] >= best->requests[best_block]) ||
+          in_flight(ctx, partial->index, b)) {
+        continue;
+      }
+
+      best = partial;
+      best_block = b;
+    }
+  }
+
+  if (!best) {
+    return -1;
+  }
+
+  best->requests[best_block]++;
+  *out_piece = best->index;
+  *out_block = best_block;
+  return 0;
+}
+
+bool piece_picker_block_wanted(const piece_picker_t *picker, uint32_t piece,
+                               uint32_t block) {
+  partial_piece_t *partial = picker->partials[piece];
+  return partial && block < partial->num_blocks &&
+         partial->blocks[block] != BLOCK_STATE_RECEIVED;
+}
+
+bool piece_picker_abort_block(piece_picker_t *picker, uint32_t piece,
+                              uint32_t block) {
+  partial_piece_t *partial = picker->partials[piece];
+  if (!partial || block >= partial->num_blocks ||
+      partial->requests[block] == 0) {
+    return false;
+  }
+
+  // The block stays in flight while someone else is still waiting for it
+  partial->requests[block]--;
+  if (partial->requests[block] > 0 ||
+      partial->blocks[block] != BLOCK_STATE_REQUESTED) {
+    return false;
+  }
+
+  partial->blocks[block] = BLOCK_STATE_FREE;
+  partial->num_free++;
+
+  // Nothing of the piece is left in flight or on disk: let availability
+  // decide again who gets it
+  if (partial->num_free == partial->num_blocks) {
+    partial_remove(picker, partial);
+    piece_picker_restore(picker, piece);
+    return true;
+  }
+
+  return false;
+}
+
+int piece_picker_block_received(piece_picker_t *picker, uint32_t piece,
+                                uint32_t block, bool requested) {
+  partial_piece_t *partial = picker->partials[piece];
+  if (!partial || block >= partial->num_blocks) {
+    return -1;
+  }
+
+  if (requested && partial->requests[block] > 0) {
+    partial->requests[block]--;
+  }
+
+  if (partial->blocks[block] == BLOCK_STATE_RECEIVED) {
+    return -1;
+  }
+
+  if (partial->blocks[block] == BLOCK_STATE_FREE) {
+    partial->num_free--;
+  }
+  partial->blocks[block] = BLOCK_STATE_RECEIVED;
+  partial->num_received++;
+  while (partial->num_in_order < partial->num_blocks &&
+         partial->blocks[partial->num_in_order] == BLOCK_STATE_RECEIVED) {
+    partial->num_in_order++;
+  }
+
+  return partial->num_received == partial->num_blocks;
+}
+
+size_t piece_picker_received_prefix(const piece_picker_t *picker,
+                                    uint32_t piece) {
+  const partial_piece_t *partial = picker->partials[piece];
+  if (!partial) {
+    return 0;
+  }
+
+  size_t len = (size_t)partial->num_in_order * PEER_REQUEST_SIZE;
+  size_t piece_len = piece_picker_piece_len(picker, piece);
+  return len < piece_len ? len : piece_len;
+}
+
+bool piece_picker_received_blocks(const piece_picker_t *picker, uint32_t piece,
+                                  uint8_t *out) {
+  const partial_piece_t *partial = picker->partials[piece];
+  if (!partial) {
+    return false;
+  }
+
+  memset(out, 0, BITFIELD_NUM_BYTES(partial->num_blocks));
+  for (uint32_t i = 0; i < partial->num_blocks; i++) {
+    if (partial->blocks[i] == BLOCK_STATE_RECEIVED) {
+      BITFIELD_SET(i, out);
+    }
+  }
+
+  return true;
+}
+
+int piece_picker_resume_piece(piece_picker_t *picker, uint32_t piece,
+                              const uint8_t *received) {
+  if (picker->partials[piece] || !piece_picker_pickable(picker, piece)) {
+    return -1;
+  }
+
+  partial_piece_t *partial = partial_create(picker, piece);
+  if (!partial) {
+    return -1;
+  }
+  piece_picker_remove(picker, piece);
+
+  for (uint32_t i = 0; i < partial->num_blocks; i++) {
+    if (BITFIELD_ISSET(i, received)) {
+      partial->blocks[i] = BLOCK_STATE_RECEIVED;
+      partial->num_free--;
+      partial->num_received++;
+    }
+  }
+  while (partial->num_in_order < partial->num_blocks &&
+         partial->blocks[partial->num_in_order] == BLOCK_STATE_RECEIVED) {
+    partial->num_in_order++;
+  }
+
+  return 0;
+}
+
+void piece_picker_piece_done(piece_picker_t *picker, uint32_t piece) {
+  if (picker->partials[piece]) {
+    partial_remove(picker, picker->partials[piece]);
+  }
+  piece_picker_remove(picker, piece);
+}
+
+void piece_picker_piece_failed(piece_picker_t *picker, uint32_t piece) {
+  if (picker->partials[piece]) {
+    partial_remove(picker, picker->partials[piece]);
+  }
+  piece_picker_restore(picker, piece);
+}
@@ -0,0 +1,124 @@
+#ifndef PIECE_PICKER_H
+#define PIECE_PICKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIECE_PICKER_NONE UINT32_MAX
+
+typedef enum {
+  BLOCK_STATE_FREE,
+  BLOCK_STATE_REQUESTED,
+  BLOCK_STATE_RECEIVED,
+} block_state_t;
+
+// Download progress of a piece whose blocks are being handed out. It is
+// shared by every connection, so the blocks of one piece can be spread over
+// several peers. `requests` counts the connections waiting for each block,
+// which is more than one only in endgame. `num_in_order` is how many blocks
+// from the start of the piece have all been received.
+typedef struct {
+  uint32_t index;
+  uint32_t num_blocks;
+  uint32_t num_free;
+  uint32_t num_received;
+  uint32_t num_in_order;
+  size_t active_index;
+  uint8_t *blocks;
+  uint8_t *requests;
+} partial_piece_t;
+
+// Rarest-first piece picker.
+//
+// `order` holds every piece that can still be handed out, sorted by how many
+// connected peers have it. Pieces with the same availability form a bucket:
+// bucket `a` is order[bucket_start[a] .. bucket_start[a + 1]). Moving a piece
+// to a neighbouring bucket is a single swap with the bucket's edge, so
+// availability changes are O(1) and picking walks the array from the rarest
+// end.
+typedef struct piece_picker {
+  size_t num_pieces;
+  size_t piece_length;
+  size_t total_length;
+  uint32_t *availability;
+  uint32_t *order;
+  uint32_t *pos;
+  size_t len;
+  uint32_t *bucket_start;
+  size_t num_buckets;
+  size_t bucket_cap;
+  partial_piece_t **partials;
+  uint32_t *active;
+  size_t num_active;
+} piece_picker_t;
+
+piece_picker_t *piece_picker_create(size_t num_pieces, size_t piece_length,
+                                    size_t total_length);
+void piece_picker_free(piece_picker_t *picker);
+
+void piece_picker_inc(piece_picker_t *picker, uint32_t piece);
+void piece_picker_dec(piece_picker_t *picker, uint32_t piece);
+void piece_picker_add_peer(piece_picker_t *picker, const uint8_t *have);
+void piece_picker_remove_peer(piece_picker_t *picker, const uint8_t *have);
+
+// Hands out the rarest pickable piece `have` contains and takes it out of the
+// pickable set. Returns -1 when there is none.
+int piece_picker_pick(piece_picker_t *picker, const uint8_t *have,
+                      uint32_t *out);
+// Takes a piece out of the pickable set (e.g. it was downloaded).
+void piece_picker_remove(piece_picker_t *picker, uint32_t piece);
+// Puts a piece back into the pickable set (e.g. its download was abandoned).
+void piece_picker_restore(piece_picker_t *picker, uint32_t piece);
+bool piece_picker_pickable(const piece_picker_t *picker, uint32_t piece);
+
+size_t piece_picker_piece_len(const piece_picker_t *picker, uint32_t piece);
+uint32_t piece_picker_block_len(const piece_picker_t *picker, uint32_t piece,
+                                uint32_t block);
+
+// Hands out a free block of a piece `have` contains, preferring pieces that
+// are already partially downloaded (closest to completion first) over
+// starting the rarest new one.
+int piece_picker_pick_block(piece_picker_t *picker, const uint8_t *have,
+                            uint32_t *out_piece, uint32_t *out_block);
+// True once every block left to download that a connected peer has is in
+// flight
+bool piece_picker_endgame(const piece_picker_t *picker);
+// In endgame, hands out a block `have` contains that is still outstanding,
+// the one with the fewest requesters first. Blocks `in_flight` says the
+// caller already requested are skipped.
+int piece_picker_pick_duplicate(piece_picker_t *picker, const uint8_t *have,
+                                bool (*in_flight)(void *ctx, uint32_t piece,
+                                                  uint32_t block),
+                                void *ctx, uint32_t *out_piece,
+                                uint32_t *out_block);
+// False once the block was received or its piece is no longer downloading,
+// so outstanding requests for it can be cancelled.
+bool piece_picker_block_wanted(const piece_picker_t *picker, uint32_t piece,
+                               uint32_t block);
+// Drops a request for a block (choke, disconnect, cancel). Returns true if
+// nothing of the piece is left in flight, so it is back to being unrequested.
+bool piece_picker_abort_block(piece_picker_t *picker, uint32_t piece,
+                              uint32_t block);
+// `requested` tells whether the block was asked for by whoever received it.
+// Returns 1 if this completed the piece, 0 if not and -1 if the block was not
+// expected.
+int piece_picker_block_received(piece_picker_t *picker, uint32_t piece,
+                                uint32_t block, bool requested);
+// Length of the piece's leading bytes that have all been received
+size_t piece_picker_received_prefix(const piece_picker_t *picker,
+                                    uint32_t piece);
+// Blocks of a partially downloaded piece already received, as a bitfield of
+// its blocks. Returns false if the piece is not partially downloaded.
+bool piece_picker_received_blocks(const piece_picker_t *picker, uint32_t piece,
+                                  uint8_t *out);
+// Picks up a piece whose `received` blocks are already on disk (e.g. from an
+// earlier run) as partially downloaded. Every other block is free.
+int piece_picker_resume_piece(piece_picker_t *picker, uint32_t piece,
+                              const uint8_t *received);
+// The piece was verified: forget its blocks
+void piece_picker_piece_done(piece_picker_t *picker, uint32_t piece);
+// The piece failed verification: download all of it again
+void piece_picker_piece_failed(piece_picker_t *picker, uint32_t piece);
+
+#endif // PIECE_PICKER_H
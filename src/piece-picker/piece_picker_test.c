@@ -0,0 +1,237 @@
+#include "piece_picker.h"
+#include "../bitfield/bitfield.h"
+#include "../peer-connection/peer-connection.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity/unity.h>
+#include <unity/unity_internals.h>
+
+#define NUM_PIECES 20
+#define PIECE_LEN (4 * PEER_REQUEST_SIZE)
+
+piece_picker_t *picker;
+uint8_t all[BITFIELD_NUM_BYTES(NUM_PIECES)];
+
+void setUp() {
+  // The last piece is one and a half blocks long
+  picker = piece_picker_create(NUM_PIECES, PIECE_LEN,
+                               (NUM_PIECES - 1) * PIECE_LEN +
+                                   PEER_REQUEST_SIZE + PEER_REQUEST_SIZE / 2);
+  memset(all, 0xFF, sizeof(all));
+}
+
+void tearDown() { piece_picker_free(picker); }
+
+void assert_sorted() {
+  for (size_t i = 1; i < picker->len; i++) {
+    TEST_ASSERT_TRUE(picker->availability[picker->order[i - 1]] <=
+                     picker->availability[picker->order[i]]);
+  }
+  for (size_t i = 0; i < picker->len; i++) {
+    TEST_ASSERT_EQUAL(i, picker->pos[picker->order[i]]);
+  }
+}
+
+void test_nothing_to_pick_without_peers() {
+  uint32_t piece;
+  TEST_ASSERT_EQUAL(-1, piece_picker_pick(picker, all, &piece));
+}
+
+void test_picks_rarest_first() {
+  piece_picker_add_peer(picker, all);
+  piece_picker_add_peer(picker, all);
+  piece_picker_dec(picker, 7);
+  piece_picker_dec(picker, 3);
+  piece_picker_dec(picker, 3);
+  piece_picker_inc(picker, 7);
+  piece_picker_dec(picker, 7);
+  assert_sorted();
+
+  uint32_t piece;
+  TEST_ASSERT_EQUAL(0, piece_picker_pick(picker, all, &piece));
+  TEST_ASSERT_EQUAL(7, piece);
+  TEST_ASSERT_FALSE(piece_picker_pickable(picker, 7));
+  assert_sorted();
+}
+
+void test_only_picks_pieces_the_peer_has() {
+  uint8_t have[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(12, have);
+  piece_picker_add_peer(picker, all);
+  piece_picker_add_peer(picker, have);
+
+  uint32_t piece;
+  TEST_ASSERT_EQUAL(0, piece_picker_pick(picker, have, &piece));
+  TEST_ASSERT_EQUAL(12, piece);
+  TEST_ASSERT_EQUAL(-1, piece_picker_pick(picker, have, &piece));
+}
+
+void test_remove_and_restore_keep_order() {
+  piece_picker_add_peer(picker, all);
+  for (uint32_t i = 0; i < NUM_PIECES; i++) {
+    for (uint32_t j = 0; j < i % 5; j++) {
+      piece_picker_inc(picker, i);
+    }
+  }
+  assert_sorted();
+
+  piece_picker_remove(picker, 4);
+  piece_picker_remove(picker, 10);
+  TEST_ASSERT_EQUAL(NUM_PIECES - 2, picker->len);
+  assert_sorted();
+
+  piece_picker_inc(picker, 4);
+  piece_picker_restore(picker, 4);
+  piece_picker_restore(picker, 10);
+  TEST_ASSERT_EQUAL(NUM_PIECES, picker->len);
+  assert_sorted();
+
+  piece_picker_remove_peer(picker, all);
+  uint32_t piece;
+  TEST_ASSERT_EQUAL(0, piece_picker_pick(picker, all, &piece));
+  TEST_ASSERT_EQUAL(1, picker->availability[piece]);
+}
+
+void test_blocks_of_a_partial_piece_are_shared() {
+  piece_picker_add_peer(picker, all);
+
+  // Keep the short last piece out of the way
+  uint8_t have[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(5, have);
+  BITFIELD_SET(6, have);
+
+  uint32_t first, piece, block;
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &first, &block));
+  TEST_ASSERT_EQUAL(0, block);
+
+  for (uint32_t i = 1; i < 4; i++) {
+    TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+    TEST_ASSERT_EQUAL(first, piece);
+    TEST_ASSERT_EQUAL(i, block);
+  }
+
+  // Every block is in flight: the next pick starts a new piece
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  TEST_ASSERT_NOT_EQUAL(first, piece);
+
+  piece_picker_abort_block(picker, first, 2);
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  TEST_ASSERT_EQUAL(first, piece);
+  TEST_ASSERT_EQUAL(2, block);
+
+  for (uint32_t i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL(0, piece_picker_block_received(picker, first, i, true));
+  }
+  TEST_ASSERT_EQUAL(-1, piece_picker_block_received(picker, first, 0, false));
+  TEST_ASSERT_EQUAL(1, piece_picker_block_received(picker, first, 3, true));
+
+  piece_picker_piece_failed(picker, first);
+  TEST_ASSERT_TRUE(piece_picker_pickable(picker, first));
+}
+
+bool in_flight(void *ctx, uint32_t piece, uint32_t block) {
+  uint32_t *mine = ctx;
+  return piece == mine[0] && block == mine[1];
+}
+
+void test_endgame_hands_out_outstanding_blocks() {
+  uint8_t have[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(5, have);
+  piece_picker_add_peer(picker, have);
+
+  uint32_t piece, block;
+  TEST_ASSERT_EQUAL(-1, piece_picker_pick_duplicate(picker, have, in_flight,
+                                                    (uint32_t[]){0, 0}, &piece,
+                                                    &block));
+
+  // Leave only piece 5 to download and put all of its blocks in flight
+  for (uint32_t i = 0; i < NUM_PIECES; i++) {
+    if (i != 5) {
+      piece_picker_piece_done(picker, i);
+    }
+  }
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  }
+  TEST_ASSERT_EQUAL(-1, piece_picker_pick_block(picker, have, &piece, &block));
+  TEST_ASSERT_TRUE(piece_picker_endgame(picker));
+
+  uint32_t mine[2] = {5, 0};
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_duplicate(picker, have, in_flight,
+                                                   mine, &piece, &block));
+  TEST_ASSERT_EQUAL(5, piece);
+  TEST_ASSERT_NOT_EQUAL(0, block);
+
+  // The first copy to arrive wins, the other requester should cancel
+  TEST_ASSERT_EQUAL(0, piece_picker_block_received(picker, 5, block, true));
+  TEST_ASSERT_FALSE(piece_picker_block_wanted(picker, 5, block));
+  TEST_ASSERT_FALSE(piece_picker_abort_block(picker, 5, block));
+  TEST_ASSERT_TRUE(piece_picker_block_wanted(picker, 5, 0));
+}
+
+void test_endgame_ignores_pieces_nobody_has() {
+  uint8_t have[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(5, have);
+  piece_picker_add_peer(picker, have);
+
+  // Pieces 5 and 6 are left, the only peer has 5 and all of it is in flight
+  for (uint32_t i = 0; i < NUM_PIECES; i++) {
+    if (i != 5 && i != 6) {
+      piece_picker_piece_done(picker, i);
+    }
+  }
+  uint32_t piece, block;
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  }
+  TEST_ASSERT_TRUE(piece_picker_pickable(picker, 6));
+  TEST_ASSERT_TRUE(piece_picker_endgame(picker));
+
+  // Once someone has piece 6 it can be requested normally again
+  uint8_t other[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(6, other);
+  piece_picker_add_peer(picker, other);
+  TEST_ASSERT_FALSE(piece_picker_endgame(picker));
+}
+
+void test_last_piece_is_short() {
+  TEST_ASSERT_EQUAL(PIECE_LEN, piece_picker_piece_len(picker, 0));
+  TEST_ASSERT_EQUAL(PEER_REQUEST_SIZE + PEER_REQUEST_SIZE / 2,
+                    piece_picker_piece_len(picker, NUM_PIECES - 1));
+  TEST_ASSERT_EQUAL(PEER_REQUEST_SIZE / 2,
+                    piece_picker_block_len(picker, NUM_PIECES - 1, 1));
+}
+
+void test_received_prefix_stops_at_gaps() {
+  uint8_t have[BITFIELD_NUM_BYTES(NUM_PIECES)] = {0};
+  BITFIELD_SET(NUM_PIECES - 1, have);
+  piece_picker_add_peer(picker, have);
+
+  uint32_t piece, block;
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  TEST_ASSERT_EQUAL(0, piece_picker_pick_block(picker, have, &piece, &block));
+  TEST_ASSERT_EQUAL(0, piece_picker_received_prefix(picker, piece));
+
+  TEST_ASSERT_EQUAL(0, piece_picker_block_received(picker, piece, 1, true));
+  TEST_ASSERT_EQUAL(0, piece_picker_received_prefix(picker, piece));
+
+  // Filling the gap covers the short last block too
+  TEST_ASSERT_EQUAL(1, piece_picker_block_received(picker, piece, 0, true));
+  TEST_ASSERT_EQUAL(piece_picker_piece_len(picker, piece),
+                    piece_picker_received_prefix(picker, piece));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_nothing_to_pick_without_peers);
+  RUN_TEST(test_picks_rarest_first);
+  RUN_TEST(test_only_picks_pieces_the_peer_has);
+  RUN_TEST(test_remove_and_restore_keep_order);
+  RUN_TEST(test_blocks_of_a_partial_piece_are_shared);
+  RUN_TEST(test_endgame_hands_out_outstanding_blocks);
+  RUN_TEST(test_endgame_ignores_pieces_nobody_has);
+  RUN_TEST(test_last_piece_is_short);
+  RUN_TEST(test_received_prefix_stops_at_gaps);
+  return UNITY_END();
+}
@@ -4,36 +4,27 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "../file-parser/file-parser.h"
 #include "../dl-file/dl_file.h"
 
-typedef struct {
-    size_t cap;
-    size_t len;
-    filemem_t *values;
-} da_filemems_t;
+// Most spans of a block handled at once. A block across more files is
+// walked in several rounds.
+#define PIECE_MAX_SPANS 64
 
-typedef struct {
-  da_filemems_t *filemems;
-  off_t begin;
-  size_t len;
-  bool completed;
-} block_request_t;
-
-typedef struct {
-    size_t cap;
-    size_t len;
-    block_request_t *values;
-} block_requests_t;
-
-typedef struct {
-  uint32_t piece_index;
-  block_requests_t *block_requests;
-  uint32_t blocks_left;
-} piece_request_t;
-
-piece_request_t *piece_request_create(const metainfo_t *torrent, uint32_t index);
-void piece_request_free(piece_request_t *request);
-block_request_t *piece_request_block_at(piece_request_t *request, off_t offset);
+// Index of the file holding byte `offset` of the torrent, found by binary
+// search over `torrent->file_offsets`. Empty files are never returned.
+size_t piece_request_file_at(const metainfo_t *torrent, size_t offset);
+// Resolves bytes [offset, offset + length) of the torrent to the file
+// mappings holding them. Returns the number of spans written to `out`, or -1
+// if the range is outside the torrent or is not mapped (see
+// storage_mapped()). A range needing more than `max` spans only gets its
+// first `max`: the caller goes on from where they end.
+int piece_request_range_spans(const metainfo_t *torrent, size_t offset,
+                              size_t length, struct iovec *out, size_t max);
+// Same, for `length` bytes at `begin` into piece `index`
+int piece_request_spans(const metainfo_t *torrent, uint32_t index,
+                        uint32_t begin, uint32_t length, struct iovec *out,
+                        size_t max);
 
 #endif // PIECE_REQUEST_H
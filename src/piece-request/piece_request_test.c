@@ -0,0 +1,90 @@
+#include "piece_request.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unity/unity.h>
+#include <unity/unity_internals.h>
+
+#define NUM_FILES 5
+
+// Files of 100, 0, 50, 0 and 10 bytes split into pieces of 64 bytes
+size_t lengths[NUM_FILES] = {100, 0, 50, 0, 10};
+uint8_t data[160];
+metainfo_t torrent;
+
+void setUp() {
+  memset(&torrent, 0, sizeof(torrent));
+  torrent.info.files_count = NUM_FILES;
+  torrent.info.piece_length = 64;
+  torrent.info.length = sizeof(data);
+  torrent.files = calloc(NUM_FILES + 1, sizeof(dl_file_t *));
+  torrent.file_offsets = malloc((NUM_FILES + 1) * sizeof(size_t));
+
+  size_t offset = 0;
+  for (size_t i = 0; i < NUM_FILES; i++) {
+    torrent.files[i] = calloc(1, sizeof(dl_file_t) + 1);
+    torrent.files[i]->size = lengths[i];
+    torrent.files[i]->data = data + offset;
+    torrent.file_offsets[i] = offset;
+    offset += lengths[i];
+  }
+  torrent.file_offsets[NUM_FILES] = offset;
+}
+
+void tearDown() {
+  for (size_t i = 0; i < NUM_FILES; i++) {
+    free(torrent.files[i]);
+  }
+  free(torrent.files);
+  free(torrent.file_offsets);
+}
+
+void test_file_at_skips_empty_files() {
+  TEST_ASSERT_EQUAL(0, piece_request_file_at(&torrent, 0));
+  TEST_ASSERT_EQUAL(0, piece_request_file_at(&torrent, 99));
+  TEST_ASSERT_EQUAL(2, piece_request_file_at(&torrent, 100));
+  TEST_ASSERT_EQUAL(2, piece_request_file_at(&torrent, 149));
+  TEST_ASSERT_EQUAL(4, piece_request_file_at(&torrent, 150));
+  TEST_ASSERT_EQUAL(4, piece_request_file_at(&torrent, 159));
+}
+
+void test_spans_cross_file_boundaries() {
+  struct iovec iov[4];
+  // Piece 1 is bytes [64, 128)
+  TEST_ASSERT_EQUAL(2, piece_request_spans(&torrent, 1, 0, 64, iov, 4));
+  TEST_ASSERT_EQUAL_PTR(data + 64, iov[0].iov_base);
+  TEST_ASSERT_EQUAL(36, iov[0].iov_len);
+  TEST_ASSERT_EQUAL_PTR(data + 100, iov[1].iov_base);
+  TEST_ASSERT_EQUAL(28, iov[1].iov_len);
+
+  // The last piece is short and ends in the last file
+  TEST_ASSERT_EQUAL(2, piece_request_spans(&torrent, 2, 0, 32, iov, 4));
+  TEST_ASSERT_EQUAL(22, iov[0].iov_len);
+  TEST_ASSERT_EQUAL_PTR(data + 150, iov[1].iov_base);
+  TEST_ASSERT_EQUAL(10, iov[1].iov_len);
+}
+
+void test_spans_reject_out_of_range() {
+  struct iovec iov[4];
+  TEST_ASSERT_EQUAL(-1, piece_request_spans(&torrent, 2, 0, 33, iov, 4));
+}
+
+void test_spans_stop_at_max() {
+  struct iovec iov[4];
+  TEST_ASSERT_EQUAL(1, piece_request_spans(&torrent, 1, 0, 64, iov, 1));
+  TEST_ASSERT_EQUAL_PTR(data + 64, iov[0].iov_base);
+  TEST_ASSERT_EQUAL(36, iov[0].iov_len);
+
+  // The rest of the block, from where the first round ended
+  TEST_ASSERT_EQUAL(1, piece_request_spans(&torrent, 1, 36, 28, iov, 1));
+  TEST_ASSERT_EQUAL_PTR(data + 100, iov[0].iov_base);
+  TEST_ASSERT_EQUAL(28, iov[0].iov_len);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_file_at_skips_empty_files);
+  RUN_TEST(test_spans_cross_file_boundaries);
+  RUN_TEST(test_spans_reject_out_of_range);
+  RUN_TEST(test_spans_stop_at_max);
+  return UNITY_END();
+}
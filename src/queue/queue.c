@@ -7,8 +7,10 @@
 #define QUEUE_BYTES(q) ((q)->entry_size * (q)->capacity)
 
 int queue_resize(queue_t *queue, uint32_t new_cap) {
+  assert(new_cap >= queue->capacity);
   ptrdiff_t offhead = queue->head - queue->mem;
   ptrdiff_t offtail = queue->tail - queue->mem;
+  size_t old_bytes = QUEUE_BYTES(queue);
 
   void *ret = realloc(queue->mem, queue->entry_size * new_cap);
   if (ret) {
@@ -21,17 +23,13 @@ int queue_resize(queue_t *queue, uint32_t new_cap) {
 
   queue->capacity = new_cap;
 
-  if (queue->head > queue->tail) {
-    ptrdiff_t top = queue->tail + queue->entry_size - queue->mem;
-    ptrdiff_t bot = queue->mem + QUEUE_BYTES(queue) - queue->mem;
-
-    char tmp[top];
-    memcpy(tmp, queue->mem, top);
-    memmove(queue->mem, queue->head, bot);
-    memcpy(queue->mem + bot, tmp, top);
-
-    queue->head = queue->mem;
-    queue->tail = queue->mem + bot;
+  // The entries wrapped around the old end: the ones at the start of the
+  // buffer move to right after the old end, which the new space has room for
+  if (queue->size > 0 && queue->head > queue->tail) {
+    size_t wrapped = queue->tail + queue->entry_size - queue->mem;
+    assert(wrapped <= QUEUE_BYTES(queue) - old_bytes);
+    memcpy(queue->mem + old_bytes, queue->mem, wrapped);
+    queue->tail = queue->mem + old_bytes + wrapped - queue->entry_size;
   }
 
   return 0;
@@ -124,3 +122,50 @@ int dequeue(queue_t *queue, void *out) {
 
   return 0;
 }
+
+int queue_peek(const queue_t *queue, void *out) {
+  if (queue->size == 0) {
+    return -1;
+  }
+
+  memcpy(out, queue->head, queue->entry_size);
+  return 0;
+}
+
+int queue_remove(queue_t *queue, const void *entry) {
+  char *end = queue->mem + QUEUE_BYTES(queue);
+  char *curr = queue->head;
+  size_t i = 0;
+
+  for (; i < queue->size; i++) {
+    if (memcmp(curr, entry, queue->entry_size) == 0) {
+      break;
+    }
+
+    curr += queue->entry_size;
+    if (curr >= end) {
+      curr = queue->mem;
+    }
+  }
+
+  if (i == queue->size) {
+    return -1;
+  }
+
+  // Shift everything behind the entry one slot towards the head
+  for (; i + 1 < queue->size; i++) {
+    char *next = curr + queue->entry_size;
+    if (next >= end) {
+      next = queue->mem;
+    }
+
+    memcpy(curr, next, queue->entry_size);
+    curr = next;
+  }
+
+  queue->tail = queue->tail == queue->mem ? end - queue->entry_size
+                                          : queue->tail - queue->entry_size;
+  queue->size--;
+
+  return 0;
+}
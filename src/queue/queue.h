@@ -18,6 +18,10 @@ void queue_free(queue_t *q);
 queue_t *queue_copy(const queue_t *queue);
 int enqueue(queue_t *q, void *entry);
 int dequeue(queue_t *queue, void *out);
+// Copies the first entry without removing it
+int queue_peek(const queue_t *queue, void *out);
+// Removes the first entry equal to `entry`, keeping the order of the others
+int queue_remove(queue_t *queue, const void *entry);
 int queue_resize(queue_t *queue, uint32_t new_cap);
 
 #endif // !QUEUE_H
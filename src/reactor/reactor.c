@@ -0,0 +1,530 @@
+#include "reactor.h"
+#include "../log/log.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+reactor_t reactors[REACTOR_MAX_THREADS];
+size_t num_reactors = 0;
+
+long reactor_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void reactor_wake(reactor_t *r) {
+  uint64_t one = 1;
+  if (write(r->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_printf(LOG_ERROR, "Could not wake reactor: %s\n", strerror(errno));
+  }
+}
+
+bool timer_before(reactor_timers_t *t, size_t a, size_t b) {
+  return t->values[a]->deadline < t->values[b]->deadline;
+}
+
+void timer_swap(reactor_timers_t *t, size_t a, size_t b) {
+  reactor_source_t *tmp = t->values[a];
+  t->values[a] = t->values[b];
+  t->values[b] = tmp;
+  t->values[a]->timer_index = a;
+  t->values[b]->timer_index = b;
+}
+
+void timer_sift_up(reactor_timers_t *t, size_t i) {
+  while (i > 0 && timer_before(t, i, (i - 1) / 2)) {
+    timer_swap(t, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void timer_sift_down(reactor_timers_t *t, size_t i) {
+  while (true) {
+    size_t smallest = i;
+    size_t l = 2 * i + 1, r = 2 * i + 2;
+    if (l < t->len && timer_before(t, l, smallest)) {
+      smallest = l;
+    }
+    if (r < t->len && timer_before(t, r, smallest)) {
+      smallest = r;
+    }
+    if (smallest == i) {
+      return;
+    }
+    timer_swap(t, i, smallest);
+    i = smallest;
+  }
+}
+
+void timer_remove(reactor_timers_t *t, reactor_source_t *src) {
+  size_t i = src->timer_index;
+  if (i == SIZE_MAX) {
+    return;
+  }
+
+  assert(t->values[i] == src);
+  t->len--;
+  if (i != t->len) {
+    t->values[i] = t->values[t->len];
+    t->values[i]->timer_index = i;
+    timer_sift_up(t, i);
+    timer_sift_down(t, i);
+  }
+
+  src->timer_index = SIZE_MAX;
+}
+
+int timer_insert(reactor_timers_t *t, reactor_source_t *src) {
+  if (t->len == t->cap) {
+    size_t cap = t->cap ? t->cap * 2 : 64;
+    void *values = realloc(t->values, cap * sizeof(*t->values));
+    if (!values) {
+      return -1;
+    }
+    t->values = values;
+    t->cap = cap;
+  }
+
+  src->timer_index = t->len;
+  t->values[t->len++] = src;
+  timer_sift_up(t, src->timer_index);
+
+  return 0;
+}
+
+void reactor_schedule(reactor_t *r, reactor_source_t *src, long deadline) {
+  if (src->timer_index != SIZE_MAX && src->deadline == deadline) {
+    return;
+  }
+
+  timer_remove(&r->timers, src);
+  src->deadline = deadline;
+  if (deadline == REACTOR_NO_DEADLINE) {
+    return;
+  }
+
+  if (timer_insert(&r->timers, src) < 0) {
+    log_printf(LOG_ERROR, "Could not schedule reactor timer\n");
+  }
+}
+
+int reactor_next_timeout(reactor_t *r) {
+  if (r->timers.len == 0) {
+    return -1;
+  }
+
+  long wait = r->timers.values[0]->deadline - reactor_now_ms();
+  if (wait < 0) {
+    return 0;
+  }
+
+  return wait > INT32_MAX ? INT32_MAX : (int)wait;
+}
+
+void reactor_run_timers(reactor_t *r) {
+  long now = reactor_now_ms();
+  while (r->timers.len > 0 && r->timers.values[0]->deadline <= now) {
+    reactor_source_t *src = r->timers.values[0];
+    timer_remove(&r->timers, src);
+    src->deadline = REACTOR_NO_DEADLINE;
+    // on_timer may reschedule, detach or free src
+    src->on_timer(r, src);
+  }
+}
+
+void reactor_collect_garbage(reactor_t *r) {
+  for (size_t i = 0; i < r->garbage.len; i++) {
+    free(r->garbage.values[i]);
+  }
+  r->garbage.len = 0;
+}
+
+void reactor_defer_free(reactor_t *r, void *ptr) {
+  reactor_garbage_t *g = &r->garbage;
+  if (g->len == g->cap) {
+    size_t cap = g->cap ? g->cap * 2 : 16;
+    void *values = realloc(g->values, cap * sizeof(*g->values));
+    if (!values) {
+      log_printf(LOG_ERROR, "Could not defer free, leaking %p\n", ptr);
+      return;
+    }
+    g->values = values;
+    g->cap = cap;
+  }
+
+  g->values[g->len++] = ptr;
+}
+
+int reactor_queue_send(reactor_t *r, reactor_source_t *src) {
+  if (src->send_queued || src->send_in_flight) {
+    return 0;
+  }
+
+  reactor_sends_t *q = &r->sends;
+  if (q->len == q->cap) {
+    size_t cap = q->cap ? q->cap * 2 : 64;
+    void *values = realloc(q->values, cap * sizeof(*q->values));
+    if (!values) {
+      log_printf(LOG_ERROR, "Could not queue send\n");
+      return -1;
+    }
+    q->values = values;
+    q->cap = cap;
+  }
+
+  src->send_queued = true;
+  q->values[q->len++] = src;
+  return 0;
+}
+
+// Takes a detached source off the queue, it may be freed before the next
+// flush
+void reactor_unqueue_send(reactor_t *r, reactor_source_t *src) {
+  reactor_sends_t *q = &r->sends;
+  for (size_t i = 0; i < q->len; i++) {
+    if (q->values[i] == src) {
+      q->values[i] = q->values[--q->len];
+      break;
+    }
+  }
+  src->send_queued = false;
+}
+
+// Hands the results of completed sends to their sources
+void reactor_reap_sends(reactor_t *r) {
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_cqe(r->ring))) {
+    reactor_source_t *src = (reactor_source_t *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    uring_seen(r->ring);
+    r->sends_in_flight--;
+    src->send_in_flight = false;
+    // on_sent may queue src again, detach it or free it
+    src->on_sent(r, src, res);
+  }
+}
+
+void reactor_on_ring_event(reactor_t *r, reactor_source_t *src,
+                           uint32_t events) {
+  (void)src;
+  (void)events;
+  reactor_reap_sends(r);
+}
+
+// The sends queued during the iteration go out with one io_uring_enter(),
+// without waiting for them. Never more than the ring's size are in flight,
+// so no completion is dropped; the rest waits for the next iteration.
+void reactor_flush_sends(reactor_t *r) {
+  reactor_reap_sends(r);
+
+  size_t kept = 0;
+  unsigned submitted = 0;
+  for (size_t i = 0; i < r->sends.len; i++) {
+    reactor_source_t *src = r->sends.values[i];
+    struct io_uring_sqe *sqe = r->sends_in_flight < r->ring->entries
+                                   ? uring_sqe(r->ring)
+                                   : NULL;
+    if (!sqe) {
+      r->sends.values[kept++] = src;
+      continue;
+    }
+
+    src->send_queued = false;
+    src->send_in_flight = true;
+    r->sends_in_flight++;
+    src->on_send(r, src, sqe);
+    sqe->user_data = (uint64_t)(uintptr_t)src;
+    submitted++;
+  }
+  r->sends.len = kept;
+
+  if (submitted > 0 && uring_submit(r->ring, 0) < 0) {
+    log_printf(LOG_ERROR, "Could not submit %u sends\n", submitted);
+  }
+}
+
+void reactor_adopt(reactor_t *r, reactor_source_t *src) {
+  struct epoll_event ev = {
+      .events = src->events,
+      .data.ptr = src,
+  };
+
+  src->prev = NULL;
+  src->next = r->sources;
+  if (r->sources) {
+    r->sources->prev = src;
+  }
+  r->sources = src;
+  src->attached = true;
+
+  long deadline = src->deadline;
+  src->timer_index = SIZE_MAX;
+  reactor_schedule(r, src, deadline);
+
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+    log_printf(LOG_ERROR, "Could not add fd %d to reactor: %s\n", src->fd,
+               strerror(errno));
+    // Let the owner notice the failure and clean up
+    src->on_event(r, src, EPOLLERR);
+  }
+}
+
+void reactor_adopt_pending(reactor_t *r) {
+  uint64_t count;
+  if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_printf(LOG_ERROR, "Could not read reactor wake fd\n");
+  }
+
+  pthread_mutex_lock(&r->pending_lock);
+  reactor_source_t *pending = r->pending;
+  r->pending = NULL;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  while (pending) {
+    reactor_source_t *src = pending;
+    pending = pending->next;
+    reactor_adopt(r, src);
+  }
+
+  if (__atomic_exchange_n(&r->notify_pending, false, __ATOMIC_ACQ_REL)) {
+    reactor_source_t *src = r->sources;
+    while (src) {
+      // on_notify may detach src, which is only freed after this batch
+      reactor_source_t *next = src->next;
+      if (src->on_notify) {
+        src->on_notify(r, src);
+      }
+      src = next;
+    }
+  }
+}
+
+void *reactor_loop(void *arg) {
+  reactor_t *r = arg;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS,
+                       reactor_next_timeout(r));
+    if (n < 0 && errno != EINTR) {
+      log_printf(LOG_ERROR, "epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      reactor_source_t *src = events[i].data.ptr;
+      if (!src) {
+        reactor_adopt_pending(r);
+        continue;
+      }
+
+      if (src->attached) {
+        src->on_event(r, src, events[i].events);
+      }
+    }
+
+    reactor_run_timers(r);
+    if (r->ring) {
+      reactor_flush_sends(r);
+    }
+    reactor_collect_garbage(r);
+  }
+
+  return NULL;
+}
+
+int reactor_init(reactor_t *r) {
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0) {
+    goto fail_epoll;
+  }
+
+  r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->wakefd < 0) {
+    goto fail_eventfd;
+  }
+
+  struct epoll_event ev = {
+      .events = EPOLLIN,
+      .data.ptr = NULL,
+  };
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0) {
+    goto fail_ctl;
+  }
+
+  pthread_mutex_init(&r->pending_lock, NULL);
+  r->pending = NULL;
+  r->notify_pending = false;
+  r->sources = NULL;
+  r->num_sources = 0;
+  memset(&r->timers, 0, sizeof(r->timers));
+  memset(&r->garbage, 0, sizeof(r->garbage));
+  memset(&r->sends, 0, sizeof(r->sends));
+
+  // Falls back to sending on readiness without a ring
+  r->ring = NULL;
+  r->sends_in_flight = 0;
+  if (uring_enabled()) {
+    r->ring = malloc(sizeof(uring_t));
+    if (r->ring && uring_init(r->ring, URING_ENTRIES) < 0) {
+      free(r->ring);
+      r->ring = NULL;
+    }
+  }
+  if (r->ring) {
+    memset(&r->ring_src, 0, sizeof(r->ring_src));
+    r->ring_src.fd = r->ring->fd;
+    r->ring_src.attached = true;
+    r->ring_src.timer_index = SIZE_MAX;
+    r->ring_src.on_event = reactor_on_ring_event;
+    struct epoll_event ring_ev = {
+        .events = EPOLLIN,
+        .data.ptr = &r->ring_src,
+    };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->ring->fd, &ring_ev) < 0) {
+      goto fail_ring;
+    }
+  }
+
+  if (pthread_create(&r->thread, NULL, reactor_loop, r)) {
+    goto fail_thread;
+  }
+
+  return 0;
+
+fail_thread:
+fail_ring:
+  if (r->ring) {
+    uring_free(r->ring);
+    free(r->ring);
+  }
+  pthread_mutex_destroy(&r->pending_lock);
+fail_ctl:
+  close(r->wakefd);
+fail_eventfd:
+  close(r->epfd);
+fail_epoll:
+  log_printf(LOG_ERROR, "Could not initialize reactor\n");
+  return -1;
+}
+
+int reactor_pool_init(size_t nthreads) {
+  if (nthreads == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+  }
+
+  if (nthreads > REACTOR_MAX_THREADS) {
+    nthreads = REACTOR_MAX_THREADS;
+  }
+
+  for (size_t i = 0; i < nthreads; i++) {
+    if (reactor_init(&reactors[i]) < 0) {
+      break;
+    }
+    num_reactors++;
+  }
+
+  if (num_reactors == 0) {
+    return -1;
+  }
+
+  log_printf(LOG_INFO, "Started %zu peer reactor threads%s\n", num_reactors,
+             reactors[0].ring ? " sending through io_uring" : "");
+  return 0;
+}
+
+reactor_t *reactor_pool_next(void) {
+  assert(num_reactors > 0);
+
+  reactor_t *best = &reactors[0];
+  size_t best_load = __atomic_load_n(&best->num_sources, __ATOMIC_RELAXED);
+  for (size_t i = 1; i < num_reactors; i++) {
+    size_t load = __atomic_load_n(&reactors[i].num_sources, __ATOMIC_RELAXED);
+    if (load < best_load) {
+      best = &reactors[i];
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+void reactor_pool_notify(void) {
+  for (size_t i = 0; i < num_reactors; i++) {
+    reactor_t *r = &reactors[i];
+    if (!__atomic_exchange_n(&r->notify_pending, true, __ATOMIC_ACQ_REL)) {
+      reactor_wake(r);
+    }
+  }
+}
+
+int reactor_attach(reactor_t *r, reactor_source_t *src, uint32_t events) {
+  src->events = events;
+  src->attached = false;
+  __atomic_add_fetch(&r->num_sources, 1, __ATOMIC_RELAXED);
+
+  if (pthread_equal(pthread_self(), r->thread)) {
+    reactor_adopt(r, src);
+    return 0;
+  }
+
+  pthread_mutex_lock(&r->pending_lock);
+  src->next = r->pending;
+  r->pending = src;
+  pthread_mutex_unlock(&r->pending_lock);
+
+  reactor_wake(r);
+  return 0;
+}
+
+int reactor_modify(reactor_t *r, reactor_source_t *src, uint32_t events) {
+  if (src->events == events) {
+    return 0;
+  }
+
+  struct epoll_event ev = {
+      .events = events,
+      .data.ptr = src,
+  };
+
+  if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+    log_printf(LOG_ERROR, "Could not modify fd %d in reactor: %s\n", src->fd,
+               strerror(errno));
+    return -1;
+  }
+
+  src->events = events;
+  return 0;
+}
+
+void reactor_detach(reactor_t *r, reactor_source_t *src) {
+  if (!src->attached) {
+    return;
+  }
+
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+  timer_remove(&r->timers, src);
+  src->attached = false;
+  if (src->send_queued) {
+    reactor_unqueue_send(r, src);
+  }
+
+  if (src->prev) {
+    src->prev->next = src->next;
+  } else {
+    r->sources = src->next;
+  }
+  if (src->next) {
+    src->next->prev = src->prev;
+  }
+
+  src->prev = src->next = NULL;
+  __atomic_sub_fetch(&r->num_sources, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,108 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "../uring/uring.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_THREADS 4
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_NO_DEADLINE -1
+
+struct reactor;
+
+// Anything that wants to be driven by a reactor embeds a reactor_source_t.
+// `on_event` runs with the epoll events for `fd`, `on_timer` runs once
+// `deadline` (a reactor_now_ms() timestamp) has passed and `on_notify` after
+// someone called reactor_pool_notify(). All of them run on the thread owning
+// the reactor, which otherwise sleeps in epoll_wait.
+//
+// With io_uring, sources queued with reactor_queue_send() get `on_send` to
+// fill in a submission at the end of the loop iteration. The sends of the
+// iteration go to the kernel together and the loop goes on; `on_sent` runs
+// with the result once the send completed, which can be after the source was
+// detached. Its memory has to stay valid until then.
+typedef struct reactor_source {
+  int fd;
+  uint32_t events;
+  bool attached;
+  long deadline;
+  size_t timer_index;
+  void (*on_event)(struct reactor *r, struct reactor_source *src,
+                   uint32_t events);
+  void (*on_timer)(struct reactor *r, struct reactor_source *src);
+  void (*on_notify)(struct reactor *r, struct reactor_source *src);
+  bool send_queued;
+  bool send_in_flight;
+  void (*on_send)(struct reactor *r, struct reactor_source *src,
+                  struct io_uring_sqe *sqe);
+  void (*on_sent)(struct reactor *r, struct reactor_source *src, int res);
+  struct reactor_source *prev;
+  struct reactor_source *next;
+} reactor_source_t;
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  reactor_source_t **values;
+} reactor_timers_t;
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  void **values;
+} reactor_garbage_t;
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  reactor_source_t **values;
+} reactor_sends_t;
+
+typedef struct reactor {
+  pthread_t thread;
+  int epfd;
+  int wakefd;
+  pthread_mutex_t pending_lock;
+  reactor_source_t *pending;
+  bool notify_pending;
+  reactor_source_t *sources;
+  size_t num_sources;
+  reactor_timers_t timers;
+  reactor_garbage_t garbage;
+  // NULL unless io_uring is enabled and could be set up
+  uring_t *ring;
+  // Polled along with the sockets for completions of the ring
+  reactor_source_t ring_src;
+  // Sources waiting for a slot in the ring
+  reactor_sends_t sends;
+  size_t sends_in_flight;
+} reactor_t;
+
+long reactor_now_ms(void);
+
+int reactor_pool_init(size_t nthreads);
+reactor_t *reactor_pool_next(void);
+// Thread safe: runs on_notify for every source of every reactor.
+void reactor_pool_notify(void);
+
+// Thread safe: the source is handed over to the reactor thread.
+int reactor_attach(reactor_t *r, reactor_source_t *src, uint32_t events);
+
+// Only to be called from the thread owning the reactor.
+int reactor_modify(reactor_t *r, reactor_source_t *src, uint32_t events);
+void reactor_schedule(reactor_t *r, reactor_source_t *src, long deadline);
+void reactor_detach(reactor_t *r, reactor_source_t *src);
+// Has `src` send through the reactor's ring along with everyone else's
+// sends of this loop iteration. Only valid if the reactor has a ring. Does
+// nothing while a send of the source is still in flight: on_sent queues the
+// rest.
+int reactor_queue_send(reactor_t *r, reactor_source_t *src);
+// Frees `ptr` once the current batch of events has been dispatched, so
+// events already fetched for a detached source are safely skipped.
+void reactor_defer_free(reactor_t *r, void *ptr);
+
+#endif // REACTOR_H
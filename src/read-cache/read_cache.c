@@ -0,0 +1,291 @@
+#include "read_cache.h"
+#include "../disk-io/disk_io.h"
+#include "../log/log.h"
+#include "../piece-picker/piece_picker.h"
+#include "../reactor/reactor.h"
+#include "../storage/storage.h"
+#include <stdlib.h>
+
+size_t read_cache_budget = READ_CACHE_DEFAULT_BUDGET;
+
+void read_cache_set_budget(size_t budget) { read_cache_budget = budget; }
+
+read_cache_t *read_cache_create(size_t num_pieces) {
+  if (read_cache_budget == 0) {
+    return NULL;
+  }
+
+  read_cache_t *cache = malloc(sizeof(read_cache_t));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->entries = calloc(num_pieces, sizeof(read_cache_entry_t *));
+  cache->queue = malloc(num_pieces * sizeof(uint32_t));
+  cache->failed = calloc(num_pieces, 1);
+  if (!cache->entries || !cache->queue || !cache->failed) {
+    free(cache->entries);
+    free(cache->queue);
+    free(cache->failed);
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->queued, NULL);
+  cache->budget = read_cache_budget;
+  cache->used = 0;
+  cache->num_pieces = num_pieces;
+  cache->lru_head = NULL;
+  cache->lru_tail = NULL;
+  cache->queue_head = 0;
+  cache->queue_len = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+  return cache;
+}
+
+// Called with the cache locked
+void read_cache_unlink(read_cache_entry_t *entry) {
+  read_cache_t *cache = entry->cache;
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->lru_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->lru_tail = entry->prev;
+  }
+}
+
+// Called with the cache locked
+void read_cache_link_head(read_cache_entry_t *entry) {
+  read_cache_t *cache = entry->cache;
+  entry->prev = NULL;
+  entry->next = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->prev = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+}
+
+// Called with the cache locked
+void read_cache_unref(read_cache_entry_t *entry) {
+  if (--entry->refs > 0) {
+    return;
+  }
+
+  entry->cache->used -= entry->len;
+  free(entry->data);
+  free(entry);
+}
+
+// Called with the cache locked
+void read_cache_remove(read_cache_entry_t *entry) {
+  read_cache_unlink(entry);
+  entry->cache->entries[entry->piece] = NULL;
+  read_cache_unref(entry);
+}
+
+// Drops the least recently requested pieces nobody is sending from until
+// `len` more bytes fit. Called with the cache locked.
+bool read_cache_make_room(read_cache_t *cache, size_t len) {
+  read_cache_entry_t *entry = cache->lru_tail;
+  while (cache->used + len > cache->budget && entry) {
+    read_cache_entry_t *prev = entry->prev;
+    if (entry->ready && entry->refs == 1) {
+      read_cache_remove(entry);
+      cache->evictions++;
+    }
+    entry = prev;
+  }
+
+  return cache->used + len <= cache->budget;
+}
+
+// Creates the piece's entry and queues it for loading. Returns NULL if it
+// does not fit. Called with the cache locked.
+read_cache_entry_t *read_cache_load(const metainfo_t *torrent,
+                                    uint32_t piece) {
+  read_cache_t *cache = torrent->read_cache;
+  size_t len = piece_picker_piece_len(torrent->sh.picker, piece);
+  if (!read_cache_make_room(cache, len)) {
+    return NULL;
+  }
+
+  read_cache_entry_t *entry = malloc(sizeof(read_cache_entry_t));
+  if (!entry) {
+    return NULL;
+  }
+  entry->data = malloc(len);
+  if (!entry->data) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->cache = cache;
+  entry->piece = piece;
+  entry->len = len;
+  entry->refs = 1;
+  entry->ready = false;
+  read_cache_link_head(entry);
+  cache->used += len;
+  cache->entries[piece] = entry;
+
+  cache->queue[(cache->queue_head + cache->queue_len) % cache->num_pieces] =
+      piece;
+  cache->queue_len++;
+  pthread_cond_signal(&cache->queued);
+  return entry;
+}
+
+// Only verified pieces are cached, their data does not change anymore
+bool read_cache_wants(const metainfo_t *torrent, uint32_t piece) {
+  return torrent->read_cache && piece < torrent->info.num_pieces &&
+         !torrent->read_cache->failed[piece] &&
+         piece_state_get(torrent, piece) == PIECE_STATE_HAVE;
+}
+
+void read_cache_prefetch(const metainfo_t *torrent, uint32_t piece) {
+  if (!read_cache_wants(torrent, piece)) {
+    return;
+  }
+
+  read_cache_t *cache = torrent->read_cache;
+  pthread_mutex_lock(&cache->lock);
+  read_cache_entry_t *entry = cache->entries[piece];
+  if (entry && entry->ready) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  if (entry) {
+    read_cache_unlink(entry);
+    read_cache_link_head(entry);
+  } else {
+    read_cache_load(torrent, piece);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+int read_cache_get(const metainfo_t *torrent, uint32_t piece,
+                   read_cache_entry_t **out) {
+  if (!read_cache_wants(torrent, piece)) {
+    return -1;
+  }
+
+  read_cache_t *cache = torrent->read_cache;
+  pthread_mutex_lock(&cache->lock);
+  // Evicted since it was requested, or the request came before the piece
+  // was verified
+  read_cache_entry_t *entry = cache->entries[piece];
+  if (!entry) {
+    entry = read_cache_load(torrent, piece);
+  }
+
+  int ret = -1;
+  if (entry && entry->ready) {
+    entry->refs++;
+    *out = entry;
+    ret = 1;
+  } else if (entry) {
+    ret = 0;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return ret;
+}
+
+void read_cache_put(read_cache_entry_t *entry) {
+  read_cache_t *cache = entry->cache;
+  pthread_mutex_lock(&cache->lock);
+  read_cache_unref(entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Runs on a disk thread once the piece was read
+void read_cache_loaded(const disk_job_t *job, int ret) {
+  read_cache_entry_t *entry = job->ctx;
+  read_cache_t *cache = entry->cache;
+
+  pthread_mutex_lock(&cache->lock);
+  if (ret < 0) {
+    log_printf(LOG_ERROR, "Could not read piece %u into the cache\n",
+               entry->piece);
+    cache->failed[entry->piece] = true;
+    read_cache_remove(entry);
+  } else {
+    entry->ready = true;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  reactor_pool_notify();
+}
+
+// Hints the whole batch to the backend first, so the disk reads the later
+// pieces while the earlier ones wait in the disk queue. Entries that are not
+// ready are never evicted, the pointers stay valid without the lock.
+void read_cache_load_batch(metainfo_t *torrent, read_cache_entry_t **batch,
+                           size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    size_t offset = (size_t)batch[i]->piece * torrent->info.piece_length;
+    storage_advise(torrent, offset, batch[i]->len);
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    disk_job_t job = {
+        .torrent = torrent,
+        .op = DISK_OP_READ,
+        .offset = (size_t)batch[i]->piece * torrent->info.piece_length,
+        .len = batch[i]->len,
+        .buf = batch[i]->data,
+        .done = read_cache_loaded,
+        .ctx = batch[i],
+    };
+    disk_io_submit(&job);
+  }
+}
+
+void *read_cache_thread(void *arg) {
+  metainfo_t *torrent = arg;
+  read_cache_t *cache = torrent->read_cache;
+  read_cache_entry_t *batch[READ_CACHE_BATCH];
+
+  while (true) {
+    pthread_mutex_lock(&cache->lock);
+    while (cache->queue_len == 0) {
+      pthread_cond_wait(&cache->queued, &cache->lock);
+    }
+
+    size_t len = 0;
+    while (cache->queue_len > 0 && len < READ_CACHE_BATCH) {
+      uint32_t piece = cache->queue[cache->queue_head];
+      cache->queue_head = (cache->queue_head + 1) % cache->num_pieces;
+      cache->queue_len--;
+      batch[len++] = cache->entries[piece];
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    read_cache_load_batch(torrent, batch, len);
+  }
+
+  return NULL;
+}
+
+int read_cache_start(metainfo_t *torrent) {
+  if (!torrent->read_cache) {
+    return 0;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, read_cache_thread, torrent) != 0) {
+    return -1;
+  }
+
+  return pthread_detach(thread);
+}
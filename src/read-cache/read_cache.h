@@ -0,0 +1,77 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include "../file-parser/file-parser.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define READ_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+// Most pieces the loader reads ahead for at once
+#define READ_CACHE_BATCH 32
+
+// A verified piece read into memory for seeding. Entries are loaded by the
+// cache's thread and only used once `ready`. `refs` counts the writers
+// sending from `data`, plus one while the entry is in the cache, so an
+// evicted entry is freed once its last block went out.
+typedef struct read_cache_entry {
+  struct read_cache *cache;
+  uint32_t piece;
+  size_t len;
+  uint8_t *data;
+  unsigned refs;
+  bool ready;
+  // Recency list, most recently requested first
+  struct read_cache_entry *prev;
+  struct read_cache_entry *next;
+} read_cache_entry_t;
+
+// Piece-granular LRU cache of the pieces peers download from us, so the
+// reactor threads send from memory and never wait on the disk. The first
+// request for a piece queues the whole piece for the cache's thread, which
+// starts read-ahead on everything queued before handing the reads to the
+// disk threads. Waiting connections are woken with reactor_pool_notify().
+//
+// `hits` and `misses` count the requests that found their piece loaded or
+// not, `evictions` the pieces dropped to make room.
+typedef struct read_cache {
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  size_t budget;
+  size_t used;
+  size_t num_pieces;
+  read_cache_entry_t **entries;
+  read_cache_entry_t *lru_head;
+  read_cache_entry_t *lru_tail;
+  // Pieces waiting to be loaded, each one at most once
+  uint32_t *queue;
+  size_t queue_head;
+  size_t queue_len;
+  // Pieces that could not be read, they are served from storage
+  uint8_t *failed;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} read_cache_t;
+
+// Budget of the caches created from now on, 0 disables them
+void read_cache_set_budget(size_t budget);
+// Returns NULL, meaning no cache, if the budget is 0
+read_cache_t *read_cache_create(size_t num_pieces);
+// Starts the thread loading the pieces of `torrent` into its cache
+int read_cache_start(metainfo_t *torrent);
+
+// Every function below takes a NULL cache as one that holds nothing.
+
+// A peer requested a block of `piece`: counts a hit or a miss and starts
+// loading the piece if it is not in the cache.
+void read_cache_prefetch(const metainfo_t *torrent, uint32_t piece);
+// Returns 1 with the piece's entry in `out` and a reference taken, 0 if the
+// piece is being loaded and -1 if it is not cached and has to be read from
+// storage: without a cache, before the piece is verified or without room.
+int read_cache_get(const metainfo_t *torrent, uint32_t piece,
+                   read_cache_entry_t **out);
+void read_cache_put(read_cache_entry_t *entry);
+
+#endif // READ_CACHE_H
@@ -0,0 +1,120 @@
+#include "recheck.h"
+#include "../hash-pool/hash_pool.h"
+#include "../log/log.h"
+#include "../piece-picker/piece_picker.h"
+#include "../piece-request/piece_request.h"
+#include "../reactor/reactor.h"
+#include <stdbool.h>
+
+size_t recheck_piece_len(const metainfo_t *torrent, size_t piece) {
+  size_t left = torrent->info.length - piece * torrent->info.piece_length;
+  return left < torrent->info.piece_length ? left : torrent->info.piece_length;
+}
+
+void recheck_done(const hash_job_t *job, bool valid) {
+  metainfo_t *torrent = job->torrent;
+  recheck_t *rc = job->ctx;
+
+  if (valid) {
+    piece_state_swap(torrent, job->piece, PIECE_STATE_HAVE);
+    __atomic_sub_fetch(&torrent->sh.pieces_left, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&torrent->sh.picker_lock);
+    piece_picker_remove(torrent->sh.picker, job->piece);
+    pthread_mutex_unlock(&torrent->sh.picker_lock);
+  }
+
+  pthread_mutex_lock(&rc->lock);
+  rc->checked++;
+  rc->valid += valid;
+  rc->bytes += recheck_piece_len(torrent, job->piece);
+  pthread_cond_signal(&rc->cond);
+  pthread_mutex_unlock(&rc->lock);
+}
+
+// True if the pieces only hold bytes of files this run created
+bool recheck_fresh(const metainfo_t *torrent, size_t first, size_t count) {
+  size_t offset = first * torrent->info.piece_length;
+  size_t end = offset + (count - 1) * torrent->info.piece_length +
+               recheck_piece_len(torrent, first + count - 1);
+
+  for (size_t i = piece_request_file_at(torrent, offset);
+       i < torrent->info.files_count && torrent->file_offsets[i] < end; i++) {
+    if (!torrent->files[i]->fresh) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void recheck_report(const metainfo_t *torrent, const recheck_t *rc,
+                    long start) {
+  long elapsed = reactor_now_ms() - start;
+  double mbps = elapsed > 0 ? rc->bytes / 1e3 / elapsed : 0;
+  log_printf(LOG_INFO,
+             "Recheck: %zu/%zu pieces checked, %zu valid, %.1f MB/s\n",
+             rc->checked, torrent->info.num_pieces, rc->valid, mbps);
+}
+
+int torrent_recheck(metainfo_t *torrent) {
+  size_t num_pieces = torrent->info.num_pieces;
+  recheck_t rc = {
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .cond = PTHREAD_COND_INITIALIZER,
+  };
+  long start = reactor_now_ms();
+  long last_report = start;
+  size_t queued = 0;
+  int ret = 0;
+
+  for (size_t i = 0; i < num_pieces; i += HASH_JOB_MAX_PIECES) {
+    size_t n = num_pieces - i < HASH_JOB_MAX_PIECES ? num_pieces - i
+                                                    : HASH_JOB_MAX_PIECES;
+    if (recheck_fresh(torrent, i, n)) {
+      continue;
+    }
+
+    hash_job_t job = {
+        .torrent = torrent,
+        .piece = i,
+        .num_pieces = n,
+        .done = recheck_done,
+        .ctx = &rc,
+    };
+    if (hash_pool_submit(&job) < 0) {
+      ret = -1;
+      break;
+    }
+    queued += n;
+
+    if (reactor_now_ms() - last_report >= RECHECK_REPORT_INTERVAL_MS) {
+      pthread_mutex_lock(&rc.lock);
+      recheck_report(torrent, &rc, start);
+      pthread_mutex_unlock(&rc.lock);
+      last_report = reactor_now_ms();
+    }
+  }
+
+  // The jobs point at `rc`: wait for all of them, even after a failure
+  pthread_mutex_lock(&rc.lock);
+  while (rc.checked < queued) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RECHECK_REPORT_INTERVAL_MS / 1000;
+    if (pthread_cond_timedwait(&rc.cond, &rc.lock, &deadline) != 0) {
+      recheck_report(torrent, &rc, start);
+    }
+  }
+  if (queued > 0) {
+    recheck_report(torrent, &rc, start);
+  }
+  size_t valid = rc.valid;
+  pthread_mutex_unlock(&rc.lock);
+
+  if (valid > 0) {
+    log_printf(LOG_INFO, "Resuming with %zu of %zu pieces already on disk\n",
+               valid, num_pieces);
+  }
+
+  return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef RECHECK_H
+#define RECHECK_H
+
+#include "../file-parser/file-parser.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#define RECHECK_REPORT_INTERVAL_MS 1000
+
+// Progress of a recheck, updated by the hashing threads
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t checked;
+  size_t valid;
+  size_t bytes;
+} recheck_t;
+
+// Hashes whatever an earlier run left on disk on the hash pool and marks the
+// pieces that check out as downloaded. Files created by this run are skipped.
+// Has to run before the torrent has any connections.
+int torrent_recheck(metainfo_t *torrent);
+
+#endif // RECHECK_H
@@ -0,0 +1,448 @@
+#include "resume.h"
+#include "../bitfield/bitfield.h"
+#include "../log/log.h"
+#include "../peer-connection/peer-connection.h"
+#include "../piece-picker/piece_picker.h"
+#include "../write-cache/write_cache.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Only one save writes the temporary file at a time
+pthread_mutex_t resume_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void resume_path(const metainfo_t *torrent, char *out, const char *suffix) {
+  snprintf(out, RESUME_PATH_MAX, "./%s.resume%s", torrent->info.name, suffix);
+}
+
+int resume_put(resume_buf_t *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + len) {
+      cap *= 2;
+    }
+    uint8_t *values = realloc(buf->values, cap);
+    if (!values) {
+      return -1;
+    }
+    buf->values = values;
+    buf->cap = cap;
+  }
+
+  memcpy(buf->values + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+int resume_put_u32(resume_buf_t *buf, uint32_t value) {
+  uint8_t be[4] = {value >> 24, value >> 16, value >> 8, value};
+  return resume_put(buf, be, sizeof(be));
+}
+
+int resume_put_u64(resume_buf_t *buf, uint64_t value) {
+  if (resume_put_u32(buf, value >> 32) < 0) {
+    return -1;
+  }
+  return resume_put_u32(buf, value);
+}
+
+// Reads from a record, `off` moves past what was read. Reading past the end
+// fails, so a truncated record is never applied.
+int resume_get(const resume_buf_t *buf, size_t *off, void *out, size_t len) {
+  if (buf->len - *off < len) {
+    return -1;
+  }
+
+  memcpy(out, buf->values + *off, len);
+  *off += len;
+  return 0;
+}
+
+int resume_get_u32(const resume_buf_t *buf, size_t *off, uint32_t *out) {
+  uint8_t be[4];
+  if (resume_get(buf, off, be, sizeof(be)) < 0) {
+    return -1;
+  }
+
+  *out = (uint32_t)be[0] << 24 | (uint32_t)be[1] << 16 | (uint32_t)be[2] << 8 |
+         be[3];
+  return 0;
+}
+
+int resume_get_u64(const resume_buf_t *buf, size_t *off, uint64_t *out) {
+  uint32_t hi, lo;
+  if (resume_get_u32(buf, off, &hi) < 0 || resume_get_u32(buf, off, &lo) < 0) {
+    return -1;
+  }
+
+  *out = (uint64_t)hi << 32 | lo;
+  return 0;
+}
+
+size_t resume_num_blocks(const metainfo_t *torrent, uint32_t piece) {
+  size_t len = piece_picker_piece_len(torrent->sh.picker, piece);
+  size_t block_len = piece_picker_block_len(torrent->sh.picker, piece, 0);
+  return (len + block_len - 1) / block_len;
+}
+
+// Piece states, partial pieces and peers, everything after the files
+int resume_snapshot(metainfo_t *torrent, resume_buf_t *buf) {
+  size_t num_pieces = torrent->info.num_pieces;
+  uint8_t *have = calloc(BITFIELD_NUM_BYTES(num_pieces), 1);
+  uint8_t *blocks =
+      calloc(BITFIELD_NUM_BYTES(resume_num_blocks(torrent, 0)), 1);
+  if (!have || !blocks) {
+    goto fail_alloc;
+  }
+
+  pthread_mutex_lock(&torrent->sh.picker_lock);
+  for (size_t i = 0; i < num_pieces; i++) {
+    if (piece_state_get(torrent, i) == PIECE_STATE_HAVE) {
+      BITFIELD_SET(i, have);
+    }
+  }
+
+  int ret = resume_put(buf, have, BITFIELD_NUM_BYTES(num_pieces));
+  // The count is filled in once the partial pieces are written
+  size_t num_partials_at = buf->len;
+  uint32_t num_partials = 0;
+  ret |= resume_put_u32(buf, 0);
+  for (size_t i = 0; i < num_pieces && ret == 0; i++) {
+    // Blocks in the write cache are not on disk
+    if (BITFIELD_ISSET(i, have) ||
+        write_cache_holds(torrent->write_cache, i) ||
+        !piece_picker_received_blocks(torrent->sh.picker, i, blocks)) {
+      continue;
+    }
+
+    ret |= resume_put_u32(buf, i);
+    ret |= resume_put(buf, blocks,
+                      BITFIELD_NUM_BYTES(resume_num_blocks(torrent, i)));
+    num_partials++;
+  }
+  pthread_mutex_unlock(&torrent->sh.picker_lock);
+  if (ret == 0) {
+    size_t len = buf->len;
+    buf->len = num_partials_at;
+    resume_put_u32(buf, num_partials);
+    buf->len = len;
+  }
+
+  // Peers that accepted our connections are likely to do it again. The
+  // address of an inbound peer is not the one it listens on.
+  pthread_mutex_lock(&torrent->sh.sh_lock);
+  peer_connections_t *conns = torrent->sh.peer_connections;
+  uint32_t num_peers = 0;
+  for (size_t i = 0; i < conns->len && num_peers < RESUME_MAX_PEERS; i++) {
+    num_peers += !conns->values[i].conn->inbound;
+  }
+  ret |= resume_put_u32(buf, num_peers);
+  for (size_t i = 0, saved = 0; i < conns->len && saved < num_peers; i++) {
+    const peer_t *peer = &conns->values[i].peer;
+    if (conns->values[i].conn->inbound) {
+      continue;
+    }
+
+    ret |= resume_put(buf, &peer->addr.sa_in.sin_addr.s_addr, 4);
+    ret |= resume_put(buf, &peer->addr.sa_in.sin_port, 2);
+    saved++;
+  }
+  pthread_mutex_unlock(&torrent->sh.sh_lock);
+
+  free(blocks);
+  free(have);
+  return ret;
+
+fail_alloc:
+  free(blocks);
+  free(have);
+  return -1;
+}
+
+int resume_write(const char *path, const resume_buf_t *buf) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (fd < 0) {
+    goto fail_open;
+  }
+
+  for (size_t off = 0; off < buf->len;) {
+    ssize_t n = write(fd, buf->values + off, buf->len - off);
+    if (n < 0) {
+      goto fail_write;
+    }
+    off += n;
+  }
+  if (fsync(fd) < 0) {
+    goto fail_write;
+  }
+
+  return close(fd);
+
+fail_write:
+  close(fd);
+fail_open:
+  log_printf(LOG_ERROR, "Could not write %s\n", path);
+  return -1;
+}
+
+int resume_save(metainfo_t *torrent) {
+  // Nothing survives the process to resume from
+  if (!torrent->files[0]->backend->persistent) {
+    return 0;
+  }
+
+  resume_buf_t body = {0};
+  resume_buf_t buf = {0};
+  int ret = -1;
+
+  // Snapshot first: a block received after this is not claimed, one
+  // received before is on disk once the files are synced
+  if (resume_snapshot(torrent, &body) < 0) {
+    goto out;
+  }
+
+  if (resume_put(&buf, RESUME_MAGIC, strlen(RESUME_MAGIC)) < 0 ||
+      resume_put_u32(&buf, RESUME_VERSION) < 0 ||
+      resume_put(&buf, torrent->info_hash, SHA_DIGEST_LENGTH) < 0 ||
+      resume_put_u32(&buf, torrent->info.num_pieces) < 0 ||
+      resume_put_u32(&buf, torrent->info.files_count) < 0) {
+    goto out;
+  }
+
+  for (size_t i = 0; i < torrent->info.files_count; i++) {
+    dl_file_t *file = torrent->files[i];
+    struct stat st;
+    // The mtime has to be taken after the writes reach the file, or the
+    // next writeback makes the record look stale
+    if (dl_file_sync(file) < 0 || dl_file_stat(file, &st) < 0) {
+      log_printf(LOG_ERROR, "Could not sync %s\n", file->path);
+      goto out;
+    }
+
+    if (resume_put_u64(&buf, st.st_size) < 0 ||
+        resume_put_u64(&buf, st.st_mtim.tv_sec) < 0 ||
+        resume_put_u32(&buf, st.st_mtim.tv_nsec) < 0) {
+      goto out;
+    }
+  }
+
+  if (resume_put(&buf, body.values, body.len) < 0) {
+    goto out;
+  }
+
+  char path[RESUME_PATH_MAX], tmp[RESUME_PATH_MAX];
+  resume_path(torrent, path, "");
+  resume_path(torrent, tmp, ".tmp");
+
+  pthread_mutex_lock(&resume_lock);
+  if (resume_write(tmp, &buf) == 0 && rename(tmp, path) == 0) {
+    ret = 0;
+  }
+  pthread_mutex_unlock(&resume_lock);
+
+out:
+  free(buf.values);
+  free(body.values);
+  return ret;
+}
+
+int resume_read(const char *path, resume_buf_t *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    goto fail;
+  }
+  out->values = malloc(st.st_size);
+  out->cap = st.st_size;
+  if (!out->values) {
+    goto fail;
+  }
+
+  while (out->len < out->cap) {
+    ssize_t n = read(fd, out->values + out->len, out->cap - out->len);
+    if (n <= 0) {
+      goto fail;
+    }
+    out->len += n;
+  }
+
+  close(fd);
+  return 0;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+// Checks the header and that every file is the one the record describes
+int resume_check(const metainfo_t *torrent, const resume_buf_t *buf,
+                 size_t *off) {
+  char magic[sizeof(RESUME_MAGIC) - 1];
+  char info_hash[SHA_DIGEST_LENGTH];
+  uint32_t version, num_pieces, num_files;
+  if (resume_get(buf, off, magic, sizeof(magic)) < 0 ||
+      memcmp(magic, RESUME_MAGIC, sizeof(magic)) != 0 ||
+      resume_get_u32(buf, off, &version) < 0 || version != RESUME_VERSION ||
+      resume_get(buf, off, info_hash, sizeof(info_hash)) < 0 ||
+      memcmp(info_hash, torrent->info_hash, sizeof(info_hash)) != 0 ||
+      resume_get_u32(buf, off, &num_pieces) < 0 ||
+      num_pieces != torrent->info.num_pieces ||
+      resume_get_u32(buf, off, &num_files) < 0 ||
+      num_files != torrent->info.files_count) {
+    log_printf(LOG_WARNING, "Resume record is not for this torrent\n");
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_files; i++) {
+    dl_file_t *file = torrent->files[i];
+    uint64_t size, sec;
+    uint32_t nsec;
+    if (resume_get_u64(buf, off, &size) < 0 ||
+        resume_get_u64(buf, off, &sec) < 0 ||
+        resume_get_u32(buf, off, &nsec) < 0) {
+      return -1;
+    }
+
+    struct stat st;
+    if (file->fresh || dl_file_stat(file, &st) < 0 ||
+        (uint64_t)st.st_size != size || (uint64_t)st.st_mtim.tv_sec != sec ||
+        (uint32_t)st.st_mtim.tv_nsec != nsec) {
+      log_printf(LOG_INFO, "%s changed since the resume record was saved\n",
+                 file->path);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int resume_load(metainfo_t *torrent) {
+  char path[RESUME_PATH_MAX];
+  resume_path(torrent, path, "");
+  resume_buf_t buf = {0};
+  size_t off = 0;
+  size_t num_pieces = torrent->info.num_pieces;
+  uint8_t *blocks = NULL;
+  int ret = -1;
+
+  if (resume_read(path, &buf) < 0 || resume_check(torrent, &buf, &off) < 0) {
+    goto out;
+  }
+
+  // Make sure all of it parses before touching the torrent
+  size_t have_off = off;
+  off += BITFIELD_NUM_BYTES(num_pieces);
+  uint32_t num_partials, num_peers;
+  if (off > buf.len || resume_get_u32(&buf, &off, &num_partials) < 0) {
+    goto fail_corrupt;
+  }
+  size_t partials_off = off;
+  for (uint32_t i = 0; i < num_partials; i++) {
+    uint32_t piece;
+    if (resume_get_u32(&buf, &off, &piece) < 0 || piece >= num_pieces ||
+        BITFIELD_ISSET(piece, buf.values + have_off)) {
+      goto fail_corrupt;
+    }
+    off += BITFIELD_NUM_BYTES(resume_num_blocks(torrent, piece));
+    if (off > buf.len) {
+      goto fail_corrupt;
+    }
+  }
+  if (resume_get_u32(&buf, &off, &num_peers) < 0 ||
+      buf.len - off != (size_t)num_peers * 6) {
+    goto fail_corrupt;
+  }
+
+  const uint8_t *have = buf.values + have_off;
+  size_t num_have = 0;
+  for (size_t i = 0; i < num_pieces; i++) {
+    if (BITFIELD_ISSET(i, have)) {
+      piece_state_swap(torrent, i, PIECE_STATE_HAVE);
+      torrent->sh.pieces_left--;
+      piece_picker_remove(torrent->sh.picker, i);
+      num_have++;
+    }
+  }
+
+  // A piece whose blocks have all arrived may never have been verified:
+  // download it again rather than trust it
+  off = partials_off;
+  size_t num_resumed = 0;
+  blocks = calloc(BITFIELD_NUM_BYTES(resume_num_blocks(torrent, 0)), 1);
+  if (!blocks) {
+    goto out;
+  }
+  for (uint32_t i = 0; i < num_partials; i++) {
+    uint32_t piece;
+    resume_get_u32(&buf, &off, &piece);
+    size_t n = resume_num_blocks(torrent, piece);
+    resume_get(&buf, &off, blocks, BITFIELD_NUM_BYTES(n));
+
+    size_t received = 0;
+    for (size_t b = 0; b < n; b++) {
+      received += BITFIELD_ISSET(b, blocks);
+    }
+    if (received > 0 && received < n &&
+        piece_picker_resume_piece(torrent->sh.picker, piece, blocks) == 0) {
+      // The rest of the piece has to join the blocks on disk
+      write_cache_bypass(torrent->write_cache, piece);
+      num_resumed++;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_peers; i++) {
+    peer_t peer = {0};
+    peer.addr.sa_in.sin_family = AF_INET;
+    resume_get(&buf, &off, &peer.addr.sa_in.sin_addr.s_addr, 4);
+    resume_get(&buf, &off, &peer.addr.sa_in.sin_port, 2);
+    da_append(torrent->sh.candidates, peer);
+  }
+
+  log_printf(LOG_INFO,
+             "Resuming from %s: %zu of %zu pieces done, %zu partially, %u "
+             "known peers\n",
+             path, num_have, num_pieces, num_resumed, num_peers);
+  ret = 0;
+  goto out;
+
+fail_corrupt:
+  log_printf(LOG_WARNING, "Resume record %s is corrupt\n", path);
+out:
+  free(blocks);
+  free(buf.values);
+  return ret;
+}
+
+void *resume_thread(void *arg) {
+  metainfo_t *torrent = arg;
+  while (true) {
+    sleep(RESUME_SAVE_INTERVAL_SEC);
+    if (resume_save(torrent) < 0) {
+      log_printf(LOG_WARNING, "Could not save the resume record\n");
+    }
+  }
+
+  return NULL;
+}
+
+int resume_start(metainfo_t *torrent) {
+  if (!torrent->files[0]->backend->persistent) {
+    return 0;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, resume_thread, torrent) != 0) {
+    return -1;
+  }
+
+  return pthread_detach(thread);
+}
@@ -0,0 +1,42 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "../file-parser/file-parser.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESUME_MAGIC "BTRESUME"
+#define RESUME_VERSION 1
+#define RESUME_SAVE_INTERVAL_SEC 30
+#define RESUME_MAX_PEERS 50
+#define RESUME_PATH_MAX 512
+
+typedef struct {
+  size_t len;
+  size_t cap;
+  uint8_t *values;
+} resume_buf_t;
+
+// Resume record, `./<name>.resume` next to the downloaded data. All integers
+// are big endian:
+//
+//   magic[8] version:u32 info_hash[20] num_pieces:u32 num_files:u32
+//   num_files * (size:u64 mtime_sec:u64 mtime_nsec:u32)
+//   have:bitfield(num_pieces)
+//   num_partials:u32 num_partials * (piece:u32 received:bitfield(blocks))
+//   num_peers:u32 num_peers * (ipv4:u8[4] port:u16)
+//
+// File sizes and mtimes are taken after the data was synced to disk, so a
+// record whose files still match claims nothing that is not there.
+
+// Seeds the torrent's piece states, partial pieces and candidate peers from
+// its resume record. Fails, leaving the torrent untouched, if there is no
+// record or the files changed since it was written.
+int resume_load(metainfo_t *torrent);
+// Thread safe. Writes the record to a temporary file and renames it over the
+// previous one, so a crash never leaves a torn record behind.
+int resume_save(metainfo_t *torrent);
+// Saves the record every RESUME_SAVE_INTERVAL_SEC from a background thread
+int resume_start(metainfo_t *torrent);
+
+#endif // RESUME_H
@@ -1,39 +1,147 @@
-
-#include "../file-parser/file-parser.h"
-#include "../piece-request/piece_request.h"
-#include <openssl/evp.h>
-#include <openssl/ssl.h>
+#include "sha1.h"
+#include "../log/log.h"
+#include "../storage/storage.h"
+#include "../write-cache/write_cache.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 
+piece_hasher_t *piece_hashers_create(size_t num_pieces) {
+  piece_hasher_t *hashers = calloc(num_pieces, sizeof(piece_hasher_t));
+  if (!hashers) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < num_pieces; i++) {
+    pthread_mutex_init(&hashers[i].lock, NULL);
+  }
+
+  return hashers;
+}
+
+size_t sha1_piece_len(const metainfo_t *torrent, size_t piece_index) {
+  size_t left = torrent->info.length - piece_index * torrent->info.piece_length;
+  return left < torrent->info.piece_length ? left : torrent->info.piece_length;
+}
+
+// Called with the hasher locked
+int sha1_advance(piece_hasher_t *h, const metainfo_t *torrent,
+                 size_t piece_index, size_t len) {
+  if (!h->started) {
+    if (sha1_init(&h->ctx) < 0) {
+      return -1;
+    }
+    h->started = true;
+  }
+
+  if (len > h->hashed) {
+    // Pieces in the write cache never have to be read back from storage
+    write_cache_entry_t *cached = write_cache_get(torrent, piece_index, false);
+    if (cached) {
+      sha1_update(&h->ctx, cached->data + h->hashed, len - h->hashed);
+      write_cache_put(cached);
+    } else {
+      size_t offset = piece_index * torrent->info.piece_length + h->hashed;
+      if (storage_hash(torrent, offset, len - h->hashed, &h->ctx) < 0) {
+        return -1;
+      }
+    }
+    h->hashed = len;
+  }
+
+  return 0;
+}
+
+uint32_t torrent_sha1_epoch(metainfo_t *torrent, size_t piece_index) {
+  return __atomic_load_n(&torrent->sh.hashers[piece_index].epoch,
+                         __ATOMIC_ACQUIRE);
+}
+
+void torrent_sha1_update(metainfo_t *torrent, size_t piece_index, size_t len,
+                         uint32_t epoch) {
+  piece_hasher_t *h = &torrent->sh.hashers[piece_index];
+  if (pthread_mutex_trylock(&h->lock) != 0) {
+    return;
+  }
+
+  if (h->epoch == epoch) {
+    sha1_advance(h, torrent, piece_index, len);
+  }
+
+  pthread_mutex_unlock(&h->lock);
+}
+
 bool torrent_sha1_verify(metainfo_t *torrent, size_t piece_index) {
   assert(piece_index < torrent->info.num_pieces);
+  // Nothing was kept to check, take the peers' word for it
+  if (storage_discards(torrent)) {
+    return true;
+  }
 
   uint8_t *piece_hash = torrent->info.pieces[piece_index];
+  piece_hasher_t *h = &torrent->sh.hashers[piece_index];
+  uint8_t buf[SHA1_DIGEST_LEN];
+  bool valid = false;
+
+  pthread_mutex_lock(&h->lock);
+  size_t caught_up = sha1_piece_len(torrent, piece_index) - h->hashed;
+  if (sha1_advance(h, torrent, piece_index,
+                   sha1_piece_len(torrent, piece_index)) < 0) {
+    log_printf(LOG_ERROR, "Could not hash piece %zu\n", piece_index);
+  } else {
+    sha1_final(&h->ctx, buf);
+    h->started = false;
+    valid = memcmp(piece_hash, buf, SHA1_DIGEST_LEN) == 0;
+  }
+
+  h->hashed = 0;
+  __atomic_store_n(&h->epoch, h->epoch + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&h->lock);
 
-  piece_request_t *pr = piece_request_create(torrent, piece_index);
-  OpenSSL_add_all_algorithms();
-  ERR_load_crypto_strings();
-  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-  const EVP_MD *hashptr = EVP_get_digestbyname("SHA1");
-  EVP_DigestInit(ctx, hashptr);
+  log_printf(LOG_DEBUG, "Piece %zu verified, %zu bytes hashed at the end\n",
+             piece_index, caught_up);
+  return valid;
+}
 
-  for (size_t i = 0; i < pr->block_requests->len; i++) {
-    block_request_t *br = &pr->block_requests->values[i];
+void torrent_sha1_verify_many(metainfo_t *torrent, size_t first, size_t count,
+                              bool *valid) {
+  assert(count <= SHA1_LANES);
+  const uint8_t *data[SHA1_LANES];
+  size_t lens[SHA1_LANES];
+  size_t pieces[SHA1_LANES];
+  size_t n = 0;
 
-    for (size_t j = 0; j < br->filemems->len; j++) {
-      filemem_t mem = br->filemems->values[j];
-      EVP_DigestUpdate(ctx, mem.mem, mem.size);
+  for (size_t i = 0; i < count; i++) {
+    size_t piece = first + i;
+    size_t offset = piece * torrent->info.piece_length;
+    size_t len = sha1_piece_len(torrent, piece);
+
+    // Pieces spanning files, or not in memory, are hashed one by one
+    const uint8_t *mem = storage_map(torrent, offset, len);
+    if (!mem) {
+      valid[i] = torrent_sha1_verify(torrent, piece);
+      continue;
     }
+
+    data[n] = mem;
+    lens[n] = len;
+    pieces[n++] = i;
   }
 
-  unsigned char buf[SHA1_LENGTH];
-  unsigned int outlen;
-  EVP_DigestFinal_ex(ctx, buf, &outlen);
+  if (n == 0) {
+    return;
+  }
 
-  EVP_MD_CTX_free(ctx);
-  piece_request_free(pr);
+  uint8_t digests[SHA1_LANES][SHA1_DIGEST_LEN];
+  if (sha1_many(data, lens, n, digests) < 0) {
+    for (size_t i = 0; i < n; i++) {
+      valid[pieces[i]] = false;
+    }
+    return;
+  }
 
-  return memcmp(piece_hash, buf, SHA1_LENGTH) == 0;
+  for (size_t i = 0; i < n; i++) {
+    valid[pieces[i]] = memcmp(torrent->info.pieces[first + pieces[i]],
+                              digests[i], SHA1_DIGEST_LEN) == 0;
+  }
 }
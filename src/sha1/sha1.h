@@ -2,8 +2,34 @@
 #define SHA1_H
 
 #include "../file-parser/file-parser.h"
+#include "sha1_engine.h"
+#include <pthread.h>
 #include <stddef.h>
 
+// Streaming hash of a piece being downloaded: the first `hashed` bytes of the
+// piece already went into `ctx`, if `started`. `epoch` changes every time the
+// state is reset, so updates worked out before a reset are dropped.
+typedef struct piece_hasher {
+  pthread_mutex_t lock;
+  sha1_ctx_t ctx;
+  bool started;
+  size_t hashed;
+  uint32_t epoch;
+} piece_hasher_t;
+
+piece_hasher_t *piece_hashers_create(size_t num_pieces);
+
+uint32_t torrent_sha1_epoch(metainfo_t *torrent, size_t piece_index);
+// Feeds the piece into its hash up to `len` bytes, unless someone else is
+// hashing it right now: whatever is skipped is caught up on verification.
+void torrent_sha1_update(metainfo_t *torrent, size_t piece_index, size_t len,
+                         uint32_t epoch);
+// Hashes what the updates did not cover and compares against the metainfo.
+// The piece starts over from an empty hash afterwards.
 bool torrent_sha1_verify(metainfo_t *torrent, size_t piece_index);
+// Verifies `count` consecutive pieces nobody is downloading, hashing those
+// that lie within a single file side by side. Results go to `valid`.
+void torrent_sha1_verify_many(metainfo_t *torrent, size_t first, size_t count,
+                              bool *valid);
 
 #endif // SHA1_H
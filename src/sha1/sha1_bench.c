@@ -0,0 +1,73 @@
+#include "sha1_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_PIECE_LEN (1024 * 1024)
+#define BENCH_NUM_PIECES 64
+#define BENCH_ROUNDS 4
+
+uint8_t digests[BENCH_NUM_PIECES][SHA1_DIGEST_LEN];
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, double secs) {
+  double bytes = (double)BENCH_ROUNDS * BENCH_NUM_PIECES * BENCH_PIECE_LEN;
+  printf("%-16s %6.2f GB/s\n", name, bytes / secs / 1e9);
+}
+
+// Hashes BENCH_NUM_PIECES pieces of BENCH_PIECE_LEN bytes with every variant
+// the CPU supports: one piece at a time with each scalar implementation,
+// then all of them at once with each multi-buffer one.
+int main() {
+  uint8_t *data = malloc((size_t)BENCH_NUM_PIECES * BENCH_PIECE_LEN);
+  if (!data) {
+    return 1;
+  }
+  for (size_t i = 0; i < (size_t)BENCH_NUM_PIECES * BENCH_PIECE_LEN; i++) {
+    data[i] = rand();
+  }
+
+  const uint8_t *pieces[BENCH_NUM_PIECES];
+  size_t lens[BENCH_NUM_PIECES];
+  for (size_t i = 0; i < BENCH_NUM_PIECES; i++) {
+    pieces[i] = data + i * BENCH_PIECE_LEN;
+    lens[i] = BENCH_PIECE_LEN;
+  }
+
+  for (sha1_impl_t impl = 0; impl < SHA1_IMPL_MAX; impl++) {
+    if (sha1_engine_use(impl, SHA1_MULTI_SERIAL) < 0) {
+      printf("%-16s unsupported\n", sha1_impl_name(impl));
+      continue;
+    }
+
+    double start = now_sec();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+      for (size_t i = 0; i < BENCH_NUM_PIECES; i++) {
+        sha1(pieces[i], lens[i], digests[i]);
+      }
+    }
+    report(sha1_impl_name(impl), now_sec() - start);
+  }
+
+  for (sha1_multi_t multi = SHA1_MULTI_SERIAL + 1; multi < SHA1_MULTI_MAX;
+       multi++) {
+    if (sha1_engine_use(SHA1_IMPL_EVP, multi) < 0) {
+      printf("%-16s unsupported\n", sha1_multi_name(multi));
+      continue;
+    }
+
+    double start = now_sec();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+      sha1_many(pieces, lens, BENCH_NUM_PIECES, digests);
+    }
+    report(sha1_multi_name(multi), now_sec() - start);
+  }
+
+  free(data);
+  return 0;
+}
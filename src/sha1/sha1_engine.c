@@ -0,0 +1,455 @@
+#include "sha1_engine.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_X86
+#endif
+
+typedef void (*sha1_blocks_fn)(uint32_t h[5], const uint8_t *p, size_t n);
+
+const uint32_t sha1_iv[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                             0xC3D2E1F0};
+
+bool sha1_engine_ready = false;
+bool sha1_has_shani = false;
+bool sha1_has_avx2 = false;
+sha1_impl_t sha1_impl = SHA1_IMPL_EVP;
+sha1_multi_t sha1_multi = SHA1_MULTI_SERIAL;
+sha1_blocks_fn sha1_blocks = NULL;
+
+static inline void store_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v) {
+  store_be32(p, v >> 32);
+  store_be32(p + 4, v);
+}
+
+// Writes the padding that follows the last `rem` bytes of a `len` byte
+// message. `tail` holds those bytes already. Returns the number of blocks.
+size_t sha1_pad(uint8_t tail[2 * SHA1_BLOCK_LEN], size_t rem, uint64_t len) {
+  size_t blocks = rem + 1 + 8 <= SHA1_BLOCK_LEN ? 1 : 2;
+  tail[rem] = 0x80;
+  memset(tail + rem + 1, 0, blocks * SHA1_BLOCK_LEN - rem - 1 - 8);
+  store_be64(tail + blocks * SHA1_BLOCK_LEN - 8, len * 8);
+  return blocks;
+}
+
+#ifdef SHA1_X86
+
+// Rounds 4*i .. 4*i+3. `E` alternates between the two registers, the one
+// not in use keeps ABCD for the next group's E.
+#define SHANI_ROUNDS(i)                                                        \
+  do {                                                                         \
+    if ((i) >= 4) {                                                            \
+      MSG[(i) % 4] = _mm_sha1msg2_epu32(                                       \
+          _mm_xor_si128(                                                       \
+              _mm_sha1msg1_epu32(MSG[(i) % 4], MSG[((i) + 1) % 4]),            \
+              MSG[((i) + 2) % 4]),                                             \
+          MSG[((i) + 3) % 4]);                                                 \
+    }                                                                          \
+    if ((i) == 0) {                                                            \
+      E[0] = _mm_add_epi32(E[0], MSG[0]);                                      \
+    } else {                                                                   \
+      E[(i) & 1] = _mm_sha1nexte_epu32(E[(i) & 1], MSG[(i) % 4]);              \
+    }                                                                          \
+    E[((i) + 1) & 1] = ABCD;                                                   \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E[(i) & 1], (i) / 5);                     \
+  } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3"))) void
+sha1_blocks_shani(uint32_t h[5], const uint8_t *p, size_t n) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1B);
+  __m128i E0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+  for (; n > 0; n--, p += SHA1_BLOCK_LEN) {
+    __m128i ABCD_SAVE = ABCD;
+    __m128i E_SAVE = E0;
+    __m128i MSG[4];
+    __m128i E[2] = {E0, E0};
+    for (int i = 0; i < 4; i++) {
+      MSG[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p + i), bswap);
+    }
+
+    SHANI_ROUNDS(0);
+    SHANI_ROUNDS(1);
+    SHANI_ROUNDS(2);
+    SHANI_ROUNDS(3);
+    SHANI_ROUNDS(4);
+    SHANI_ROUNDS(5);
+    SHANI_ROUNDS(6);
+    SHANI_ROUNDS(7);
+    SHANI_ROUNDS(8);
+    SHANI_ROUNDS(9);
+    SHANI_ROUNDS(10);
+    SHANI_ROUNDS(11);
+    SHANI_ROUNDS(12);
+    SHANI_ROUNDS(13);
+    SHANI_ROUNDS(14);
+    SHANI_ROUNDS(15);
+    SHANI_ROUNDS(16);
+    SHANI_ROUNDS(17);
+    SHANI_ROUNDS(18);
+    SHANI_ROUNDS(19);
+
+    E0 = _mm_sha1nexte_epu32(E[0], E_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+  }
+
+  _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(ABCD, 0x1B));
+  h[4] = _mm_extract_epi32(E0, 3);
+}
+
+#define AVX2_ROTL(x, n)                                                        \
+  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// Loads word `w .. w+7` of the current block of every lane, one register per
+// word holding it for all lanes.
+__attribute__((target("avx2"))) static inline void
+avx2_load_words(const uint8_t *const p[SHA1_LANES], size_t half,
+                __m256i out[8]) {
+  const __m256i bswap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+      9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+  __m256i r[8], t[8], u[8];
+  for (int l = 0; l < 8; l++) {
+    r[l] = _mm256_loadu_si256((const __m256i *)(p[l] + 32 * half));
+  }
+
+  for (int i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+  }
+  for (int i = 0; i < 8; i += 4) {
+    u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+  for (int i = 0; i < 4; i++) {
+    out[i] = _mm256_shuffle_epi8(
+        _mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+    out[i + 4] = _mm256_shuffle_epi8(
+        _mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+  }
+}
+
+// Hashes up to SHA1_LANES messages at once, lane `l` working on message `l`.
+// Lanes whose message ran out of blocks keep their state untouched.
+__attribute__((target("avx2"))) void
+sha1_many_avx2(const uint8_t *const *data, const size_t *len, size_t n,
+               uint8_t (*out)[SHA1_DIGEST_LEN]) {
+  static const uint8_t zero[SHA1_BLOCK_LEN];
+  uint8_t tail[SHA1_LANES][2 * SHA1_BLOCK_LEN];
+  size_t full[SHA1_LANES];
+  int32_t nblocks[SHA1_LANES] = {0};
+  size_t max_blocks = 0;
+
+  for (size_t l = 0; l < n; l++) {
+    full[l] = len[l] / SHA1_BLOCK_LEN;
+    size_t rem = len[l] % SHA1_BLOCK_LEN;
+    memcpy(tail[l], data[l] + full[l] * SHA1_BLOCK_LEN, rem);
+    nblocks[l] = full[l] + sha1_pad(tail[l], rem, len[l]);
+    if ((size_t)nblocks[l] > max_blocks) {
+      max_blocks = nblocks[l];
+    }
+  }
+
+  __m256i h[5];
+  for (int i = 0; i < 5; i++) {
+    h[i] = _mm256_set1_epi32(sha1_iv[i]);
+  }
+  const __m256i lane_blocks = _mm256_loadu_si256((const __m256i *)nblocks);
+
+  for (size_t b = 0; b < max_blocks; b++) {
+    const uint8_t *p[SHA1_LANES];
+    for (size_t l = 0; l < SHA1_LANES; l++) {
+      if (l >= n || b >= (size_t)nblocks[l]) {
+        p[l] = zero;
+      } else if (b < full[l]) {
+        p[l] = data[l] + b * SHA1_BLOCK_LEN;
+      } else {
+        p[l] = tail[l] + (b - full[l]) * SHA1_BLOCK_LEN;
+      }
+    }
+
+    __m256i W[16];
+    avx2_load_words(p, 0, W);
+    avx2_load_words(p, 1, W + 8);
+
+    __m256i a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+    for (int t = 0; t < 80; t++) {
+      if (t >= 16) {
+        __m256i w = _mm256_xor_si256(
+            _mm256_xor_si256(W[(t - 3) & 15], W[(t - 8) & 15]),
+            _mm256_xor_si256(W[(t - 14) & 15], W[t & 15]));
+        W[t & 15] = AVX2_ROTL(w, 1);
+      }
+
+      __m256i f, k;
+      if (t < 20) {
+        f = _mm256_xor_si256(d, _mm256_and_si256(bb, _mm256_xor_si256(c, d)));
+        k = _mm256_set1_epi32(0x5A827999);
+      } else if (t < 40) {
+        f = _mm256_xor_si256(_mm256_xor_si256(bb, c), d);
+        k = _mm256_set1_epi32(0x6ED9EBA1);
+      } else if (t < 60) {
+        f = _mm256_or_si256(_mm256_and_si256(bb, c),
+                            _mm256_and_si256(d, _mm256_or_si256(bb, c)));
+        k = _mm256_set1_epi32(0x8F1BBCDC);
+      } else {
+        f = _mm256_xor_si256(_mm256_xor_si256(bb, c), d);
+        k = _mm256_set1_epi32(0xCA62C1D6);
+      }
+
+      __m256i tmp = _mm256_add_epi32(
+          _mm256_add_epi32(AVX2_ROTL(a, 5), f),
+          _mm256_add_epi32(_mm256_add_epi32(e, k), W[t & 15]));
+      e = d;
+      d = c;
+      c = AVX2_ROTL(bb, 30);
+      bb = a;
+      a = tmp;
+    }
+
+    __m256i active =
+        _mm256_cmpgt_epi32(lane_blocks, _mm256_set1_epi32((int32_t)b));
+    h[0] = _mm256_blendv_epi8(h[0], _mm256_add_epi32(h[0], a), active);
+    h[1] = _mm256_blendv_epi8(h[1], _mm256_add_epi32(h[1], bb), active);
+    h[2] = _mm256_blendv_epi8(h[2], _mm256_add_epi32(h[2], c), active);
+    h[3] = _mm256_blendv_epi8(h[3], _mm256_add_epi32(h[3], d), active);
+    h[4] = _mm256_blendv_epi8(h[4], _mm256_add_epi32(h[4], e), active);
+  }
+
+  uint32_t lanes[5][SHA1_LANES];
+  for (int i = 0; i < 5; i++) {
+    _mm256_storeu_si256((__m256i *)lanes[i], h[i]);
+  }
+  for (size_t l = 0; l < n; l++) {
+    for (int i = 0; i < 5; i++) {
+      store_be32(out[l] + 4 * i, lanes[i][l]);
+    }
+  }
+}
+
+void sha1_detect_cpu(void) {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return;
+  }
+  bool ssse3 = ecx & bit_SSSE3;
+  bool sse41 = ecx & bit_SSE4_1;
+  bool osxsave = ecx & bit_OSXSAVE;
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return;
+  }
+  sha1_has_shani = ssse3 && sse41 && (ebx & bit_SHA);
+
+  // AVX2 also needs the OS to save the upper halves of the registers
+  if (osxsave && (ebx & bit_AVX2)) {
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    sha1_has_avx2 = (xcr0_lo & 0x6) == 0x6;
+  }
+}
+
+#else
+
+void sha1_detect_cpu(void) {}
+
+#endif // SHA1_X86
+
+bool sha1_impl_supported(sha1_impl_t impl) {
+  switch (impl) {
+  case SHA1_IMPL_EVP:
+    return true;
+  case SHA1_IMPL_SHANI:
+    return sha1_has_shani;
+  default:
+    return false;
+  }
+}
+
+bool sha1_multi_supported(sha1_multi_t multi) {
+  switch (multi) {
+  case SHA1_MULTI_SERIAL:
+    return true;
+  case SHA1_MULTI_AVX2:
+    return sha1_has_avx2;
+  default:
+    return false;
+  }
+}
+
+const char *sha1_impl_name(sha1_impl_t impl) {
+  switch (impl) {
+  case SHA1_IMPL_EVP:
+    return "evp";
+  case SHA1_IMPL_SHANI:
+    return "sha-ni";
+  default:
+    return "unknown";
+  }
+}
+
+const char *sha1_multi_name(sha1_multi_t multi) {
+  switch (multi) {
+  case SHA1_MULTI_SERIAL:
+    return "serial";
+  case SHA1_MULTI_AVX2:
+    return "avx2-x8";
+  default:
+    return "unknown";
+  }
+}
+
+int sha1_engine_use(sha1_impl_t impl, sha1_multi_t multi) {
+  if (!sha1_engine_ready) {
+    sha1_engine_init();
+  }
+
+  if (!sha1_impl_supported(impl) || !sha1_multi_supported(multi)) {
+    return -1;
+  }
+
+  sha1_impl = impl;
+  sha1_multi = multi;
+#ifdef SHA1_X86
+  sha1_blocks = impl == SHA1_IMPL_SHANI ? sha1_blocks_shani : NULL;
+#endif
+  return 0;
+}
+
+sha1_impl_t sha1_engine_impl(void) { return sha1_impl; }
+
+sha1_multi_t sha1_engine_multi(void) { return sha1_multi; }
+
+void sha1_engine_init(void) {
+  if (sha1_engine_ready) {
+    return;
+  }
+  sha1_detect_cpu();
+  sha1_engine_ready = true;
+
+  // SHA-NI beats eight AVX2 lanes, which only pay off without it
+  sha1_engine_use(sha1_has_shani ? SHA1_IMPL_SHANI : SHA1_IMPL_EVP,
+                  sha1_has_shani || !sha1_has_avx2 ? SHA1_MULTI_SERIAL
+                                                   : SHA1_MULTI_AVX2);
+}
+
+int sha1_init(sha1_ctx_t *ctx) {
+  if (!sha1_engine_ready) {
+    sha1_engine_init();
+  }
+
+  ctx->evp = NULL;
+  ctx->len = 0;
+  memcpy(ctx->h, sha1_iv, sizeof(sha1_iv));
+
+  if (!sha1_blocks) {
+    ctx->evp = EVP_MD_CTX_new();
+    if (!ctx->evp || EVP_DigestInit_ex(ctx->evp, EVP_sha1(), NULL) != 1) {
+      EVP_MD_CTX_free(ctx->evp);
+      ctx->evp = NULL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void sha1_update(sha1_ctx_t *ctx, const void *data, size_t len) {
+  if (ctx->evp) {
+    EVP_DigestUpdate(ctx->evp, data, len);
+    return;
+  }
+
+  const uint8_t *p = data;
+  size_t buffered = ctx->len % SHA1_BLOCK_LEN;
+  ctx->len += len;
+
+  if (buffered > 0) {
+    size_t take = SHA1_BLOCK_LEN - buffered;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(ctx->buf + buffered, p, take);
+    p += take;
+    len -= take;
+    if (buffered + take < SHA1_BLOCK_LEN) {
+      return;
+    }
+    sha1_blocks(ctx->h, ctx->buf, 1);
+  }
+
+  sha1_blocks(ctx->h, p, len / SHA1_BLOCK_LEN);
+  p += len - len % SHA1_BLOCK_LEN;
+  memcpy(ctx->buf, p, len % SHA1_BLOCK_LEN);
+}
+
+void sha1_final(sha1_ctx_t *ctx, uint8_t out[SHA1_DIGEST_LEN]) {
+  if (ctx->evp) {
+    EVP_DigestFinal_ex(ctx->evp, out, NULL);
+    sha1_free(ctx);
+    return;
+  }
+
+  uint8_t tail[2 * SHA1_BLOCK_LEN];
+  size_t rem = ctx->len % SHA1_BLOCK_LEN;
+  memcpy(tail, ctx->buf, rem);
+  sha1_blocks(ctx->h, tail, sha1_pad(tail, rem, ctx->len));
+
+  for (int i = 0; i < 5; i++) {
+    store_be32(out + 4 * i, ctx->h[i]);
+  }
+}
+
+void sha1_free(sha1_ctx_t *ctx) {
+  EVP_MD_CTX_free(ctx->evp);
+  ctx->evp = NULL;
+}
+
+int sha1(const void *data, size_t len, uint8_t out[SHA1_DIGEST_LEN]) {
+  sha1_ctx_t ctx;
+  if (sha1_init(&ctx) < 0) {
+    return -1;
+  }
+
+  sha1_update(&ctx, data, len);
+  sha1_final(&ctx, out);
+  return 0;
+}
+
+int sha1_many(const uint8_t *const *data, const size_t *len, size_t n,
+              uint8_t (*out)[SHA1_DIGEST_LEN]) {
+  if (!sha1_engine_ready) {
+    sha1_engine_init();
+  }
+
+#ifdef SHA1_X86
+  if (sha1_multi == SHA1_MULTI_AVX2) {
+    for (size_t i = 0; i < n; i += SHA1_LANES) {
+      size_t lanes = n - i < SHA1_LANES ? n - i : SHA1_LANES;
+      sha1_many_avx2(data + i, len + i, lanes, out + i);
+    }
+    return 0;
+  }
+#endif
+
+  for (size_t i = 0; i < n; i++) {
+    if (sha1(data[i], len[i], out[i]) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
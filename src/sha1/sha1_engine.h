@@ -0,0 +1,64 @@
+#ifndef SHA1_ENGINE_H
+#define SHA1_ENGINE_H
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LEN 20
+#define SHA1_BLOCK_LEN 64
+// Messages sha1_many() hashes side by side
+#define SHA1_LANES 8
+
+typedef enum {
+  // OpenSSL's EVP, always available
+  SHA1_IMPL_EVP,
+  // x86 SHA extensions
+  SHA1_IMPL_SHANI,
+  SHA1_IMPL_MAX,
+} sha1_impl_t;
+
+typedef enum {
+  // One message after the other with the scalar implementation
+  SHA1_MULTI_SERIAL,
+  // SHA1_LANES messages at once in AVX2 registers
+  SHA1_MULTI_AVX2,
+  SHA1_MULTI_MAX,
+} sha1_multi_t;
+
+// Streaming hash. With the EVP implementation the work is done by `evp`,
+// otherwise by the selected block function on `h`, with `buf` holding what
+// does not fill a block yet.
+typedef struct {
+  EVP_MD_CTX *evp;
+  uint32_t h[5];
+  uint64_t len;
+  uint8_t buf[SHA1_BLOCK_LEN];
+} sha1_ctx_t;
+
+// Picks the fastest implementations the CPU supports. Called implicitly, but
+// not thread safe: call it once before starting threads that hash.
+void sha1_engine_init(void);
+bool sha1_impl_supported(sha1_impl_t impl);
+bool sha1_multi_supported(sha1_multi_t multi);
+// Overrides the automatic choice. Returns -1 if the CPU lacks support.
+int sha1_engine_use(sha1_impl_t impl, sha1_multi_t multi);
+sha1_impl_t sha1_engine_impl(void);
+sha1_multi_t sha1_engine_multi(void);
+const char *sha1_impl_name(sha1_impl_t impl);
+const char *sha1_multi_name(sha1_multi_t multi);
+
+int sha1_init(sha1_ctx_t *ctx);
+void sha1_update(sha1_ctx_t *ctx, const void *data, size_t len);
+// Also releases the context
+void sha1_final(sha1_ctx_t *ctx, uint8_t out[SHA1_DIGEST_LEN]);
+void sha1_free(sha1_ctx_t *ctx);
+int sha1(const void *data, size_t len, uint8_t out[SHA1_DIGEST_LEN]);
+
+// Hashes `n` independent messages, `data[i]` being `len[i]` bytes long. Fastest
+// when the messages have about the same length, like the pieces of a torrent.
+int sha1_many(const uint8_t *const *data, const size_t *len, size_t n,
+              uint8_t (*out)[SHA1_DIGEST_LEN]);
+
+#endif // SHA1_ENGINE_H
@@ -0,0 +1,92 @@
+#include "sha1_engine.h"
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity/unity.h>
+#include <unity/unity_internals.h>
+
+#define DATA_LEN (3 * 4096 + 77)
+
+uint8_t data[DATA_LEN];
+
+void setUp() {
+  srand(42);
+  for (size_t i = 0; i < DATA_LEN; i++) {
+    data[i] = rand();
+  }
+}
+
+void tearDown() { sha1_engine_init(); }
+
+// Lengths around every padding edge case plus a few multi-block ones
+const size_t lengths[] = {0,   1,   3,   55,  56,   63,   64,      65,
+                          119, 120, 127, 128, 1000, 4096, DATA_LEN};
+#define NUM_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+void test_every_impl_matches_openssl() {
+  for (sha1_impl_t impl = 0; impl < SHA1_IMPL_MAX; impl++) {
+    if (sha1_engine_use(impl, SHA1_MULTI_SERIAL) < 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i < NUM_LENGTHS; i++) {
+      uint8_t expected[SHA1_DIGEST_LEN], got[SHA1_DIGEST_LEN];
+      SHA1(data, lengths[i], expected);
+      TEST_ASSERT_EQUAL(0, sha1(data, lengths[i], got));
+      TEST_ASSERT_EQUAL_MEMORY(expected, got, SHA1_DIGEST_LEN);
+    }
+  }
+}
+
+void test_streaming_in_odd_chunks() {
+  for (sha1_impl_t impl = 0; impl < SHA1_IMPL_MAX; impl++) {
+    if (sha1_engine_use(impl, SHA1_MULTI_SERIAL) < 0) {
+      continue;
+    }
+
+    sha1_ctx_t ctx;
+    TEST_ASSERT_EQUAL(0, sha1_init(&ctx));
+    for (size_t off = 0, chunk = 1; off < DATA_LEN; chunk = chunk * 3 + 1) {
+      size_t len = chunk < DATA_LEN - off ? chunk : DATA_LEN - off;
+      sha1_update(&ctx, data + off, len);
+      off += len;
+    }
+
+    uint8_t expected[SHA1_DIGEST_LEN], got[SHA1_DIGEST_LEN];
+    sha1_final(&ctx, got);
+    SHA1(data, DATA_LEN, expected);
+    TEST_ASSERT_EQUAL_MEMORY(expected, got, SHA1_DIGEST_LEN);
+  }
+}
+
+void test_many_messages_of_different_lengths() {
+  // More messages than lanes, all ending at different blocks
+  const uint8_t *msgs[NUM_LENGTHS];
+  size_t lens[NUM_LENGTHS];
+  for (size_t i = 0; i < NUM_LENGTHS; i++) {
+    msgs[i] = data + i;
+    lens[i] = lengths[i] < DATA_LEN - i ? lengths[i] : DATA_LEN - i;
+  }
+
+  for (sha1_multi_t multi = 0; multi < SHA1_MULTI_MAX; multi++) {
+    if (sha1_engine_use(SHA1_IMPL_EVP, multi) < 0) {
+      continue;
+    }
+
+    uint8_t got[NUM_LENGTHS][SHA1_DIGEST_LEN];
+    TEST_ASSERT_EQUAL(0, sha1_many(msgs, lens, NUM_LENGTHS, got));
+    for (size_t i = 0; i < NUM_LENGTHS; i++) {
+      uint8_t expected[SHA1_DIGEST_LEN];
+      SHA1(msgs[i], lens[i], expected);
+      TEST_ASSERT_EQUAL_MEMORY(expected, got[i], SHA1_DIGEST_LEN);
+    }
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_impl_matches_openssl);
+  RUN_TEST(test_streaming_in_odd_chunks);
+  RUN_TEST(test_many_messages_of_different_lengths);
+  return UNITY_END();
+}
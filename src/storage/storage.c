@@ -0,0 +1,191 @@
+#include "storage.h"
+#include "../piece-request/piece_request.h"
+#include <assert.h>
+#include <string.h>
+
+storage_kind_t storage_kind = STORAGE_MMAP;
+
+const storage_backend_t *storage_backends[STORAGE_MAX] = {
+    [STORAGE_MMAP] = &storage_mmap_backend,
+    [STORAGE_PREAD] = &storage_pread_backend,
+    [STORAGE_MEMORY] = &storage_memory_backend,
+    [STORAGE_NULL] = &storage_null_backend,
+};
+
+void storage_use(storage_kind_t kind) {
+  assert(kind < STORAGE_MAX);
+  storage_kind = kind;
+}
+
+const storage_backend_t *storage_backend(void) {
+  return storage_backends[storage_kind];
+}
+
+const char *storage_kind_name(storage_kind_t kind) {
+  return kind < STORAGE_MAX ? storage_backends[kind]->name : "unknown";
+}
+
+storage_kind_t storage_kind_from_name(const char *name) {
+  for (storage_kind_t kind = 0; kind < STORAGE_MAX; kind++) {
+    if (strcmp(storage_backends[kind]->name, name) == 0) {
+      return kind;
+    }
+  }
+
+  return STORAGE_MAX;
+}
+
+// Every file of a torrent is on the same backend
+bool storage_mapped(const metainfo_t *torrent) {
+  return torrent->files[0]->backend->mapped;
+}
+
+bool storage_discards(const metainfo_t *torrent) {
+  return torrent->files[0]->backend->discards;
+}
+
+const uint8_t *storage_map(const metainfo_t *torrent, size_t offset,
+                           size_t len) {
+  if (!storage_mapped(torrent) || len == 0) {
+    return NULL;
+  }
+
+  size_t i = piece_request_file_at(torrent, offset);
+  if (offset + len > torrent->file_offsets[i + 1]) {
+    return NULL;
+  }
+
+  return torrent->files[i]->data + (offset - torrent->file_offsets[i]);
+}
+
+// Calls `fn` for every file span of bytes [offset, offset + len)
+int storage_for_spans(const metainfo_t *torrent, size_t offset, size_t len,
+                      int (*fn)(dl_file_t *file, size_t file_offset,
+                                size_t done, size_t len, void *ctx),
+                      void *ctx) {
+  if (len == 0) {
+    return 0;
+  }
+
+  if (offset + len > torrent->file_offsets[torrent->info.files_count]) {
+    return -1;
+  }
+
+  size_t done = 0;
+  for (size_t i = piece_request_file_at(torrent, offset); done < len; i++) {
+    dl_file_t *file = torrent->files[i];
+    size_t skip = offset + done - torrent->file_offsets[i];
+    if (skip >= file->size) {
+      continue;
+    }
+
+    size_t span = file->size - skip < len - done ? file->size - skip
+                                                 : len - done;
+    if (fn(file, skip, done, span, ctx) < 0) {
+      return -1;
+    }
+    done += span;
+  }
+
+  return 0;
+}
+
+int storage_read_span(dl_file_t *file, size_t file_offset, size_t done,
+                      size_t len, void *ctx) {
+  return dl_file_read(file, file_offset, (uint8_t *)ctx + done, len);
+}
+
+int storage_read(const metainfo_t *torrent, size_t offset, void *buf,
+                 size_t len) {
+  return storage_for_spans(torrent, offset, len, storage_read_span, buf);
+}
+
+int storage_write_span(dl_file_t *file, size_t file_offset, size_t done,
+                       size_t len, void *ctx) {
+  return dl_file_write(file, file_offset, (const uint8_t *)ctx + done, len);
+}
+
+int storage_write(const metainfo_t *torrent, size_t offset, const void *buf,
+                  size_t len) {
+  return storage_for_spans(torrent, offset, len, storage_write_span,
+                           (void *)buf);
+}
+
+int storage_advise_span(dl_file_t *file, size_t file_offset, size_t done,
+                        size_t len, void *ctx) {
+  (void)done;
+  (void)ctx;
+  return dl_file_advise(file, file_offset, len);
+}
+
+int storage_advise(const metainfo_t *torrent, size_t offset, size_t len) {
+  return storage_for_spans(torrent, offset, len, storage_advise_span, NULL);
+}
+
+typedef struct {
+  uint8_t *buf;
+  storage_span_t *spans;
+  size_t max;
+  size_t len;
+} storage_fd_spans_t;
+
+int storage_fd_span(dl_file_t *file, size_t file_offset, size_t done,
+                    size_t len, void *ctx) {
+  storage_fd_spans_t *out = ctx;
+  if (out->len == out->max) {
+    return -1;
+  }
+
+  out->spans[out->len++] = (storage_span_t){
+      .fd = file->fd,
+      .offset = file_offset,
+      .buf = out->buf + done,
+      .len = len,
+  };
+  return 0;
+}
+
+int storage_fd_spans(const metainfo_t *torrent, size_t offset, size_t len,
+                     void *buf, storage_span_t *spans, size_t max) {
+  if (!torrent->files[0]->backend->fd_io) {
+    return -1;
+  }
+
+  storage_fd_spans_t out = {
+      .buf = buf,
+      .spans = spans,
+      .max = max,
+      .len = 0,
+  };
+  if (storage_for_spans(torrent, offset, len, storage_fd_span, &out) < 0) {
+    return -1;
+  }
+
+  return out.len;
+}
+
+int storage_hash_span(dl_file_t *file, size_t file_offset, size_t done,
+                      size_t len, void *ctx) {
+  (void)done;
+  sha1_ctx_t *sha = ctx;
+  if (file->backend->mapped) {
+    sha1_update(sha, file->data + file_offset, len);
+    return 0;
+  }
+
+  uint8_t chunk[STORAGE_HASH_CHUNK];
+  for (size_t off = 0; off < len; off += STORAGE_HASH_CHUNK) {
+    size_t n = len - off < STORAGE_HASH_CHUNK ? len - off : STORAGE_HASH_CHUNK;
+    if (dl_file_read(file, file_offset + off, chunk, n) < 0) {
+      return -1;
+    }
+    sha1_update(sha, chunk, n);
+  }
+
+  return 0;
+}
+
+int storage_hash(const metainfo_t *torrent, size_t offset, size_t len,
+                 sha1_ctx_t *ctx) {
+  return storage_for_spans(torrent, offset, len, storage_hash_span, ctx);
+}
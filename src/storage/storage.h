@@ -0,0 +1,76 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "../dl-file/dl_file.h"
+#include "../file-parser/file-parser.h"
+#include "../sha1/sha1_engine.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Chunk size for hashing data that is not mapped in memory
+#define STORAGE_HASH_CHUNK (64 * 1024)
+// The pread backend starts writeback of a file every time this much was
+// written to it, instead of leaving it all for the kernel to flush at once
+#define STORAGE_WRITEBACK_CHUNK (4 * 1024 * 1024)
+
+typedef enum {
+  // MAP_SHARED mapping of the file, the default
+  STORAGE_MMAP,
+  // pread/pwrite on the file, writeback is started explicitly
+  STORAGE_PREAD,
+  // Kept in memory only, lost on exit
+  STORAGE_MEMORY,
+  // Discards everything, to measure the network path alone
+  STORAGE_NULL,
+  STORAGE_MAX,
+} storage_kind_t;
+
+// Bytes of a torrent within one of its files, see storage_fd_spans()
+typedef struct {
+  int fd;
+  size_t offset;
+  uint8_t *buf;
+  size_t len;
+} storage_span_t;
+
+extern const storage_backend_t storage_mmap_backend;
+extern const storage_backend_t storage_pread_backend;
+extern const storage_backend_t storage_memory_backend;
+extern const storage_backend_t storage_null_backend;
+
+// Backend the files of torrents parsed from now on are opened with
+void storage_use(storage_kind_t kind);
+const storage_backend_t *storage_backend(void);
+const char *storage_kind_name(storage_kind_t kind);
+// Returns STORAGE_MAX if there is no backend called `name`
+storage_kind_t storage_kind_from_name(const char *name);
+
+// Whether the torrent's data is in memory, so blocks can be sent and
+// received in place (see piece_request_spans())
+bool storage_mapped(const metainfo_t *torrent);
+// Whether the torrent's backend throws the data away
+bool storage_discards(const metainfo_t *torrent);
+// Address of bytes [offset, offset + len) of the torrent if they are mapped
+// and in a single file, NULL otherwise
+const uint8_t *storage_map(const metainfo_t *torrent, size_t offset,
+                           size_t len);
+// Bytes [offset, offset + len) of the torrent, across file boundaries
+int storage_read(const metainfo_t *torrent, size_t offset, void *buf,
+                 size_t len);
+int storage_write(const metainfo_t *torrent, size_t offset, const void *buf,
+                  size_t len);
+// Starts reading bytes [offset, offset + len) of the torrent in ahead of
+// time, where the backend supports it
+int storage_advise(const metainfo_t *torrent, size_t offset, size_t len);
+// Splits bytes [offset, offset + len) of the torrent, to be read into or
+// written from `buf`, into at most `max` spans on the files' descriptors.
+// Returns the number of spans, or -1 if the backend is not `fd_io` or more
+// spans are needed.
+int storage_fd_spans(const metainfo_t *torrent, size_t offset, size_t len,
+                     void *buf, storage_span_t *spans, size_t max);
+// Feeds bytes [offset, offset + len) of the torrent to `ctx`
+int storage_hash(const metainfo_t *torrent, size_t offset, size_t len,
+                 sha1_ctx_t *ctx);
+
+#endif // STORAGE_H
@@ -0,0 +1,27 @@
+#include "storage.h"
+#include <stdlib.h>
+
+int storage_memory_open(dl_file_t *file) {
+  file->fresh = true;
+  if (file->size == 0) {
+    return 0;
+  }
+
+  file->data = calloc(file->size, 1);
+  return file->data ? 0 : -1;
+}
+
+int storage_memory_sync(dl_file_t *file) {
+  (void)file;
+  return 0;
+}
+
+void storage_memory_close(dl_file_t *file) { free(file->data); }
+
+const storage_backend_t storage_memory_backend = {
+    .name = "memory",
+    .mapped = true,
+    .open = storage_memory_open,
+    .sync = storage_memory_sync,
+    .close = storage_memory_close,
+};
@@ -0,0 +1,55 @@
+#include "storage.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+int storage_mmap_open(dl_file_t *file) {
+  int fd = dl_file_open_fd(file);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // Nothing to map, and mmap() refuses empty lengths
+  if (file->size > 0) {
+    void *mem = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0);
+    if (mem == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    file->data = mem;
+  }
+
+  close(fd);
+  return 0;
+}
+
+int storage_mmap_sync(dl_file_t *file) {
+  if (file->size == 0) {
+    return 0;
+  }
+
+  return msync(file->data, file->size, MS_SYNC);
+}
+
+// madvise() wants a page aligned start
+int storage_mmap_advise(dl_file_t *file, size_t offset, size_t len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = offset & ~(page - 1);
+  return madvise(file->data + start, offset + len - start, MADV_WILLNEED);
+}
+
+void storage_mmap_close(dl_file_t *file) {
+  if (file->size > 0) {
+    munmap(file->data, file->size);
+  }
+}
+
+const storage_backend_t storage_mmap_backend = {
+    .name = "mmap",
+    .mapped = true,
+    .persistent = true,
+    .open = storage_mmap_open,
+    .sync = storage_mmap_sync,
+    .advise = storage_mmap_advise,
+    .close = storage_mmap_close,
+};
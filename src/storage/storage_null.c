@@ -0,0 +1,40 @@
+#include "storage.h"
+#include <string.h>
+
+int storage_null_open(dl_file_t *file) {
+  file->fresh = true;
+  return 0;
+}
+
+int storage_null_read(dl_file_t *file, size_t offset, void *buf, size_t len) {
+  (void)file;
+  (void)offset;
+  memset(buf, 0, len);
+  return 0;
+}
+
+int storage_null_write(dl_file_t *file, size_t offset, const void *buf,
+                       size_t len) {
+  (void)file;
+  (void)offset;
+  (void)buf;
+  (void)len;
+  return 0;
+}
+
+int storage_null_sync(dl_file_t *file) {
+  (void)file;
+  return 0;
+}
+
+void storage_null_close(dl_file_t *file) { (void)file; }
+
+const storage_backend_t storage_null_backend = {
+    .name = "null",
+    .discards = true,
+    .open = storage_null_open,
+    .read = storage_null_read,
+    .write = storage_null_write,
+    .sync = storage_null_sync,
+    .close = storage_null_close,
+};
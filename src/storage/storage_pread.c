@@ -0,0 +1,89 @@
+#define _GNU_SOURCE // sync_file_range
+#include "storage.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int storage_pread_open(dl_file_t *file) {
+  file->fd = dl_file_open_fd(file);
+  return file->fd < 0 ? -1 : 0;
+}
+
+int storage_pread_read(dl_file_t *file, size_t offset, void *buf,
+                       size_t len) {
+  while (len > 0) {
+    ssize_t n = pread(file->fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    buf = (uint8_t *)buf + n;
+    offset += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+// Every STORAGE_WRITEBACK_CHUNK written, starts writing the file back
+// without waiting for it. The kernel would otherwise collect dirty pages of
+// all files and flush them in one burst.
+void storage_pread_writeback(dl_file_t *file, size_t len) {
+  size_t dirty = __atomic_add_fetch(&file->dirty, len, __ATOMIC_RELAXED);
+  if (dirty < STORAGE_WRITEBACK_CHUNK) {
+    return;
+  }
+
+  if (__atomic_compare_exchange_n(&file->dirty, &dirty, 0, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    sync_file_range(file->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+}
+
+int storage_pread_write(dl_file_t *file, size_t offset, const void *buf,
+                        size_t len) {
+  size_t total = len;
+  while (len > 0) {
+    ssize_t n = pwrite(file->fd, buf, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+
+    buf = (const uint8_t *)buf + n;
+    offset += n;
+    len -= n;
+  }
+
+  storage_pread_writeback(file, total);
+  return 0;
+}
+
+int storage_pread_sync(dl_file_t *file) {
+  __atomic_store_n(&file->dirty, 0, __ATOMIC_RELAXED);
+  return fdatasync(file->fd);
+}
+
+int storage_pread_advise(dl_file_t *file, size_t offset, size_t len) {
+  return posix_fadvise(file->fd, offset, len, POSIX_FADV_WILLNEED) == 0 ? 0
+                                                                        : -1;
+}
+
+void storage_pread_close(dl_file_t *file) { close(file->fd); }
+
+const storage_backend_t storage_pread_backend = {
+    .name = "pread",
+    .persistent = true,
+    .fd_io = true,
+    .open = storage_pread_open,
+    .read = storage_pread_read,
+    .write = storage_pread_write,
+    .sync = storage_pread_sync,
+    .advise = storage_pread_advise,
+    .close = storage_pread_close,
+};
@@ -0,0 +1,110 @@
+#include "storage.h"
+#include "../log/log.h"
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <unity/unity.h>
+#include <unity/unity_internals.h>
+
+#define NUM_FILES 4
+
+// Files of 100, 0, 50 and 10 bytes
+size_t lengths[NUM_FILES] = {100, 0, 50, 10};
+uint8_t data[160];
+metainfo_t torrent;
+
+void open_torrent(const storage_backend_t *backend) {
+  torrent.files = calloc(NUM_FILES + 1, sizeof(dl_file_t *));
+  size_t offset = 0;
+  for (size_t i = 0; i < NUM_FILES; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/storage_test_%d_%zu", getpid(), i);
+    torrent.files[i] = dl_file_create_and_open(backend, lengths[i], path);
+    TEST_ASSERT_NOT_NULL(torrent.files[i]);
+    torrent.file_offsets[i] = offset;
+    offset += lengths[i];
+  }
+  torrent.file_offsets[NUM_FILES] = offset;
+}
+
+void setUp() {
+  memset(&torrent, 0, sizeof(torrent));
+  torrent.info.files_count = NUM_FILES;
+  torrent.info.piece_length = 64;
+  torrent.info.length = sizeof(data);
+  torrent.file_offsets = malloc((NUM_FILES + 1) * sizeof(size_t));
+
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = rand();
+  }
+}
+
+void tearDown() {
+  for (size_t i = 0; torrent.files && i < NUM_FILES; i++) {
+    if (torrent.files[i]->backend->persistent) {
+      unlink(torrent.files[i]->path);
+    }
+    dl_file_close_and_free(torrent.files[i]);
+  }
+  free(torrent.files);
+  free(torrent.file_offsets);
+}
+
+void test_backends_read_back_across_files() {
+  const storage_backend_t *backends[] = {&storage_mmap_backend,
+                                         &storage_pread_backend,
+                                         &storage_memory_backend};
+  for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+    open_torrent(backends[b]);
+
+    // Written in pieces of 64 bytes, read back in one go
+    for (size_t off = 0; off < sizeof(data); off += 64) {
+      size_t len = sizeof(data) - off < 64 ? sizeof(data) - off : 64;
+      TEST_ASSERT_EQUAL(0, storage_write(&torrent, off, data + off, len));
+    }
+    uint8_t got[sizeof(data)];
+    TEST_ASSERT_EQUAL(0, storage_read(&torrent, 0, got, sizeof(got)));
+    TEST_ASSERT_EQUAL_MEMORY(data, got, sizeof(data));
+    TEST_ASSERT_EQUAL(backends[b]->mapped,
+                      storage_map(&torrent, 100, 50) != NULL);
+
+    tearDown();
+    setUp();
+  }
+}
+
+void test_hash_matches_data() {
+  open_torrent(&storage_pread_backend);
+  TEST_ASSERT_EQUAL(0, storage_write(&torrent, 0, data, sizeof(data)));
+
+  sha1_ctx_t ctx;
+  uint8_t expected[SHA1_DIGEST_LEN], got[SHA1_DIGEST_LEN];
+  TEST_ASSERT_EQUAL(0, sha1_init(&ctx));
+  TEST_ASSERT_EQUAL(0, storage_hash(&torrent, 64, 96, &ctx));
+  sha1_final(&ctx, got);
+  SHA1(data + 64, 96, expected);
+  TEST_ASSERT_EQUAL_MEMORY(expected, got, SHA1_DIGEST_LEN);
+}
+
+void test_null_discards_writes() {
+  open_torrent(&storage_null_backend);
+  TEST_ASSERT_TRUE(storage_discards(&torrent));
+  TEST_ASSERT_EQUAL(0, storage_write(&torrent, 0, data, sizeof(data)));
+
+  uint8_t got[sizeof(data)], zero[sizeof(data)] = {0};
+  TEST_ASSERT_EQUAL(0, storage_read(&torrent, 0, got, sizeof(got)));
+  TEST_ASSERT_EQUAL_MEMORY(zero, got, sizeof(got));
+  TEST_ASSERT_EQUAL(-1, storage_read(&torrent, 100, got, 61));
+}
+
+int main() {
+  log_set_logfile(stderr);
+  log_set_lvl(LOG_ERROR);
+  UNITY_BEGIN();
+  RUN_TEST(test_backends_read_back_across_files);
+  RUN_TEST(test_hash_matches_data);
+  RUN_TEST(test_null_discards_writes);
+  return UNITY_END();
+}
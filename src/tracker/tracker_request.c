@@ -1,5 +1,6 @@
 #include "tracker_request.h"
 #include "tracker_announce.h"
+#include "../peer-listener/peer_listener.h"
 #include <string.h>
 
 size_t multi_left(info_t info) {
@@ -29,7 +30,7 @@ tracker_request_t *build_tracker_announce_request(metainfo_t *metainfo) {
     req->left = multi_left(metainfo->info);
     break;
   }
-  req->port = 6889;
+  req->port = listen_port;
   req->uploaded = 0;
   req->downloaded = 0;
   SET_FLAG(req, COMPACT);
@@ -0,0 +1,141 @@
+#include "uring.h"
+#include "../log/log.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool uring_on = false;
+
+void uring_use(bool enable) { uring_on = enable; }
+
+bool uring_enabled(void) { return uring_on; }
+
+int uring_init(uring_t *u, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0) {
+    log_printf(LOG_WARNING, "Could not set up io_uring: %s\n",
+               strerror(errno));
+    return -1;
+  }
+
+  u->entries = p.sq_entries;
+  u->queued = 0;
+  u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  // Older kernels map the two rings separately
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && u->cq_ring_len > u->sq_ring_len) {
+    u->sq_ring_len = u->cq_ring_len;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    goto fail_sq;
+  }
+
+  u->cq_ring = u->sq_ring;
+  if (!single) {
+    u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      goto fail_cq;
+    }
+  }
+
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    goto fail_sqes;
+  }
+
+  u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+  u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+  return 0;
+
+fail_sqes:
+  if (!single) {
+    munmap(u->cq_ring, u->cq_ring_len);
+  }
+fail_cq:
+  munmap(u->sq_ring, u->sq_ring_len);
+fail_sq:
+  close(u->fd);
+  log_printf(LOG_WARNING, "Could not map io_uring rings\n");
+  return -1;
+}
+
+void uring_free(uring_t *u) {
+  munmap(u->sqes, u->sqes_len);
+  if (u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_len);
+  }
+  munmap(u->sq_ring, u->sq_ring_len);
+  close(u->fd);
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail + u->queued;
+  if (tail - head >= u->entries) {
+    return NULL;
+  }
+
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+  u->queued++;
+  return sqe;
+}
+
+int uring_submit(uring_t *u, unsigned wait) {
+  // The entries are written before the kernel sees the new tail
+  __atomic_store_n(u->sq_tail, *u->sq_tail + u->queued, __ATOMIC_RELEASE);
+  unsigned to_submit = u->queued;
+  u->queued = 0;
+
+  while (to_submit > 0 || wait > 0) {
+    int ret = syscall(__NR_io_uring_enter, u->fd, to_submit, wait,
+                      wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      log_printf(LOG_ERROR, "io_uring_enter failed: %s\n", strerror(errno));
+      return -1;
+    }
+
+    to_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && tail - *u->cq_head >= wait) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_seen(uring_t *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Entries of the rings of the reactors and of the disk threads
+#define URING_ENTRIES 256
+
+// An io_uring set up with the raw syscalls. Entries are queued with
+// uring_sqe() and all go to the kernel with the next uring_submit(), one
+// io_uring_enter() for the whole batch.
+//
+// Only peer sends (src/reactor) and the reads and writes of the pread
+// backend (src/disk-io) go through rings. Accept, connect and receive stay
+// on epoll readiness: blocks are received straight into write cache entries
+// or mapped storage, which registered buffers cannot cover, and accepts and
+// connects are too rare to batch.
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  // Entries queued since the last submit
+  unsigned queued;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  size_t sqes_len;
+} uring_t;
+
+// Whether rings are set up from now on, off by default
+void uring_use(bool enable);
+bool uring_enabled(void);
+
+// Fails if the kernel does not support io_uring, or does not allow it
+int uring_init(uring_t *u, unsigned entries);
+void uring_free(uring_t *u);
+// A cleared entry to fill in, NULL if the batch is full and has to be
+// submitted first
+struct io_uring_sqe *uring_sqe(uring_t *u);
+// Submits the queued entries and waits until `wait` completions are in
+int uring_submit(uring_t *u, unsigned wait);
+// The oldest completion not seen yet, NULL if there is none
+struct io_uring_cqe *uring_cqe(uring_t *u);
+void uring_seen(uring_t *u);
+
+#endif // URING_H
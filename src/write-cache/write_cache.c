@@ -0,0 +1,228 @@
+#include "write_cache.h"
+#include "../disk-io/disk_io.h"
+#include "../log/log.h"
+#include "../piece-picker/piece_picker.h"
+#include "../storage/storage.h"
+#include <stdlib.h>
+
+size_t write_cache_budget = WRITE_CACHE_DEFAULT_BUDGET;
+
+void write_cache_set_budget(size_t budget) { write_cache_budget = budget; }
+
+write_cache_t *write_cache_create(size_t num_pieces) {
+  if (write_cache_budget == 0) {
+    return NULL;
+  }
+
+  write_cache_t *cache = malloc(sizeof(write_cache_t));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->entries = calloc(num_pieces, sizeof(write_cache_entry_t *));
+  cache->bypass = calloc(num_pieces, 1);
+  if (!cache->entries || !cache->bypass) {
+    free(cache->entries);
+    free(cache->bypass);
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->written, NULL);
+  cache->budget = write_cache_budget;
+  cache->used = 0;
+  cache->flushed = 0;
+  cache->bypassed = 0;
+  return cache;
+}
+
+// Called with the cache locked
+void write_cache_unref(write_cache_entry_t *entry) {
+  if (--entry->refs > 0) {
+    return;
+  }
+
+  entry->cache->used -= entry->len;
+  free(entry->data);
+  free(entry);
+}
+
+// Called with the cache locked
+write_cache_entry_t *write_cache_create_entry(const metainfo_t *torrent,
+                                              uint32_t piece) {
+  write_cache_t *cache = torrent->write_cache;
+  size_t len = piece_picker_piece_len(torrent->sh.picker, piece);
+  if (cache->used + len > cache->budget) {
+    return NULL;
+  }
+
+  write_cache_entry_t *entry = malloc(sizeof(write_cache_entry_t));
+  if (!entry) {
+    return NULL;
+  }
+  entry->data = malloc(len);
+  if (!entry->data) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->cache = cache;
+  entry->piece = piece;
+  entry->len = len;
+  entry->refs = 1;
+  entry->writers = 0;
+  entry->sealed = false;
+  cache->used += len;
+  cache->entries[piece] = entry;
+  return entry;
+}
+
+write_cache_entry_t *write_cache_get(const metainfo_t *torrent, uint32_t piece,
+                                     bool create) {
+  write_cache_t *cache = torrent->write_cache;
+  if (!cache) {
+    return NULL;
+  }
+
+  // Checked under the lock: piece_verified() marks the piece as had before
+  // it discards the piece, so a late block cannot bring it back for good
+  pthread_mutex_lock(&cache->lock);
+  write_cache_entry_t *entry = cache->entries[piece];
+  if (!entry && create && !cache->bypass[piece] &&
+      piece_state_get(torrent, piece) != PIECE_STATE_HAVE) {
+    entry = write_cache_create_entry(torrent, piece);
+    if (!entry) {
+      cache->bypass[piece] = true;
+      cache->bypassed++;
+    }
+  }
+  if (entry) {
+    entry->refs++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+void write_cache_put(write_cache_entry_t *entry) {
+  write_cache_t *cache = entry->cache;
+  pthread_mutex_lock(&cache->lock);
+  write_cache_unref(entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+bool write_cache_begin_write(write_cache_entry_t *entry) {
+  write_cache_t *cache = entry->cache;
+  pthread_mutex_lock(&cache->lock);
+  bool writable = !entry->sealed;
+  if (writable) {
+    entry->writers++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return writable;
+}
+
+void write_cache_end_write(write_cache_entry_t *entry) {
+  write_cache_t *cache = entry->cache;
+  pthread_mutex_lock(&cache->lock);
+  if (--entry->writers == 0 && entry->sealed) {
+    pthread_cond_broadcast(&cache->written);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Takes the piece out of the cache, handing its reference to the caller.
+// Waits for copies into the entry already underway, none start after.
+write_cache_entry_t *write_cache_remove(write_cache_t *cache, uint32_t piece) {
+  pthread_mutex_lock(&cache->lock);
+  write_cache_entry_t *entry = cache->entries[piece];
+  cache->entries[piece] = NULL;
+  cache->bypass[piece] = false;
+  if (entry) {
+    entry->sealed = true;
+    while (entry->writers > 0) {
+      pthread_cond_wait(&cache->written, &cache->lock);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+// The entry stays allocated, and counted against the budget, until it is
+// written
+void write_cache_written(const disk_job_t *job, int ret) {
+  write_cache_entry_t *entry = job->ctx;
+  write_cache_t *cache = entry->cache;
+  if (ret < 0) {
+    log_printf(LOG_ERROR, "Could not write piece %u to storage\n",
+               entry->piece);
+  }
+
+  write_cache_flushed_fn done = entry->flushed;
+  uint32_t piece = entry->piece;
+  pthread_mutex_lock(&cache->lock);
+  cache->flushed++;
+  write_cache_unref(entry);
+  pthread_mutex_unlock(&cache->lock);
+
+  done(job->torrent, piece, ret);
+}
+
+void write_cache_flush(metainfo_t *torrent, uint32_t piece,
+                       write_cache_flushed_fn done) {
+  write_cache_entry_t *entry =
+      torrent->write_cache ? write_cache_remove(torrent->write_cache, piece)
+                           : NULL;
+  if (!entry) {
+    done(torrent, piece, 0);
+    return;
+  }
+
+  entry->flushed = done;
+  disk_job_t job = {
+      .torrent = torrent,
+      .op = DISK_OP_WRITE,
+      .offset = (size_t)piece * torrent->info.piece_length,
+      .len = entry->len,
+      .buf = entry->data,
+      .done = write_cache_written,
+      .ctx = entry,
+  };
+  disk_io_submit(&job);
+}
+
+void write_cache_discard(write_cache_t *cache, uint32_t piece) {
+  if (!cache) {
+    return;
+  }
+
+  write_cache_entry_t *entry = write_cache_remove(cache, piece);
+  if (entry) {
+    write_cache_put(entry);
+  }
+}
+
+void write_cache_bypass(write_cache_t *cache, uint32_t piece) {
+  if (!cache) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  cache->bypass[piece] = true;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+bool write_cache_holds(write_cache_t *cache, uint32_t piece) {
+  if (!cache) {
+    return false;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  bool holds = cache->entries[piece] != NULL;
+  pthread_mutex_unlock(&cache->lock);
+
+  return holds;
+}
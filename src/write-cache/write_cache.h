@@ -0,0 +1,84 @@
+#ifndef WRITE_CACHE_H
+#define WRITE_CACHE_H
+
+#include "../file-parser/file-parser.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRITE_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+typedef void (*write_cache_flushed_fn)(metainfo_t *torrent, uint32_t piece,
+                                       int ret);
+
+// A piece being downloaded into memory. Blocks are received straight into
+// `data` and the piece is hashed from there. `refs` counts the users of
+// `data`, plus one while the entry is in the cache: an entry dropped while
+// a connection is still receiving into it is freed once that is done.
+//
+// Connections copy into `data` between write_cache_begin_write() and
+// write_cache_end_write(), counted by `writers`. Once the entry leaves the
+// cache it is `sealed` and its data no longer changes: what is written back
+// is exactly what was verified.
+typedef struct write_cache_entry {
+  struct write_cache *cache;
+  uint32_t piece;
+  size_t len;
+  uint8_t *data;
+  unsigned refs;
+  unsigned writers;
+  bool sealed;
+  // Called once the entry is written back
+  write_cache_flushed_fn flushed;
+} write_cache_entry_t;
+
+// Write-back cache of the pieces being downloaded. A verified piece is
+// written to storage with one write per file it spans, a failed one is
+// dropped without ever touching the disk.
+//
+// Once any block of a piece went to storage, because the cache was full or
+// it was there from an earlier run, the whole piece `bypass`es the cache
+// until it is verified. Its data is never split between the two.
+typedef struct write_cache {
+  pthread_mutex_t lock;
+  // Signalled when the last writer of a sealed entry is done
+  pthread_cond_t written;
+  size_t budget;
+  size_t used;
+  write_cache_entry_t **entries;
+  uint8_t *bypass;
+  size_t flushed;
+  size_t bypassed;
+} write_cache_t;
+
+// Budget of the caches created from now on, 0 disables them
+void write_cache_set_budget(size_t budget);
+// Returns NULL, meaning no cache, if the budget is 0
+write_cache_t *write_cache_create(size_t num_pieces);
+
+// Every function below takes a NULL cache as one that holds nothing.
+
+// The piece's entry with a reference taken, or NULL if the piece bypasses
+// the cache. With `create`, a piece not cached yet gets an entry if the
+// budget allows it and bypasses the cache otherwise.
+write_cache_entry_t *write_cache_get(const metainfo_t *torrent, uint32_t piece,
+                                     bool create);
+void write_cache_put(write_cache_entry_t *entry);
+// Returns false, and the caller drops what it was about to copy, if the
+// entry was sealed. Otherwise the data may be written until
+// write_cache_end_write(), which is not to wait on anything in between.
+bool write_cache_begin_write(write_cache_entry_t *entry);
+void write_cache_end_write(write_cache_entry_t *entry);
+// Drops a verified piece from the cache and queues it to be written to
+// storage. `done` runs once it is written, from a disk thread, or right away
+// if the piece was not cached.
+void write_cache_flush(metainfo_t *torrent, uint32_t piece,
+                       write_cache_flushed_fn done);
+// Drops a piece that failed verification, it is downloaded again
+void write_cache_discard(write_cache_t *cache, uint32_t piece);
+// The piece has blocks in storage, e.g. from an earlier run
+void write_cache_bypass(write_cache_t *cache, uint32_t piece);
+bool write_cache_holds(write_cache_t *cache, uint32_t piece);
+
+#endif // WRITE_CACHE_H